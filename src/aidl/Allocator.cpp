@@ -7,6 +7,8 @@
 
 #include "Allocator.h"
 
+#include <inttypes.h>
+
 #include <aidl/android/hardware/graphics/allocator/AllocationError.h>
 #include <aidlcommonsupport/NativeHandle.h>
 #include <android-base/logging.h>
@@ -37,16 +39,39 @@ ndk::ScopedAStatus convertToGBMDesc(const BufferDescriptorInfo& info, gralloc_bu
     outResult->width = static_cast<uint32_t>(info.width);
     outResult->height = static_cast<uint32_t>(info.height);
 
-    if (info.layerCount > 1) {
+    if (info.layerCount > GRALLOC_MAX_LAYER_COUNT) {
         log_e("Failed to convert descriptor. Unsupported layerCount: %d", info.layerCount);
         return ToBinderStatus(AllocationError::UNSUPPORTED);
     }
 
+    if (info.reservedSize < 0) {
+        log_e("Invalid buffer descriptor: reservedSize %" PRId64, info.reservedSize);
+        return ToBinderStatus(AllocationError::BAD_DESCRIPTOR);
+    }
+    if (info.reservedSize > GRALLOC_MAX_RESERVED_SIZE) {
+        log_e("Failed to convert descriptor. Unsupported reservedSize: %" PRId64, info.reservedSize);
+        return ToBinderStatus(AllocationError::UNSUPPORTED);
+    }
+
     outResult->android_format = static_cast<uint32_t>(info.format);
-    outResult->android_usage = static_cast<uint32_t>(info.usage);
+    outResult->android_usage = static_cast<uint64_t>(info.usage);
     outResult->android_reserved_size = static_cast<uint32_t>(info.reservedSize);
     outResult->layer_count = static_cast<uint32_t>(info.layerCount);
     outResult->gbm_format = -1; // GBM FourCC format should be convert in gralloc_gm
+
+    outResult->fixed_compression = GRALLOC_FIXED_COMPRESSION_POLICY;
+    for (const auto& option : info.additionalOptions) {
+        if (option.name != GRALLOC_FIXED_COMPRESSION_OPTION)
+            continue;
+        if (option.value < GRALLOC_FIXED_COMPRESSION_NONE ||
+            option.value > GRALLOC_FIXED_COMPRESSION_MAX_BPC) {
+            log_e("Invalid buffer descriptor: %s=%" PRId64, GRALLOC_FIXED_COMPRESSION_OPTION, option.value);
+            return ToBinderStatus(AllocationError::BAD_DESCRIPTOR);
+        }
+        // The option says 0 for the driver default, the descriptor 0 for the policy.
+        outResult->fixed_compression = option.value == 0 ? GRALLOC_FIXED_COMPRESSION_DEFAULT
+                                                         : static_cast<int32_t>(option.value);
+    }
     return ndk::ScopedAStatus::ok();
 }
 
@@ -131,7 +156,9 @@ GbmMesaAllocator::~GbmMesaAllocator() {
 }
 
 bool GbmMesaAllocator::init() {
-    _gbmDevFd = gralloc_gbm_device_init();
+    _gbmDevFd = gralloc_gbm_allocator_device_init();
+    if (_gbmDevFd > 0 && gralloc_gbm_probe_format_caps())
+        log_w("Failed to probe the format caps, they will be probed on demand.");
     return (_gbmDevFd > 0);
 }
 
@@ -200,14 +227,19 @@ ndk::ScopedAStatus GbmMesaAllocator::isSupported(const BufferDescriptorInfo& des
     }
 
     for (const auto& option : descriptor.additionalOptions) {
-        if (option.name != STANDARD_METADATA_DATASPACE) {
+        if (option.name != STANDARD_METADATA_DATASPACE && option.name != GRALLOC_FIXED_COMPRESSION_OPTION) {
             *outResult = false;
             return ndk::ScopedAStatus::ok();
         }
     }
 
-    // TODO: Call the gralloc_is_desc_support()
-    *outResult = true;
+    struct gralloc_buffer_desc gbmDesc = {};
+    if (!convertToGBMDesc(descriptor, &gbmDesc).isOk()) {
+        *outResult = false;
+        return ndk::ScopedAStatus::ok();
+    }
+
+    *outResult = gralloc_is_desc_support(&gbmDesc);
     return ndk::ScopedAStatus::ok();
 }
 
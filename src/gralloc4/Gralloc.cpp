@@ -36,7 +36,7 @@ static int gralloc_mod_gbm_init(gralloc_gbm_module_t* mod) {
     log_i("GBM Mesa Gralloc HAL Module initializing...");
     pthread_mutex_lock(&mod->mutex);
     if (!mod->initialized) {
-        int fd = gralloc_gbm_device_init();
+        int fd = gralloc_gbm_allocator_device_init();
         if (fd < 0) {
             pthread_mutex_unlock(&mod->mutex);
             return -EINVAL;
@@ -146,7 +146,7 @@ static int gralloc_mod_alloc_alloc(alloc_device_t* dev, int w, int h, int format
         .android_format = static_cast<uint32_t>(format),
         .android_usage = static_cast<uint32_t>(usage),
         .gbm_format = gralloc_gm_android_format_to_gbm_format(format),
-        .flags = gralloc_gm_get_gbm_flags_from_android_usage(usage, format)
+        .flags = gralloc_gm_get_gbm_flags_from_android_usage(static_cast<uint32_t>(usage), format)
     };
 
     native_handle_t* hnd = nullptr;
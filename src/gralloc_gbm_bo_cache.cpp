@@ -0,0 +1,248 @@
+/*
+ * Copyright (C) 2025  Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ *
+ * Authors:
+ *      Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ */
+
+#include "gralloc_gbm_bo_cache.h"
+
+#define LOG_TAG "libgralloc_gm"
+
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include <mutex>
+#include <new>
+#include <unordered_map>
+#include <vector>
+
+#include <cutils/properties.h>
+
+#include "gralloc_gbm_reaper.h"
+#include "log.h"
+
+typedef struct gralloc_bo_cache_record {
+    gralloc_bo_cache_key_t key;
+    struct gbm_bo *bo;
+    uint32_t refs;
+    uint64_t expire_ms;
+    // grace list, oldest first
+    struct gralloc_bo_cache_record *prev;
+    struct gralloc_bo_cache_record *next;
+    bool parked;
+} gralloc_bo_cache_record_t;
+
+struct gralloc_bo_cache_key_hash {
+    size_t operator()(const gralloc_bo_cache_key_t& key) const {
+        uint64_t h = (uint64_t)key.ino * 0x9e3779b97f4a7c15ULL;
+        h ^= (uint64_t)key.dev + (h << 6) + (h >> 2);
+        h ^= ((uint64_t)key.format << 32 | key.route) + (h << 6) + (h >> 2);
+        return (size_t)h;
+    }
+};
+
+struct gralloc_bo_cache_key_equal {
+    bool operator()(const gralloc_bo_cache_key_t& a, const gralloc_bo_cache_key_t& b) const {
+        return a.ino == b.ino && a.dev == b.dev && a.route == b.route && a.format == b.format &&
+               a.width == b.width && a.height == b.height && a.stride == b.stride &&
+               a.modifier == b.modifier;
+    }
+};
+
+static std::mutex _bo_cache_mutex;
+static std::unordered_map<gralloc_bo_cache_key_t, gralloc_bo_cache_record_t *,
+                          gralloc_bo_cache_key_hash, gralloc_bo_cache_key_equal> _bo_cache_by_key;
+static std::unordered_map<struct gbm_bo *, gralloc_bo_cache_record_t *> _bo_cache_by_bo;
+static gralloc_bo_cache_record_t *_bo_cache_parked_head = nullptr;
+static gralloc_bo_cache_record_t *_bo_cache_parked_tail = nullptr;
+static uint32_t _bo_cache_parked_count = 0;
+static gralloc_bo_cache_stats_t _bo_cache_stats = {};
+
+static uint32_t gralloc_bo_cache_grace_ms() {
+    static const int32_t grace_ms =
+            property_get_int32(GRALLOC_BO_CACHE_GRACE_PROP, GRALLOC_BO_CACHE_DEFAULT_GRACE_MS);
+    return grace_ms > 0 ? (uint32_t)grace_ms : 0;
+}
+
+static uint64_t gralloc_bo_cache_now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void gralloc_bo_cache_unpark_locked(gralloc_bo_cache_record_t *record) {
+    if (record->prev)
+        record->prev->next = record->next;
+    else
+        _bo_cache_parked_head = record->next;
+    if (record->next)
+        record->next->prev = record->prev;
+    else
+        _bo_cache_parked_tail = record->prev;
+
+    record->prev = record->next = nullptr;
+    record->parked = false;
+    _bo_cache_parked_count--;
+}
+
+static void gralloc_bo_cache_park_locked(gralloc_bo_cache_record_t *record, uint64_t now_ms) {
+    record->expire_ms = now_ms + gralloc_bo_cache_grace_ms();
+    record->prev = _bo_cache_parked_tail;
+    record->next = nullptr;
+    if (_bo_cache_parked_tail)
+        _bo_cache_parked_tail->next = record;
+    else
+        _bo_cache_parked_head = record;
+    _bo_cache_parked_tail = record;
+    record->parked = true;
+    _bo_cache_parked_count++;
+}
+
+static void gralloc_bo_cache_erase_locked(gralloc_bo_cache_record_t *record, std::vector<struct gbm_bo *> *dead) {
+    if (record->parked)
+        gralloc_bo_cache_unpark_locked(record);
+    _bo_cache_by_key.erase(record->key);
+    _bo_cache_by_bo.erase(record->bo);
+    dead->push_back(record->bo);
+    delete record;
+}
+
+// Drop the BOs whose grace period is over, and the oldest ones above the limit.
+static void gralloc_bo_cache_expire_locked(uint64_t now_ms, std::vector<struct gbm_bo *> *dead) {
+    while (_bo_cache_parked_head &&
+           (_bo_cache_parked_count > GRALLOC_BO_CACHE_MAX_PARKED ||
+            _bo_cache_parked_head->expire_ms <= now_ms)) {
+        gralloc_bo_cache_erase_locked(_bo_cache_parked_head, dead);
+        _bo_cache_stats.expired++;
+    }
+}
+
+// The BOs are handed over without the lock, gralloc_reaper_destroy() may destroy them inline.
+static void gralloc_bo_cache_destroy(const std::vector<struct gbm_bo *>& dead) {
+    for (struct gbm_bo *bo : dead)
+        gralloc_reaper_destroy(bo);
+    if (!dead.empty())
+        log_v("destroyed %zu cached BOs", dead.size());
+}
+
+int gralloc_bo_cache_make_key(int prime_fd, gralloc_bo_cache_key_t *key) {
+    struct stat st;
+
+    if (fstat(prime_fd, &st))
+        return -errno;
+
+    *key = {};
+    key->dev = st.st_dev;
+    key->ino = st.st_ino;
+    return 0;
+}
+
+struct gbm_bo *gralloc_bo_cache_get(const gralloc_bo_cache_key_t *key) {
+    std::vector<struct gbm_bo *> dead;
+    struct gbm_bo *bo = nullptr;
+
+    {
+        std::lock_guard<std::mutex> lock(_bo_cache_mutex);
+        gralloc_bo_cache_expire_locked(gralloc_bo_cache_now_ms(), &dead);
+
+        auto it = _bo_cache_by_key.find(*key);
+        if (it != _bo_cache_by_key.end()) {
+            gralloc_bo_cache_record_t *record = it->second;
+            if (record->parked) {
+                gralloc_bo_cache_unpark_locked(record);
+                _bo_cache_stats.grace_hits++;
+            } else {
+                _bo_cache_stats.hits++;
+            }
+            record->refs++;
+            bo = record->bo;
+        } else {
+            _bo_cache_stats.misses++;
+        }
+    }
+
+    gralloc_bo_cache_destroy(dead);
+    return bo;
+}
+
+struct gbm_bo *gralloc_bo_cache_add(const gralloc_bo_cache_key_t *key, struct gbm_bo *bo) {
+    std::vector<struct gbm_bo *> dead;
+
+    {
+        std::lock_guard<std::mutex> lock(_bo_cache_mutex);
+        gralloc_bo_cache_expire_locked(gralloc_bo_cache_now_ms(), &dead);
+
+        auto it = _bo_cache_by_key.find(*key);
+        if (it != _bo_cache_by_key.end()) {
+            // Another thread has imported the same dma-buf meanwhile.
+            gralloc_bo_cache_record_t *record = it->second;
+            if (record->parked)
+                gralloc_bo_cache_unpark_locked(record);
+            record->refs++;
+            dead.push_back(bo);
+            bo = record->bo;
+        } else {
+            auto *record = new (std::nothrow) gralloc_bo_cache_record_t();
+            if (record) {
+                record->key = *key;
+                record->bo = bo;
+                record->refs = 1;
+                _bo_cache_by_key.emplace(*key, record);
+                _bo_cache_by_bo.emplace(bo, record);
+            } else {
+                dead.push_back(bo);
+                bo = nullptr;
+            }
+        }
+    }
+
+    gralloc_bo_cache_destroy(dead);
+    return bo;
+}
+
+bool gralloc_bo_cache_put(struct gbm_bo *bo) {
+    std::vector<struct gbm_bo *> dead;
+
+    {
+        std::lock_guard<std::mutex> lock(_bo_cache_mutex);
+        auto it = _bo_cache_by_bo.find(bo);
+        if (it == _bo_cache_by_bo.end())
+            return false;
+
+        gralloc_bo_cache_record_t *record = it->second;
+        if (--record->refs == 0) {
+            if (gralloc_bo_cache_grace_ms())
+                gralloc_bo_cache_park_locked(record, gralloc_bo_cache_now_ms());
+            else
+                gralloc_bo_cache_erase_locked(record, &dead);
+        }
+        gralloc_bo_cache_expire_locked(gralloc_bo_cache_now_ms(), &dead);
+    }
+
+    gralloc_bo_cache_destroy(dead);
+    return true;
+}
+
+void gralloc_bo_cache_trim() {
+    std::vector<struct gbm_bo *> dead;
+
+    {
+        std::lock_guard<std::mutex> lock(_bo_cache_mutex);
+        while (_bo_cache_parked_head) {
+            gralloc_bo_cache_erase_locked(_bo_cache_parked_head, &dead);
+            _bo_cache_stats.expired++;
+        }
+    }
+
+    gralloc_bo_cache_destroy(dead);
+}
+
+void gralloc_bo_cache_get_stats(gralloc_bo_cache_stats_t *stats) {
+    std::lock_guard<std::mutex> lock(_bo_cache_mutex);
+
+    *stats = _bo_cache_stats;
+    stats->parked_count = _bo_cache_parked_count;
+    stats->live_count = (uint32_t)_bo_cache_by_bo.size() - _bo_cache_parked_count;
+}
@@ -0,0 +1,237 @@
+/*
+ * Copyright (C) 2025  Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ *
+ * Authors:
+ *      Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ */
+
+#include "gralloc_gbm_device.h"
+
+#define LOG_TAG "libgralloc_gm"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <mutex>
+
+#include <cutils/properties.h>
+#include <hardware/gralloc.h>
+#include <xf86drm.h>
+
+#include "gralloc_gbm_mesa.h"
+#include "log.h"
+
+#define GRALLOC_DEVICE_MAX_RENDER_NODES 64 // renderD128 to renderD191
+#define GRALLOC_DEVICE_MAX_CARD_NODES 16
+
+// The usages which end up on a display plane, GRALLOC_USAGE_HW_COMPOSER if the composer does overlays.
+#define GRALLOC_DEVICE_DISPLAY_USAGE (GRALLOC_USAGE_HW_FB | GRALLOC_USAGE_CURSOR)
+
+typedef struct gralloc_device_node {
+    int fd;
+    struct gbm_device *gbm;
+    char path[PROPERTY_VALUE_MAX];
+} gralloc_device_node_t;
+
+static std::mutex _device_mutex;
+static std::atomic<bool> _device_ready{false};
+static gralloc_device_node_t _device_nodes[GRALLOC_DEVICE_NUM_ROUTES] = {
+    {.fd = -1, .gbm = nullptr, .path = ""},
+    {.fd = -1, .gbm = nullptr, .path = ""},
+};
+// The display route has a node of its own, otherwise it uses the render node.
+static std::atomic<bool> _device_display_split{false};
+static bool _device_display_probed = false;
+static int _device_display_usage = GRALLOC_DEVICE_DISPLAY_USAGE;
+
+static int gralloc_device_open(const char *path) {
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+        return -errno;
+
+    // The first opener of a primary node becomes DRM master, leave it to the composer.
+    if (drmIsMaster(fd))
+        drmDropMaster(fd);
+    return fd;
+}
+
+static int gralloc_device_node_create(gralloc_device_node_t *node, int fd, const char *path) {
+    node->gbm = gbm_create_device(fd);
+    if (!node->gbm) {
+        log_e("Failed to create GBM device on %s, fd=%d", path, fd);
+        return -EINVAL;
+    }
+
+    node->fd = gbm_device_get_fd(node->gbm);
+    snprintf(node->path, sizeof(node->path), "%s", path);
+    log_i("Created the GBM device with backend '%s' on %s.",
+          gbm_device_get_backend_name(node->gbm), node->path);
+    return 0;
+}
+
+static void gralloc_device_node_destroy(gralloc_device_node_t *node) {
+    if (node->gbm) {
+        gbm_device_destroy(node->gbm);
+        node->gbm = nullptr;
+    }
+    if (node->fd >= 0) {
+        close(node->fd);
+        node->fd = -1;
+    }
+}
+
+static int gralloc_device_open_render(char *path, size_t size) {
+    property_get(GRALLOC_DEFAULT_DEVICE_PROP, path, "");
+    if (path[0])
+        return gralloc_device_open(path);
+
+    for (int i = 0; i < GRALLOC_DEVICE_MAX_RENDER_NODES; i++) {
+        snprintf(path, size, "/dev/dri/renderD%d", 128 + i);
+        int fd = gralloc_device_open(path);
+        if (fd >= 0)
+            return fd;
+    }
+
+    snprintf(path, size, "%s", GRALLOC_DEFAULT_DEVICE_PATH);
+    return -ENODEV;
+}
+
+/*
+ * Find a KMS node which isn't the primary node of the render device: a
+ * display controller can always allocate dumb buffers, a GPU-only driver
+ * can't.
+ */
+static int gralloc_device_find_display(int render_fd, const char *render_path, char *path, size_t size) {
+    char *render_primary = drmGetPrimaryDeviceNameFromFd(render_fd);
+    int fd = -ENODEV;
+
+    for (int i = 0; i < GRALLOC_DEVICE_MAX_CARD_NODES; i++) {
+        uint64_t dumb = 0;
+
+        snprintf(path, size, "/dev/dri/card%d", i);
+        if (!strcmp(path, render_path) || (render_primary && !strcmp(path, render_primary)))
+            continue;
+
+        fd = gralloc_device_open(path);
+        if (fd < 0)
+            continue;
+        if (!drmGetCap(fd, DRM_CAP_DUMB_BUFFER, &dumb) && dumb)
+            break;
+
+        close(fd);
+        fd = -ENODEV;
+    }
+
+    free(render_primary);
+    return fd;
+}
+
+int gralloc_device_manager_init(int render_fd) {
+    char path[PROPERTY_VALUE_MAX];
+
+    std::lock_guard<std::mutex> lock(_device_mutex);
+    if (_device_ready.load(std::memory_order_relaxed))
+        return 0;
+
+    gralloc_device_node_t *render = &_device_nodes[GRALLOC_DEVICE_RENDER];
+    bool opened = render_fd < 0;
+    if (opened) {
+        render_fd = gralloc_device_open_render(path, sizeof(path));
+        if (render_fd < 0) {
+            log_e("Failed to open the render node %s, err=%d", path, render_fd);
+            return -ENODEV;
+        }
+    } else {
+        snprintf(path, sizeof(path), "fd %d", render_fd);
+    }
+    if (gralloc_device_node_create(render, render_fd, path)) {
+        if (opened)
+            close(render_fd);
+        return -ENODEV;
+    }
+
+    log_i("Allocating on %s.", render->path);
+    _device_ready.store(true, std::memory_order_release);
+    return 0;
+}
+
+int gralloc_device_manager_init_display() {
+    char path[PROPERTY_VALUE_MAX];
+    char display[PROPERTY_VALUE_MAX];
+    int display_fd;
+
+    std::lock_guard<std::mutex> lock(_device_mutex);
+    if (!_device_ready.load(std::memory_order_relaxed))
+        return -ENODEV;
+    if (_device_display_probed)
+        return 0;
+    _device_display_probed = true;
+
+    property_get(GRALLOC_DISPLAY_DEVICE_PROP, display, GRALLOC_DISPLAY_DEVICE_NONE);
+    if (!strcmp(display, GRALLOC_DISPLAY_DEVICE_NONE))
+        return 0;
+
+    gralloc_device_node_t *render = &_device_nodes[GRALLOC_DEVICE_RENDER];
+    if (!strcmp(display, GRALLOC_DISPLAY_DEVICE_AUTO)) {
+        display_fd = gralloc_device_find_display(render->fd, render->path, path, sizeof(path));
+    } else {
+        snprintf(path, sizeof(path), "%s", display);
+        display_fd = gralloc_device_open(path);
+        if (display_fd < 0)
+            log_w("Failed to open the display node %s, err=%d", path, display_fd);
+    }
+    if (display_fd < 0)
+        return 0;
+
+    if (gralloc_device_node_create(&_device_nodes[GRALLOC_DEVICE_DISPLAY], display_fd, path)) {
+        close(display_fd);
+        return 0;
+    }
+
+    if (property_get_bool(GRALLOC_DISPLAY_COMPOSER_PROP, false))
+        _device_display_usage |= GRALLOC_USAGE_HW_COMPOSER;
+    log_i("Scanout on %s.", _device_nodes[GRALLOC_DEVICE_DISPLAY].path);
+    _device_display_split.store(true, std::memory_order_release);
+    return 0;
+}
+
+gralloc_device_route_t gralloc_device_route_for_usage(int usage) {
+    if (!_device_ready.load(std::memory_order_acquire))
+        gralloc_device_manager_init(-1);
+
+    if (_device_display_split.load(std::memory_order_acquire) && (usage & _device_display_usage))
+        return GRALLOC_DEVICE_DISPLAY;
+    return GRALLOC_DEVICE_RENDER;
+}
+
+struct gbm_device *gralloc_device_get(gralloc_device_route_t route) {
+    if (!_device_ready.load(std::memory_order_acquire) && gralloc_device_manager_init(-1))
+        return nullptr;
+
+    if (route != GRALLOC_DEVICE_DISPLAY || !_device_display_split.load(std::memory_order_acquire))
+        route = GRALLOC_DEVICE_RENDER;
+    return _device_nodes[route].gbm;
+}
+
+const char *gralloc_device_get_path(gralloc_device_route_t route) {
+    if (route != GRALLOC_DEVICE_DISPLAY || !_device_display_split.load(std::memory_order_acquire))
+        route = GRALLOC_DEVICE_RENDER;
+    return _device_nodes[route].path;
+}
+
+void gralloc_device_manager_deinit() {
+    std::lock_guard<std::mutex> lock(_device_mutex);
+
+    _device_ready.store(false, std::memory_order_relaxed);
+    _device_display_split.store(false, std::memory_order_relaxed);
+    _device_display_probed = false;
+    _device_display_usage = GRALLOC_DEVICE_DISPLAY_USAGE;
+    for (auto& node : _device_nodes)
+        gralloc_device_node_destroy(&node);
+}
@@ -0,0 +1,427 @@
+/*
+ * Copyright (C) 2025  Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ *
+ * Authors:
+ *      Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ */
+
+#include "gralloc_gbm_fence.h"
+
+#define LOG_TAG "libgralloc_gm"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <linux/dma-buf.h>
+
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <thread>
+
+#include <cutils/properties.h>
+
+#include "log.h"
+
+// Since Linux 6.0, the UAPI headers of the NDK may not have them yet.
+#ifndef DMA_BUF_IOCTL_EXPORT_SYNC_FILE
+struct dma_buf_export_sync_file {
+    __u32 flags;
+    __s32 fd;
+};
+struct dma_buf_import_sync_file {
+    __u32 flags;
+    __s32 fd;
+};
+#define DMA_BUF_IOCTL_EXPORT_SYNC_FILE _IOWR(DMA_BUF_BASE, 2, struct dma_buf_export_sync_file)
+#define DMA_BUF_IOCTL_IMPORT_SYNC_FILE _IOW(DMA_BUF_BASE, 3, struct dma_buf_import_sync_file)
+#endif
+
+static std::atomic<uint64_t> _fence_signaled{0};
+static std::atomic<uint64_t> _fence_waits{0};
+static std::atomic<uint64_t> _fence_deferred{0};
+static std::atomic<uint64_t> _fence_timeouts{0};
+static std::atomic<uint64_t> _fence_errors{0};
+static std::atomic<uint64_t> _fence_exported{0};
+static std::atomic<uint64_t> _fence_imported{0};
+static std::atomic<uint64_t> _fence_wait_us[GRALLOC_FENCE_HIST_BUCKETS];
+static std::atomic<uint64_t> _fence_deferred_us[GRALLOC_FENCE_HIST_BUCKETS];
+
+static int64_t gralloc_fence_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void gralloc_fence_record(std::atomic<uint64_t> *hist, int64_t start_ns) {
+    uint64_t us = (uint64_t)(gralloc_fence_now_ns() - start_ns) / 1000;
+    int bucket = us ? 64 - __builtin_clzll(us) : 0;
+    if (bucket >= GRALLOC_FENCE_HIST_BUCKETS)
+        bucket = GRALLOC_FENCE_HIST_BUCKETS - 1;
+    hist[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+static void gralloc_fence_count_status(int status) {
+    if (status == -ETIME)
+        _fence_timeouts.fetch_add(1, std::memory_order_relaxed);
+    else if (status)
+        _fence_errors.fetch_add(1, std::memory_order_relaxed);
+}
+
+/*
+ * Poll the fence once.
+ * @return 0 if it has signaled, -ETIME if not, -EIO if it signaled with an error.
+ */
+static int gralloc_fence_poll(int fence_fd, int timeout_ms) {
+    struct pollfd pfd = {.fd = fence_fd, .events = POLLIN, .revents = 0};
+    int ret = poll(&pfd, 1, timeout_ms);
+
+    if (ret < 0)
+        return -errno;
+    if (ret == 0)
+        return -ETIME;
+    if (pfd.revents & (POLLERR | POLLNVAL))
+        return -EIO;
+    return 0;
+}
+
+int gralloc_fence_default_timeout() {
+    static const int timeout_ms =
+            property_get_int32(GRALLOC_FENCE_TIMEOUT_PROP, GRALLOC_FENCE_DEFAULT_TIMEOUT_MS);
+    return timeout_ms;
+}
+
+int gralloc_fence_is_signaled(int fence_fd) {
+    if (fence_fd < 0)
+        return 1;
+
+    int ret = gralloc_fence_poll(fence_fd, 0);
+    if (ret == -ETIME)
+        return 0;
+    return ret ? ret : 1;
+}
+
+int gralloc_fence_wait(int fence_fd, int timeout_ms) {
+    int ret;
+
+    // Fast path, most of the fences have signaled by the time we lock.
+    if (fence_fd < 0 || (ret = gralloc_fence_poll(fence_fd, 0)) == 0) {
+        _fence_signaled.fetch_add(1, std::memory_order_relaxed);
+        return 0;
+    }
+    if (ret != -ETIME) {
+        gralloc_fence_count_status(ret);
+        return ret;
+    }
+
+    int64_t start_ns = gralloc_fence_now_ns();
+    int64_t deadline_ns = timeout_ms < 0 ? -1 : start_ns + (int64_t)timeout_ms * 1000000LL;
+    _fence_waits.fetch_add(1, std::memory_order_relaxed);
+
+    for (;;) {
+        int remaining_ms = -1;
+        if (deadline_ns >= 0) {
+            int64_t left_ns = deadline_ns - gralloc_fence_now_ns();
+            remaining_ms = left_ns > 0 ? (int)((left_ns + 999999) / 1000000) : 0;
+        }
+
+        ret = gralloc_fence_poll(fence_fd, remaining_ms);
+        if (ret == -EINTR || ret == -EAGAIN)
+            continue;
+        break;
+    }
+
+    gralloc_fence_record(_fence_wait_us, start_ns);
+    gralloc_fence_count_status(ret);
+    if (ret)
+        log_w("Failed to wait for fence %d, err=%d", fence_fd, ret);
+    return ret;
+}
+
+/*
+ * Deferred waits
+ * One worker thread waits for all of the deferred fences with epoll. Waiters
+ * are added by any thread and only removed by the worker, which also owns the
+ * timeouts: epoll_wait() sleeps until the closest deadline at most.
+ */
+typedef struct gralloc_fence_waiter {
+    int fence_fd;
+    int64_t start_ns;
+    int64_t deadline_ns; // -1 if there's no timeout
+    gralloc_fence_callback_t callback;
+    void *data;
+    struct gralloc_fence_waiter *prev;
+    struct gralloc_fence_waiter *next;
+} gralloc_fence_waiter_t;
+
+#define GRALLOC_FENCE_MAX_EVENTS 16
+
+static std::once_flag _fence_worker_once;
+static std::mutex _fence_worker_mutex;
+static int _fence_epoll_fd = -1;
+static int _fence_wake_fd = -1; // wakes the worker up to pick a closer deadline
+static gralloc_fence_waiter_t *_fence_waiters = nullptr;
+
+static void gralloc_fence_unlink_locked(gralloc_fence_waiter_t *waiter) {
+    if (waiter->prev)
+        waiter->prev->next = waiter->next;
+    else
+        _fence_waiters = waiter->next;
+    if (waiter->next)
+        waiter->next->prev = waiter->prev;
+    waiter->prev = waiter->next = nullptr;
+    epoll_ctl(_fence_epoll_fd, EPOLL_CTL_DEL, waiter->fence_fd, nullptr);
+}
+
+static void gralloc_fence_finish(gralloc_fence_waiter_t *waiter, int status) {
+    close(waiter->fence_fd);
+    gralloc_fence_record(_fence_deferred_us, waiter->start_ns);
+    gralloc_fence_count_status(status);
+    waiter->callback(status, waiter->data);
+    delete waiter;
+}
+
+static int gralloc_fence_next_timeout_locked() {
+    int64_t now_ns = gralloc_fence_now_ns();
+    int64_t closest_ns = -1;
+
+    for (gralloc_fence_waiter_t *waiter = _fence_waiters; waiter; waiter = waiter->next) {
+        if (waiter->deadline_ns >= 0 && (closest_ns < 0 || waiter->deadline_ns < closest_ns))
+            closest_ns = waiter->deadline_ns;
+    }
+    if (closest_ns < 0)
+        return -1;
+    return closest_ns > now_ns ? (int)((closest_ns - now_ns + 999999) / 1000000) : 0;
+}
+
+static void gralloc_fence_worker() {
+    struct epoll_event events[GRALLOC_FENCE_MAX_EVENTS];
+
+    pthread_setname_np(pthread_self(), "gralloc_fence");
+
+    for (;;) {
+        int timeout_ms;
+        {
+            std::lock_guard<std::mutex> lock(_fence_worker_mutex);
+            timeout_ms = gralloc_fence_next_timeout_locked();
+        }
+
+        int num_events = epoll_wait(_fence_epoll_fd, events, GRALLOC_FENCE_MAX_EVENTS, timeout_ms);
+        if (num_events < 0 && errno != EINTR) {
+            log_e("epoll_wait failed on the fence worker, err=%d", errno);
+            usleep(1000);
+            continue;
+        }
+
+        for (int i = 0; i < num_events; i++) {
+            if (!events[i].data.ptr) {
+                uint64_t count;
+                (void)read(_fence_wake_fd, &count, sizeof(count));
+                continue;
+            }
+
+            auto *waiter = static_cast<gralloc_fence_waiter_t *>(events[i].data.ptr);
+            {
+                std::lock_guard<std::mutex> lock(_fence_worker_mutex);
+                gralloc_fence_unlink_locked(waiter);
+            }
+            gralloc_fence_finish(waiter, (events[i].events & EPOLLERR) ? -EIO : 0);
+        }
+
+        // Expire the waiters whose deadline has passed.
+        gralloc_fence_waiter_t *expired = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(_fence_worker_mutex);
+            int64_t now_ns = gralloc_fence_now_ns();
+            gralloc_fence_waiter_t *waiter = _fence_waiters;
+            while (waiter) {
+                gralloc_fence_waiter_t *next = waiter->next;
+                if (waiter->deadline_ns >= 0 && waiter->deadline_ns <= now_ns) {
+                    gralloc_fence_unlink_locked(waiter);
+                    waiter->next = expired;
+                    expired = waiter;
+                }
+                waiter = next;
+            }
+        }
+        while (expired) {
+            gralloc_fence_waiter_t *next = expired->next;
+            log_w("Deferred fence %d timed out.", expired->fence_fd);
+            gralloc_fence_finish(expired, -ETIME);
+            expired = next;
+        }
+    }
+}
+
+static void gralloc_fence_start_worker() {
+    _fence_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    _fence_wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (_fence_epoll_fd < 0 || _fence_wake_fd < 0) {
+        log_e("Failed to create the fence worker, err=%d", errno);
+        return;
+    }
+
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.ptr = nullptr;
+    epoll_ctl(_fence_epoll_fd, EPOLL_CTL_ADD, _fence_wake_fd, &event);
+
+    std::thread(gralloc_fence_worker).detach();
+}
+
+int gralloc_fence_wait_async(int fence_fd, int timeout_ms, gralloc_fence_callback_t callback, void *data) {
+    if (!callback) {
+        if (fence_fd >= 0)
+            close(fence_fd);
+        return -EINVAL;
+    }
+
+    int ret = fence_fd < 0 ? 1 : gralloc_fence_is_signaled(fence_fd);
+    if (ret != 0) {
+        if (fence_fd >= 0)
+            close(fence_fd);
+        if (ret > 0)
+            _fence_signaled.fetch_add(1, std::memory_order_relaxed);
+        else
+            gralloc_fence_count_status(ret);
+        callback(ret > 0 ? 0 : ret, data);
+        return 0;
+    }
+
+    std::call_once(_fence_worker_once, gralloc_fence_start_worker);
+    if (_fence_epoll_fd < 0) {
+        close(fence_fd);
+        return -ENODEV;
+    }
+
+    auto *waiter = new (std::nothrow) gralloc_fence_waiter_t();
+    if (!waiter) {
+        close(fence_fd);
+        return -ENOMEM;
+    }
+    waiter->fence_fd = fence_fd;
+    waiter->start_ns = gralloc_fence_now_ns();
+    waiter->deadline_ns = timeout_ms < 0 ? -1 : waiter->start_ns + (int64_t)timeout_ms * 1000000LL;
+    waiter->callback = callback;
+    waiter->data = data;
+
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.ptr = waiter;
+
+    std::lock_guard<std::mutex> lock(_fence_worker_mutex);
+    if (epoll_ctl(_fence_epoll_fd, EPOLL_CTL_ADD, fence_fd, &event)) {
+        ret = -errno;
+        log_e("Failed to add fence %d to the fence worker, err=%d", fence_fd, ret);
+        close(fence_fd);
+        delete waiter;
+        return ret;
+    }
+
+    waiter->next = _fence_waiters;
+    if (_fence_waiters)
+        _fence_waiters->prev = waiter;
+    _fence_waiters = waiter;
+    _fence_deferred.fetch_add(1, std::memory_order_relaxed);
+
+    if (waiter->deadline_ns >= 0) {
+        uint64_t one = 1;
+        (void)write(_fence_wake_fd, &one, sizeof(one));
+    }
+    return 0;
+}
+
+static void gralloc_fence_signal_eventfd(int status, void *data) {
+    int event_fd = (int)(intptr_t)data;
+    uint64_t value = status ? 2 : 1;
+
+    if (write(event_fd, &value, sizeof(value)) != sizeof(value))
+        log_e("Failed to signal eventfd %d, err=%d", event_fd, errno);
+}
+
+int gralloc_fence_notify_eventfd(int fence_fd, int timeout_ms, int event_fd) {
+    if (event_fd < 0) {
+        if (fence_fd >= 0)
+            close(fence_fd);
+        return -EINVAL;
+    }
+    return gralloc_fence_wait_async(fence_fd, timeout_ms, gralloc_fence_signal_eventfd,
+                                    (void *)(intptr_t)event_fd);
+}
+
+// Cleared once the kernel tells us that it doesn't know the sync_file ioctls.
+static std::atomic<bool> _sync_file_ioctls{true};
+
+static int gralloc_dma_buf_sync_file_ioctl(int dmabuf_fd, unsigned long request, void *arg) {
+    int ret;
+
+    if (!_sync_file_ioctls.load(std::memory_order_relaxed))
+        return -ENOTSUP;
+
+    do {
+        ret = ioctl(dmabuf_fd, request, arg);
+    } while (ret && (errno == EINTR || errno == EAGAIN));
+
+    if (ret) {
+        if (errno == ENOTTY) {
+            log_i("The kernel doesn't support sync_file ioctls of dma-buf.");
+            _sync_file_ioctls.store(false, std::memory_order_relaxed);
+            return -ENOTSUP;
+        }
+        return -errno;
+    }
+    return 0;
+}
+
+int gralloc_dma_buf_export_fence(int dmabuf_fd, bool write, int *fence_fd) {
+    struct dma_buf_export_sync_file arg = {
+        .flags = write ? (__u32)DMA_BUF_SYNC_WRITE : (__u32)DMA_BUF_SYNC_READ,
+        .fd = -1,
+    };
+
+    int ret = gralloc_dma_buf_sync_file_ioctl(dmabuf_fd, DMA_BUF_IOCTL_EXPORT_SYNC_FILE, &arg);
+    if (ret)
+        return ret;
+
+    _fence_exported.fetch_add(1, std::memory_order_relaxed);
+    *fence_fd = arg.fd;
+    return 0;
+}
+
+int gralloc_dma_buf_import_fence(int dmabuf_fd, int fence_fd, bool write) {
+    struct dma_buf_import_sync_file arg = {
+        .flags = write ? (__u32)DMA_BUF_SYNC_WRITE : (__u32)DMA_BUF_SYNC_READ,
+        .fd = fence_fd,
+    };
+
+    int ret = gralloc_dma_buf_sync_file_ioctl(dmabuf_fd, DMA_BUF_IOCTL_IMPORT_SYNC_FILE, &arg);
+    if (ret)
+        return ret;
+
+    _fence_imported.fetch_add(1, std::memory_order_relaxed);
+    return 0;
+}
+
+void gralloc_fence_get_stats(gralloc_fence_stats_t *stats) {
+    if (!stats)
+        return;
+
+    stats->signaled = _fence_signaled.load(std::memory_order_relaxed);
+    stats->waits = _fence_waits.load(std::memory_order_relaxed);
+    stats->deferred = _fence_deferred.load(std::memory_order_relaxed);
+    stats->timeouts = _fence_timeouts.load(std::memory_order_relaxed);
+    stats->errors = _fence_errors.load(std::memory_order_relaxed);
+    stats->exported = _fence_exported.load(std::memory_order_relaxed);
+    stats->imported = _fence_imported.load(std::memory_order_relaxed);
+    for (int i = 0; i < GRALLOC_FENCE_HIST_BUCKETS; i++) {
+        stats->wait_us[i] = _fence_wait_us[i].load(std::memory_order_relaxed);
+        stats->deferred_us[i] = _fence_deferred_us[i].load(std::memory_order_relaxed);
+    }
+}
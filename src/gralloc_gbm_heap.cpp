@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2025  Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ *
+ * Authors:
+ *      Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ */
+
+#include "gralloc_gbm_heap.h"
+
+#define LOG_TAG "libgralloc_gm"
+
+#include <errno.h>
+
+#include <mutex>
+
+#include <BufferAllocator/BufferAllocator.h>
+#include <cutils/properties.h>
+#include <hardware/gralloc.h>
+
+#include "gralloc_gbm_mesa.h"
+#include "log.h"
+
+/*
+ * Any of these means that a device which isn't the CPU or the camera reads or
+ * writes the buffer. The 64-bit usage bits (front buffer rendering, vendor
+ * bits) are all for devices too.
+ */
+#define GRALLOC_HEAP_DEVICE_USAGE                                                       \
+    (GRALLOC_USAGE_HW_TEXTURE | GRALLOC_USAGE_HW_RENDER | GRALLOC_USAGE_HW_2D |         \
+     GRALLOC_USAGE_HW_COMPOSER | GRALLOC_USAGE_HW_FB | GRALLOC_USAGE_EXTERNAL_DISP |    \
+     GRALLOC_USAGE_PROTECTED | GRALLOC_USAGE_CURSOR | GRALLOC_USAGE_HW_VIDEO_ENCODER |   \
+     GRALLOC_USAGE_RENDERSCRIPT | GRALLOC_GM_USAGE_VIDEO_DECODER |                      \
+     GRALLOC_GM_USAGE_GPU_DATA_BUFFER | ~0xffffffffULL)
+
+static std::once_flag _heap_once;
+static BufferAllocator *_heap_allocator = nullptr;
+static bool _heap_has_uncached = false;
+
+static void gralloc_heap_init() {
+    auto heaps = BufferAllocator::GetDmabufHeapList();
+    if (!heaps.count(GRALLOC_HEAP_SYSTEM)) {
+        log_i("No '%s' dma-buf heap, CPU buffers are allocated by GBM.", GRALLOC_HEAP_SYSTEM);
+        return;
+    }
+
+    _heap_has_uncached = heaps.count(GRALLOC_HEAP_SYSTEM_UNCACHED) > 0;
+    _heap_allocator = new BufferAllocator();
+}
+
+bool gralloc_heap_is_eligible(uint32_t android_format, uint64_t usage) {
+    static const bool enabled = property_get_bool(GRALLOC_HEAP_PROP, true);
+
+    if (!enabled || (usage & GRALLOC_HEAP_DEVICE_USAGE))
+        return false;
+    if (android_format == HAL_PIXEL_FORMAT_IMPLEMENTATION_DEFINED)
+        return false;
+
+    return android_format == HAL_PIXEL_FORMAT_BLOB ||
+           (usage & (GRALLOC_USAGE_SW_READ_MASK | GRALLOC_USAGE_SW_WRITE_MASK));
+}
+
+int gralloc_heap_allocate(size_t size, uint32_t usage) {
+    std::call_once(_heap_once, gralloc_heap_init);
+    if (!_heap_allocator)
+        return -ENODEV;
+
+    // Uncached memory is fine if the CPU only touches the buffer now and then.
+    bool cached = (usage & GRALLOC_USAGE_SW_READ_MASK) == GRALLOC_USAGE_SW_READ_OFTEN ||
+                  (usage & GRALLOC_USAGE_SW_WRITE_MASK) == GRALLOC_USAGE_SW_WRITE_OFTEN ||
+                  !_heap_has_uncached;
+    const char *heap = cached ? GRALLOC_HEAP_SYSTEM : GRALLOC_HEAP_SYSTEM_UNCACHED;
+
+    int fd = _heap_allocator->Alloc(heap, size);
+    if (fd < 0) {
+        log_w("Failed to allocate %zu bytes from the '%s' heap, err=%d", size, heap, fd);
+        return fd;
+    }
+
+    log_v("allocated %zu bytes from the '%s' heap, fd=%d", size, heap, fd);
+    return fd;
+}
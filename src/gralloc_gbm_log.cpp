@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2025  Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ *
+ * Authors:
+ *      Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ */
+
+#define LOG_TAG "libgralloc_gm"
+
+#include "log.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+#include <cutils/properties.h>
+
+/*
+ * Async sink
+ * A bounded multi-producer ring buffer (Vyukov): each slot has a sequence
+ * number which tells whether it is free for the producer at that position
+ * or ready for the consumer. Producers claim a position with one CAS and
+ * never wait; if the ring is full the message is written synchronously.
+ * The only consumer is the drain thread, which sleeps on a futex while the
+ * ring is empty. Producers only make a syscall when it is asleep.
+ */
+#define GRALLOC_LOG_RING_SLOTS 256 // power of two
+#define GRALLOC_LOG_MESSAGE_SIZE 256
+
+typedef struct gralloc_log_slot {
+    std::atomic<uint32_t> seq;
+    int level;
+    const char *tag;
+    char message[GRALLOC_LOG_MESSAGE_SIZE];
+} gralloc_log_slot_t;
+
+static gralloc_log_slot_t _log_ring[GRALLOC_LOG_RING_SLOTS];
+static std::atomic<uint32_t> _log_head{0}; // next position to be claimed by a producer
+static uint32_t _log_tail = 0;             // next position to be drained, consumer only
+static std::atomic<int> _log_sleeping{0};  // futex word, 1 while the drain thread waits
+static std::atomic<uint32_t> _log_overflows{0};
+
+static std::once_flag _log_async_once;
+static std::atomic<bool> _log_async_enabled{false};
+static std::atomic<bool> _log_redirected{false};
+
+void __log_set_outputs_redirected(void) {
+    _log_redirected.store(true, std::memory_order_relaxed);
+}
+
+bool __log_outputs_redirected(void) {
+    return _log_redirected.load(std::memory_order_relaxed);
+}
+
+static void gralloc_log_futex(int op, int value) {
+    syscall(SYS_futex, reinterpret_cast<int *>(&_log_sleeping), op, value, nullptr, nullptr, 0);
+}
+
+static bool gralloc_log_drain() {
+    bool drained = false;
+
+    for (;;) {
+        gralloc_log_slot_t *slot = &_log_ring[_log_tail & (GRALLOC_LOG_RING_SLOTS - 1)];
+        if (slot->seq.load(std::memory_order_acquire) != _log_tail + 1)
+            break;
+
+        __android_log_write(slot->level, slot->tag, slot->message);
+        slot->seq.store(_log_tail + GRALLOC_LOG_RING_SLOTS, std::memory_order_release);
+        _log_tail++;
+        drained = true;
+    }
+    return drained;
+}
+
+static void gralloc_log_worker() {
+    pthread_setname_np(pthread_self(), "gralloc_log");
+
+    for (;;) {
+        if (gralloc_log_drain()) {
+            uint32_t overflows = _log_overflows.exchange(0, std::memory_order_relaxed);
+            if (overflows)
+                __android_log_print(ANDROID_LOG_WARN, LOG_TAG,
+                                    "%u messages bypassed the full log ring", overflows);
+            if (__log_outputs_redirected())
+                __flush_redirected_outputs();
+            continue;
+        }
+
+        // Tell the producers to wake us up, then look again before sleeping.
+        _log_sleeping.store(1, std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!gralloc_log_drain())
+            gralloc_log_futex(FUTEX_WAIT_PRIVATE, 1);
+        _log_sleeping.store(0, std::memory_order_relaxed);
+    }
+}
+
+static void gralloc_log_async_init() {
+    if (!property_get_bool(GRALLOC_LOG_ASYNC_PROP, false))
+        return;
+
+    for (uint32_t i = 0; i < GRALLOC_LOG_RING_SLOTS; i++)
+        _log_ring[i].seq.store(i, std::memory_order_relaxed);
+
+    std::thread(gralloc_log_worker).detach();
+    _log_async_enabled.store(true, std::memory_order_release);
+}
+
+bool __log_async_vprint(int level, const char *tag, const char *format, va_list va) {
+    std::call_once(_log_async_once, gralloc_log_async_init);
+    if (!_log_async_enabled.load(std::memory_order_acquire))
+        return false;
+
+    uint32_t pos = _log_head.load(std::memory_order_relaxed);
+    gralloc_log_slot_t *slot;
+    for (;;) {
+        slot = &_log_ring[pos & (GRALLOC_LOG_RING_SLOTS - 1)];
+        int32_t diff = (int32_t)(slot->seq.load(std::memory_order_acquire) - pos);
+        if (diff == 0) {
+            if (_log_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            _log_overflows.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        } else {
+            pos = _log_head.load(std::memory_order_relaxed);
+        }
+    }
+
+    slot->level = level;
+    slot->tag = tag;
+    vsnprintf(slot->message, sizeof(slot->message), format, va);
+    slot->seq.store(pos + 1, std::memory_order_release);
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (_log_sleeping.load(std::memory_order_relaxed) && _log_sleeping.exchange(0))
+        gralloc_log_futex(FUTEX_WAKE_PRIVATE, 1);
+    return true;
+}
@@ -13,151 +13,144 @@
 #include <errno.h>
 #include <error.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <syscall.h>
-
-// #include <mutex>
-#include <unordered_map>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/dma-buf.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <new>
+#include <thread>
 
 #include <cutils/log.h>
 #include <cutils/properties.h>
+#include <drm_fourcc.h>
 #include <hardware/gralloc.h>
 #include <sync/sync.h>
-
+#include <xf86drm.h>
+
+#include "gralloc_bo_lock.h"
+#include "gralloc_bo_registry.h"
+#include "gralloc_gbm_bo_cache.h"
+#include "gralloc_gbm_device.h"
+#include "gralloc_gbm_fence.h"
+#include "gralloc_gbm_format_caps.h"
+#include "gralloc_gbm_formats.h"
+#include "gralloc_gbm_heap.h"
+#include "gralloc_gbm_modifiers.h"
+#include "gralloc_gbm_prefault.h"
+#include "gralloc_gbm_reaper.h"
+#include "gralloc_gbm_stats.h"
 #include "log.h"
 
-// We store the BO with a K,V map [buffer_handle_t, struct gbm_bo] named gbm_bo_handle_map.
-static std::unordered_map<buffer_handle_t, struct gbm_bo *> gbm_bo_handle_map;
-
-// static std::mutex _gbm_bo_handle_map_mutex;
-// static std::mutex _gbm_dev_mutex;
-
-static int _gbm_dev_fd = -1;
-static struct gbm_device* _gbm_dev = nullptr;
+/*
+ * Per-process registry entry of an imported or allocated BO. It keeps the BO,
+ * its lock state and the metadata we query often in one place.
+ *
+ * Entries are carved from chunks which are never freed or moved, so the
+ * reserved field of gralloc_handle_t can refer to an entry directly with a
+ * tag of (generation << 32 | index). The generation changes every time an
+ * entry is recycled, and the entry remembers its handle, so a stale handle or
+ * a tag written by another process never resolves to a wrong BO.
+ */
+typedef struct gralloc_bo_entry {
+    std::atomic<buffer_handle_t> handle;
+    std::atomic<uint32_t> generation;
+    uint32_t index;
+    struct gbm_bo *bo;
+    bo_data_t bo_data;
+    gralloc_bo_info_t info;
+    struct gralloc_bo_entry *next_free;
+    // idle mapping LRU, protected by _map_cache_mutex
+    struct gralloc_bo_entry *lru_prev;
+    struct gralloc_bo_entry *lru_next;
+    bool lru_linked;
+    bool linear; // CPU mappings of the BO are direct, not staged
+    uint32_t shadow_cpp; // bytes per pixel of the shadow of a tiled BO, 0 if it has none
+    // mapping of the reserved region, kept until the handle is freed
+    std::atomic<void *> reserved_addr;
+    uint64_t reserved_size;
+    // CPU locks: readers share the mapping, a writer has it alone (nested writes of one thread are fine)
+    GrallocBoLock cpu_lock;
+} gralloc_bo_entry_t;
+
+#define GRALLOC_BO_ENTRY_CHUNK_SIZE 256
+#define GRALLOC_BO_ENTRY_MAX_CHUNKS 256
+
+static std::atomic<gralloc_bo_entry_t *> _bo_entry_chunks[GRALLOC_BO_ENTRY_MAX_CHUNKS];
+static uint32_t _bo_entry_chunk_count = 0;
+static gralloc_bo_entry_t *_bo_entry_free_list = nullptr;
+static std::mutex _bo_entry_mutex;
+
+// We store the BO entries with a K,V map [buffer_handle_t, gralloc_bo_entry_t] named gbm_bo_handle_map.
+// Lookups are lock-free, inserts and erases lock only one shard of the map.
+// It is the fallback when the tag in the handle can't be used.
+static GrallocHandleRegistry<gralloc_bo_entry_t> gbm_bo_handle_map;
 
 int gralloc_gbm_device_init() {
-    int fd = -1;
-    char device_path[PROPERTY_VALUE_MAX];
-    struct gbm_device *dev = nullptr;
-
     __redirect_standard_outputs();
 
-    property_get(GRALLOC_DEFAULT_DEVICE_PROP, device_path, GRALLOC_DEFAULT_DEVICE_PATH);
-
-    fd = open(device_path, O_RDWR | O_CLOEXEC); //TODO: Shall we add O_CLOEXEC?
-    if (fd < 0) {
-        log_e("Failed to open device %s, err=%d", device_path, errno);
-        return -EINVAL;
-    }
-    log_v("opened device %s, fd=%d", device_path, fd);
-
-    if (gralloc_gbm_device_create(fd, &dev)) {
+    if (gralloc_device_manager_init(-1)) {
         log_e("Failed to initialize the gralloc_gm because cannot create GBM device!");
         return -EINVAL;
     }
 
-    log_i("The GBM device has been initialized, fd=%d, dev_fd=%d", fd, _gbm_dev_fd);
+    int fd = gbm_device_get_fd(gralloc_device_get(GRALLOC_DEVICE_RENDER));
+    log_i("The GBM device has been initialized, dev_fd=%d", fd);
 
     // we shouldn't close the fd.
-    return _gbm_dev_fd;
+    return fd;
 }
 
-// The GBM (DRI backend) supported formats can be found at gbm_dri_visuals_table[]
-// in <mesa_dir>/src/gbm/backends/dri/gbm_dri.c
-// The DRI supported formats can be found at dri2_format_table[]
-// in <mesa_dir>/src/gallium/frontends/dri/dri_helpers.c
+int gralloc_gbm_allocator_device_init() {
+    int fd = gralloc_gbm_device_init();
+    if (fd < 0)
+        return fd;
+
+    // The display node if the board has one (gralloc_gbm_device.h)
+    gralloc_device_manager_init_display();
+    return fd;
+}
+
+// The conversion table is kGbmFormats/kAndroidFormats in gralloc_gbm_formats.h
 uint32_t gralloc_gm_android_format_to_gbm_format(uint32_t android_format)
 {
-    uint32_t fmt;
-
-    /* The order of color format should be reversed 
-       while converting Android format to GBM format */
-    switch (android_format) {
-    case HAL_PIXEL_FORMAT_RGBA_8888:
-        fmt = GBM_FORMAT_ABGR8888; // not GBM_FORMAT_RGBA8888
-        break;
-    case HAL_PIXEL_FORMAT_RGBX_8888:
-        fmt = GBM_FORMAT_XBGR8888; // not GBM_FORMAT_RGBX8888
-        break;
-    case HAL_PIXEL_FORMAT_RGB_888:
-        fmt = GBM_FORMAT_BGR888; // not GBM_FORMAT_RGB888
-        break;
-    case HAL_PIXEL_FORMAT_RGB_565:
-        fmt = GBM_FORMAT_BGR565; // not GBM_FORMAT_RGB565
-        break;
-    case HAL_PIXEL_FORMAT_BGRA_8888:
-        fmt = GBM_FORMAT_ARGB8888; // not GBM_FORMAT_BGRA8888
-        break;
-    case HAL_PIXEL_FORMAT_RAW16:
-        fmt = GBM_FORMAT_R16;
-        break;
-    case HAL_PIXEL_FORMAT_YV12:
-        /* YV12 is planar, but must be a single buffer so ask for GR88 */
-        fmt = GBM_FORMAT_GR88;
-        break;
-    case HAL_PIXEL_FORMAT_Y8:
-        fmt = GBM_FORMAT_R8;
-        break;
-    case HAL_PIXEL_FORMAT_Y16:
-        fmt = GBM_FORMAT_R16;
-        break;
-    case HAL_PIXEL_FORMAT_RGBA_FP16:
-        fmt = GBM_FORMAT_ABGR16161616F;
-        break;
-    case HAL_PIXEL_FORMAT_RGBA_1010102:
-        fmt = GBM_FORMAT_ABGR2101010; // not GBM_FORMAT_RGBA1010102
-        break;
-    case HAL_PIXEL_FORMAT_YCbCr_422_SP:
-        fmt = GBM_FORMAT_YUV422;
-        break;
-    case HAL_PIXEL_FORMAT_YCbCr_420_888:
-    case HAL_PIXEL_FORMAT_YCrCb_420_SP:
-        fmt = GBM_FORMAT_YUV420;
-        break;
-    case HAL_PIXEL_FORMAT_YCBCR_P010:
-        fmt = __gbm_fourcc_code('P', '0', '1', '0');
-        break;
-    /*
-     * Choose GBM_FORMAT_R8 because <system/graphics.h> requires the buffers
-     * with a format HAL_PIXEL_FORMAT_BLOB have a height of 1, and width
-     * equal to their size in bytes.
-     */
-    case HAL_PIXEL_FORMAT_BLOB:
-        fmt = GBM_FORMAT_R8;
-        break;
-    case HAL_PIXEL_FORMAT_IMPLEMENTATION_DEFINED:
-        return __gbm_fourcc_code('9','9','9','8');
-        break;
-    default:
-        fmt = 0;
+    const gralloc_android_format_desc_t *desc = gralloc_get_android_format_desc(android_format);
+    uint32_t fmt = desc ? desc->gbm_format : 0;
+
+    if (!desc)
         log_e("Unknown android format '%d', failed to convert!", android_format);
-        break;
-    }
 
     log_v("convert android format '%d' to '%d'", android_format, fmt);
     return fmt;
 }
 
-unsigned int gralloc_gm_get_gbm_flags_from_android_usage(int usage, int android_format)
+/*
+ * Same as gralloc_gm_get_gbm_flags_from_android_usage() but quiet, for the hot paths.
+ * The camera, video and RenderScript usages have no GBM flag, they only
+ * restrict the modifiers (gralloc_modifiers_select()).
+ */
+static unsigned int gralloc_gm_usage_to_gbm_flags(uint64_t usage, uint32_t gbm_format)
 {
     unsigned int flags = 0;
-    uint32_t gbm_format = gralloc_gm_android_format_to_gbm_format(android_format);
 
     if (usage & (GRALLOC_USAGE_SW_READ_OFTEN | GRALLOC_USAGE_SW_WRITE_OFTEN))
         flags |= GBM_BO_USE_LINEAR;
-    if (usage & GRALLOC_USAGE_CURSOR) {
-        switch (gbm_format) {
-            case GBM_FORMAT_ARGB8888:
-                flags |= GBM_BO_USE_CURSOR;
-                break;
-            default:
-                log_w("The GBM_BO_USE_CURSOR is required but using unsupported format (%d).", android_format);
-                break;
-        }
-    }
+    if ((usage & GRALLOC_USAGE_CURSOR) && gbm_format == GBM_FORMAT_ARGB8888)
+        flags |= GBM_BO_USE_CURSOR;
     if (usage & (GRALLOC_USAGE_HW_RENDER | GRALLOC_USAGE_HW_TEXTURE))
         flags |= GBM_BO_USE_RENDERING;
     if (usage & GRALLOC_USAGE_HW_FB)
@@ -168,6 +161,21 @@ unsigned int gralloc_gm_get_gbm_flags_from_android_usage(int usage, int android_
         flags |= GBM_BO_USE_RENDERING;
     if (usage & GRALLOC_USAGE_PROTECTED)
         flags |= GBM_BO_USE_PROTECTED;
+    if (usage & GRALLOC_GM_USAGE_FRONT_BUFFER)
+        flags |= GBM_BO_USE_FRONT_RENDERING;
+
+    return flags;
+}
+
+unsigned int gralloc_gm_get_gbm_flags_from_android_usage(uint64_t usage, int android_format)
+{
+    // Quiet lookup, the caller has logged the conversion already
+    const gralloc_android_format_desc_t *desc = gralloc_get_android_format_desc(android_format);
+    uint32_t gbm_format = desc ? desc->gbm_format : 0;
+    unsigned int flags = gralloc_gm_usage_to_gbm_flags(usage, gbm_format);
+
+    if ((usage & GRALLOC_USAGE_CURSOR) && !(flags & GBM_BO_USE_CURSOR))
+        log_w("The GBM_BO_USE_CURSOR is required but using unsupported format (%d).", android_format);
 
     if ((flags & GBM_BO_USE_SCANOUT) &&
         !(gbm_format == GBM_FORMAT_XRGB8888 || gbm_format == GBM_FORMAT_XBGR8888)) {
@@ -179,87 +187,25 @@ unsigned int gralloc_gm_get_gbm_flags_from_android_usage(int usage, int android_
 }
 
 int gralloc_gm_get_bpp_from_gbm_format(int gbm_format) {
-    int bpp;
-
-    switch (gbm_format) {
-        case GBM_FORMAT_C8:
-        case GBM_FORMAT_RGB332:
-        case GBM_FORMAT_BGR233:
-            bpp = 8; break;
-        case GBM_FORMAT_YUV420: // Planar/semi-planar YUV420 formats
-        case GBM_FORMAT_NV12:
-        case GBM_FORMAT_NV21:
-        case GBM_FORMAT_YVU420:
-            bpp = 12; break;
-        case GBM_FORMAT_XRGB4444:
-        case GBM_FORMAT_XBGR4444:
-        case GBM_FORMAT_RGBX4444:
-        case GBM_FORMAT_BGRX4444:
-        case GBM_FORMAT_ARGB4444:
-        case GBM_FORMAT_ABGR4444:
-        case GBM_FORMAT_RGBA4444:
-        case GBM_FORMAT_BGRA4444:
-        case GBM_FORMAT_XRGB1555:
-        case GBM_FORMAT_XBGR1555:
-        case GBM_FORMAT_RGBX5551:
-        case GBM_FORMAT_BGRX5551:
-        case GBM_FORMAT_ARGB1555:
-        case GBM_FORMAT_ABGR1555:
-        case GBM_FORMAT_RGBA5551:
-        case GBM_FORMAT_BGRA5551:
-        case GBM_FORMAT_RGB565:
-        case GBM_FORMAT_BGR565:
-            bpp = 16; break;
-        case GBM_FORMAT_YUYV:
-        case GBM_FORMAT_YVYU:
-        case GBM_FORMAT_UYVY:
-        case GBM_FORMAT_VYUY:
-        case GBM_FORMAT_YUV422: // Packed YUV422, e.g., UYVY
-            bpp = 16; break;
-        case GBM_FORMAT_R16:
-        case GBM_FORMAT_GR88:
-            bpp = 16; break;
-        case GBM_FORMAT_RGB888:
-        case GBM_FORMAT_BGR888:
-            bpp = 24; break;
-        case GBM_FORMAT_YUV444:
-            bpp = 24; break;
-        case GBM_FORMAT_XRGB8888:
-        case GBM_FORMAT_XBGR8888:
-        case GBM_FORMAT_RGBX8888:
-        case GBM_FORMAT_BGRX8888:
-        case GBM_FORMAT_ARGB8888:
-        case GBM_FORMAT_ABGR8888:
-        case GBM_FORMAT_RGBA8888:
-        case GBM_FORMAT_BGRA8888:
-        case GBM_FORMAT_XRGB2101010:
-        case GBM_FORMAT_XBGR2101010:
-        case GBM_FORMAT_ARGB2101010:
-        case GBM_FORMAT_ABGR2101010:
-            bpp = 32; break;
-        case GBM_FORMAT_RG1616:
-            bpp = 32; break;
-        case GBM_FORMAT_XBGR16161616:
-        case GBM_FORMAT_ABGR16161616:
-            bpp = 64; break;
-        case GBM_FORMAT_XBGR16161616F:
-        case GBM_FORMAT_ABGR16161616F:
-            bpp = 64; break;
-        default:
-            bpp = 0; break;
-    }
-    
+    const gralloc_gbm_format_desc_t *desc = gralloc_get_gbm_format_desc(gbm_format);
+    int bpp = desc ? desc->bpp : 0;
+
     if (bpp == 0) {
         log_e("Unsupported or compressed GBM pixel format (%d)! "
             "Return bpp=0, and this will cause the 'stride' to be zero.", gbm_format);
     }
-    
+
     log_v("set bpp to %d for format %d", bpp, gbm_format);
 
     return bpp;
 }
 
 int gralloc_gm_get_bytes_per_pixel_from_gbm_format(int gbm_format) {
+    // The stride of a planar format is the stride of its luma plane.
+    const gralloc_gbm_format_desc_t *desc = gralloc_get_gbm_format_desc(gbm_format);
+    if (desc && desc->num_planes > 1)
+        return desc->planes[0].sample_increment_bits / 8;
+
     int bpp = gralloc_gm_get_bpp_from_gbm_format(gbm_format);
     return (bpp > 0) ? (bpp + 7)/8 : 4; // default: 4 bytes
 }
@@ -275,197 +221,1533 @@ uint32_t gralloc_gm_android_caculate_pixel_stride(uint32_t android_format, uint3
     return DIV_ROUND_UP(stride, bytes_per_pixel);
 }
 
+static void gralloc_gm_yuv_fallback_size(uint32_t gbm_format, uint32_t width, uint32_t height,
+                                         uint32_t *bo_width, uint32_t *bo_height) {
+    // GR88 carries two luma samples per pixel.
+    if (gbm_format == GBM_FORMAT_YVU420)
+        *bo_width = ALIGN(width, 32) / 2;
+    else
+        *bo_width = ALIGN(width, 2);
+    *bo_height = height + ALIGN(height, 2) / 2;
+}
+
+// Rows of each layer of a BO whose layers have the rows of the image.
+static uint32_t gralloc_gm_layer_rows(uint32_t rows, uint32_t layer_count) {
+    return layer_count > 1 ? ALIGN(rows, GRALLOC_LAYER_ROW_ALIGN) : rows;
+}
+
+static size_t gralloc_gm_page_size() {
+    static const size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    return page_size;
+}
+
+/*
+ * Rows to add to a single-plane BO of the format so that the reserved region
+ * fits after the pixels, whatever stride the driver picks.
+ */
+static uint32_t gralloc_gm_reserved_rows(uint32_t bo_format, uint32_t width, uint64_t reserved_size) {
+    if (!reserved_size)
+        return 0;
+
+    const gralloc_gbm_format_desc_t *desc = gralloc_get_gbm_format_desc(bo_format);
+    uint32_t min_stride = MAX(width * (desc && desc->bpp ? desc->bpp : 8) / 8, 1u);
+    return (uint32_t)DIV_ROUND_UP(reserved_size + gralloc_gm_page_size(), min_stride);
+}
+
+/*
+ * Place the reserved region after the pixels (image_size bytes) of the
+ * dma-buf. @return 0, or -ENOSPC if the dma-buf is too small for it.
+ */
+static int gralloc_gm_set_reserved_region(struct gralloc_handle_t *handle, uint64_t image_size,
+                                          uint64_t reserved_size) {
+    handle->reserved_offset = 0;
+    handle->reserved_size = 0;
+    if (!reserved_size)
+        return 0;
+
+    off_t size = lseek(handle->prime_fd, 0, SEEK_END);
+    uint64_t offset = ALIGN(image_size, (uint64_t)gralloc_gm_page_size());
+    if (size <= 0 || offset + reserved_size > (uint64_t)size) {
+        log_e("No room for the %" PRIu64 " bytes reserved region after %" PRIu64 " bytes of pixels, dma-buf size %lld",
+              reserved_size, image_size, (long long)size);
+        return -ENOSPC;
+    }
+
+    handle->reserved_offset = offset;
+    handle->reserved_size = reserved_size;
+    return 0;
+}
+
+/*
+ * Rows of the buffer which carries the handle, more than the height of the
+ * image for a single-plane stand-in or a layered buffer.
+ */
+static uint32_t gralloc_gm_bo_height(const struct gralloc_handle_t *hnd) {
+    const gralloc_android_format_desc_t *desc = gralloc_get_android_format_desc(hnd->format);
+    uint32_t format = desc ? desc->gbm_format : 0;
+    uint32_t fallback_format = gralloc_gm_yuv_fallback_format(format);
+    uint32_t layer_count = gralloc_handle_layer_count(hnd);
+    uint32_t width, height = hnd->height;
+
+    if (fallback_format && hnd->gbm_format == fallback_format)
+        gralloc_gm_yuv_fallback_size(format, hnd->width, hnd->height, &width, &height);
+    return gralloc_gm_layer_rows(height, layer_count) * layer_count;
+}
+
+static void gralloc_gm_yuv_fallback_planes(uint32_t gbm_format, uint32_t stride, uint32_t height,
+                                           uint32_t *num_planes, uint32_t *offsets, uint32_t *strides) {
+    uint32_t luma_size = stride * height;
+
+    offsets[0] = 0;
+    strides[0] = stride;
+    if (gbm_format == GBM_FORMAT_YVU420) {
+        // Cr then Cb, each of them has half of the luma stride
+        *num_planes = 3;
+        offsets[1] = luma_size;
+        strides[1] = stride / 2;
+        offsets[2] = luma_size + (stride / 2) * (ALIGN(height, 2) / 2);
+        strides[2] = stride / 2;
+    } else {
+        // Interleaved chroma with the luma stride
+        *num_planes = 2;
+        offsets[1] = luma_size;
+        strides[1] = stride;
+    }
+}
+
 int gralloc_gbm_device_create(int fd, struct gbm_device **dev) {
     if (!dev) {
         log_e("Invalid pointer to receive GBM device!");
         return -EINVAL;
     }
 
-    // std::lock_guard<std::mutex> lock(_gbm_dev_mutex);
+    // The fd is only used if the device manager hasn't found a render node yet.
+    if (gralloc_device_manager_init(fd)) {
+        log_e("Failed to create GBM device, fd=%d", fd);
+        return -EINVAL;
+    }
+
+    *dev = gralloc_device_get(GRALLOC_DEVICE_RENDER);
+    return 0;
+}
+
+/*
+ * Format caps of each device (gralloc_gbm_format_caps.h), saved to
+ * GRALLOC_FORMAT_CAPS_DEFAULT_PATH. A display node of its own has another
+ * table, saved with the ".display" suffix.
+ */
+static std::mutex _format_caps_mutex;
+static std::atomic<bool> _format_caps_ready[GRALLOC_DEVICE_NUM_ROUTES];
+static gralloc_format_caps_file_t _format_caps[GRALLOC_DEVICE_NUM_ROUTES];
+
+static void gralloc_format_caps_make_key(struct gbm_device *dev, char *key, size_t size) {
+    char build[PROPERTY_VALUE_MAX];
+    drmVersionPtr version = drmGetVersion(gbm_device_get_fd(dev));
+
+    property_get("ro.vendor.build.fingerprint", build, "unknown");
+    snprintf(key, size, "%s:%s-%d.%d.%d-%s:%s",
+             gbm_device_get_backend_name(dev),
+             version ? version->name : "unknown",
+             version ? version->version_major : 0,
+             version ? version->version_minor : 0,
+             version ? version->version_patchlevel : 0,
+             version ? version->date : "unknown",
+             build);
+    if (version)
+        drmFreeVersion(version);
+}
+
+static void gralloc_format_caps_probe_device(struct gbm_device *dev, gralloc_format_caps_file_t *caps_file) {
+    for (size_t i = 0; i < GRALLOC_CAPS_NUM_FORMATS; i++) {
+        uint32_t format = gralloc_formats::kGbmFormats[i].gbm_format;
+        gralloc_format_caps_t *caps = &caps_file->caps[i];
+
+        for (uint32_t cls = 0; cls < GRALLOC_CAPS_NUM_CLASSES; cls++) {
+            if (gbm_device_is_format_supported(dev, format, gralloc_format_caps_class_to_flags(cls)))
+                caps->classes |= (uint16_t)(1u << cls);
+        }
+        for (size_t m = 0; m < GRALLOC_CAPS_NUM_MODIFIERS; m++) {
+            if (gbm_device_get_format_modifier_plane_count(dev, format, kGrallocCapsModifiers[m]) > 0)
+                caps->modifiers |= (uint8_t)(1u << m);
+        }
+        log_v("format %d: classes=0x%x modifiers=0x%x", format, caps->classes, caps->modifiers);
+    }
+}
+
+static int gralloc_format_caps_probe_locked(gralloc_device_route_t route) {
+    char path[PROPERTY_VALUE_MAX + 8];
+    char key[sizeof(_format_caps[route].key)];
+    gralloc_format_caps_file_t *caps_file = &_format_caps[route];
+    struct gbm_device *dev = gralloc_device_get(route);
+    int save_err;
+
+    if (_format_caps_ready[route].load(std::memory_order_relaxed))
+        return 0;
+
+    if (!dev) {
+        log_e("Cannot probe the format caps without a GBM device.");
+        return -ENODEV;
+    }
+
+    gralloc_format_caps_make_key(dev, key, sizeof(key));
+    gralloc_format_caps_init(caps_file, key);
+
+    property_get(GRALLOC_FORMAT_CAPS_PATH_PROP, path, GRALLOC_FORMAT_CAPS_DEFAULT_PATH);
+    if (route == GRALLOC_DEVICE_DISPLAY)
+        strcat(path, ".display");
+    auto probe = [dev](gralloc_format_caps_file_t *file) { gralloc_format_caps_probe_device(dev, file); };
+    if (gralloc_format_caps_load_or_probe(path, caps_file, probe, &save_err)) {
+        log_i("Probed the format caps of '%s'.", caps_file->key);
+        if (save_err)
+            log_w("Failed to save the format caps to %s, err=%d", path, -save_err);
+    } else {
+        log_i("Loaded the format caps of '%s' from %s.", caps_file->key, path);
+    }
+
+    _format_caps_ready[route].store(true, std::memory_order_release);
+    return 0;
+}
+
+static int gralloc_format_caps_probe(gralloc_device_route_t route) {
+    if (_format_caps_ready[route].load(std::memory_order_acquire))
+        return 0;
+
+    std::lock_guard<std::mutex> lock(_format_caps_mutex);
+    return gralloc_format_caps_probe_locked(route);
+}
+
+int gralloc_gbm_probe_format_caps() {
+    int ret = gralloc_format_caps_probe(GRALLOC_DEVICE_RENDER);
+    if (ret)
+        return ret;
+
+    // Only if the BOs to scan out have a device of their own
+    gralloc_device_route_t display = gralloc_device_route_for_usage(GRALLOC_USAGE_HW_FB);
+    return display == GRALLOC_DEVICE_RENDER ? 0 : gralloc_format_caps_probe(display);
+}
+
+static bool gralloc_is_gbm_format_supported(gralloc_device_route_t route, uint32_t gbm_format, uint32_t flags) {
+    if (gralloc_format_caps_probe(route)) {
+        // Nothing to tell without a device, let gbm_bo_create() decide.
+        return true;
+    }
+
+    return gralloc_format_caps_gbm_supported(&_format_caps[route], gbm_format, flags);
+}
+
+bool gralloc_is_format_supported(uint32_t android_format, uint64_t android_usage) {
+    const gralloc_android_format_desc_t *desc = gralloc_get_android_format_desc(android_format);
+    if (!desc)
+        return false;
+
+    gralloc_device_route_t route = gralloc_device_route_for_usage(android_usage);
+    if (gralloc_format_caps_probe(route)) {
+        // Nothing to tell without a device, let gbm_bo_create() decide.
+        return true;
+    }
+
+    uint32_t flags = gralloc_gm_usage_to_gbm_flags(android_usage, desc->gbm_format);
+    return gralloc_format_caps_supported(&_format_caps[route], android_format, flags);
+}
+
+// The modifiers of a new BO (gralloc_modifiers_select()), from the format caps of its device.
+static uint32_t gralloc_gm_select_modifiers(uint32_t gbm_format, uint32_t flags, int usage,
+                                            bool uncompressed, uint64_t *modifiers) {
+    static const bool scanout_compression = property_get_bool(GRALLOC_SCANOUT_COMPRESSION_PROP, false);
+    gralloc_device_route_t route = gralloc_device_route_for_usage(usage);
+
+    if (!_format_caps_ready[route].load(std::memory_order_acquire))
+        return 0;
+    const gralloc_format_caps_t *caps = gralloc_format_caps_find(&_format_caps[route], gbm_format);
+    if (!caps)
+        return 0;
+
+    return gralloc_modifiers_select(caps->modifiers, flags, usage, uncompressed, scanout_compression, modifiers);
+}
+
+static int32_t gralloc_gm_fixed_compression_policy() {
+    char value[PROPERTY_VALUE_MAX];
+
+    property_get(GRALLOC_FIXED_COMPRESSION_PROP, value, "none");
+    if (!strcmp(value, "default"))
+        return GRALLOC_FIXED_COMPRESSION_DEFAULT;
+
+    int bpc = atoi(value);
+    if (bpc >= 1 && bpc <= GRALLOC_FIXED_COMPRESSION_MAX_BPC)
+        return bpc;
+    if (strcmp(value, "none"))
+        log_w("Invalid %s '%s', fixed-rate compression is disabled.", GRALLOC_FIXED_COMPRESSION_PROP, value);
+    return GRALLOC_FIXED_COMPRESSION_NONE;
+}
+
+/*
+ * The GBM_BO_FIXED_COMPRESSION_* flag of a new BO (gralloc_buffer_desc.fixed_compression),
+ * or 0. The CPU and the cursor need the plain pixels, and the front buffer
+ * is never compressed, so they never get it.
+ */
+static uint32_t gralloc_gm_fixed_compression_flags(int32_t request, uint64_t usage) {
+    static const int32_t policy = gralloc_gm_fixed_compression_policy();
+    const uint64_t excluded_usage = GRALLOC_USAGE_SW_READ_MASK | GRALLOC_USAGE_SW_WRITE_MASK |
+                                    GRALLOC_USAGE_CURSOR | GRALLOC_USAGE_RENDERSCRIPT |
+                                    GRALLOC_GM_USAGE_FRONT_BUFFER;
+
+    if (usage & excluded_usage)
+        return 0;
+    // The policy is only for the video layers, the option for any buffer.
+    if (request == GRALLOC_FIXED_COMPRESSION_POLICY)
+        request = (usage & GRALLOC_GM_USAGE_VIDEO_DECODER) ? policy : GRALLOC_FIXED_COMPRESSION_NONE;
+
+    if (request == GRALLOC_FIXED_COMPRESSION_DEFAULT)
+        return GBM_BO_FIXED_COMPRESSION_DEFAULT;
+    if (request >= 1 && request <= GRALLOC_FIXED_COMPRESSION_MAX_BPC)
+        return (uint32_t)(request + 1) << 7; // GBM_BO_FIXED_COMPRESSION_<request>BPC
+    return 0;
+}
+
+bool gralloc_is_desc_support(const struct gralloc_buffer_desc* desc) {
+    uint32_t max_texture_size = gralloc_get_max_texture_2d_size();
+    if (!gralloc_is_format_supported(desc->android_format, desc->android_usage))
+        return false;
+
+    if (desc->layer_count > GRALLOC_MAX_LAYER_COUNT || desc->android_reserved_size > GRALLOC_MAX_RESERVED_SIZE)
+        return false;
+    if (desc->layer_count > 1 || desc->android_reserved_size) {
+        // Layered buffers and reserved regions need a plain layout, planar formats get it from their stand-in.
+        const gralloc_android_format_desc_t *android_desc = gralloc_get_android_format_desc(desc->android_format);
+        const gralloc_gbm_format_desc_t *gbm_desc = gralloc_get_gbm_format_desc(android_desc->gbm_format);
+        if ((desc->android_usage & GRALLOC_USAGE_CURSOR) ||
+            (desc->layer_count > 1 && (desc->android_usage & GRALLOC_USAGE_HW_FB)) ||
+            (gbm_desc && gbm_desc->num_planes > 1 && !gralloc_gm_yuv_fallback_format(android_desc->gbm_format)))
+            return false;
+    }
+
+    return desc->width <= max_texture_size && desc->height <= max_texture_size;
+}
+
+static void gralloc_bo_entry_drop_mapping(gralloc_bo_entry_t *entry);
+
+static gralloc_bo_entry_t *gralloc_bo_entry_alloc() {
+    std::lock_guard<std::mutex> lock(_bo_entry_mutex);
+
+    if (!_bo_entry_free_list) {
+        if (_bo_entry_chunk_count >= GRALLOC_BO_ENTRY_MAX_CHUNKS) {
+            log_e("Too many BOs, all of %d entries are in use.",
+                  GRALLOC_BO_ENTRY_CHUNK_SIZE * GRALLOC_BO_ENTRY_MAX_CHUNKS);
+            return nullptr;
+        }
+
+        auto *chunk = new (std::nothrow) gralloc_bo_entry_t[GRALLOC_BO_ENTRY_CHUNK_SIZE]();
+        if (!chunk)
+            return nullptr;
+
+        for (uint32_t i = GRALLOC_BO_ENTRY_CHUNK_SIZE; i-- > 0;) {
+            chunk[i].index = _bo_entry_chunk_count * GRALLOC_BO_ENTRY_CHUNK_SIZE + i;
+            chunk[i].next_free = _bo_entry_free_list;
+            _bo_entry_free_list = &chunk[i];
+        }
+        _bo_entry_chunks[_bo_entry_chunk_count++].store(chunk, std::memory_order_release);
+    }
+
+    gralloc_bo_entry_t *entry = _bo_entry_free_list;
+    _bo_entry_free_list = entry->next_free;
+    entry->next_free = nullptr;
+    return entry;
+}
+
+static void gralloc_bo_entry_release(gralloc_bo_entry_t *entry) {
+    entry->handle.store(nullptr, std::memory_order_relaxed);
+    entry->generation.fetch_add(1, std::memory_order_release);
+    entry->bo = nullptr;
+
+    std::lock_guard<std::mutex> lock(_bo_entry_mutex);
+    entry->next_free = _bo_entry_free_list;
+    _bo_entry_free_list = entry;
+}
+
+/*
+ * Fill the plane layout and the size of the buffer. The layout comes from the
+ * handle, or is rebuilt for the handles made before version 5.
+ * @return true if the BO is a single-plane stand-in of a planar YUV format.
+ */
+static bool gralloc_bo_info_set_planes(gralloc_bo_info_t *info, const struct gralloc_handle_t *hnd) {
+    const gralloc_android_format_desc_t *android_desc = gralloc_get_android_format_desc(hnd->format);
+    uint32_t format = android_desc ? android_desc->gbm_format : 0;
+    const gralloc_gbm_format_desc_t *desc = gralloc_get_gbm_format_desc(format);
+    uint32_t fallback_format = gralloc_gm_yuv_fallback_format(format);
+    bool stand_in;
+
+    if (hnd->version >= 5 && hnd->num_planes) {
+        stand_in = fallback_format && hnd->gbm_format == fallback_format;
+        info->num_planes = MIN(hnd->num_planes, GRALLOC_HANDLE_MAX_PLANES);
+        memcpy(info->offsets, hnd->offsets, sizeof(info->offsets));
+        memcpy(info->strides, hnd->strides, sizeof(info->strides));
+    } else if (fallback_format) {
+        stand_in = true;
+        gralloc_gm_yuv_fallback_planes(format, info->stride, hnd->height,
+                                       &info->num_planes, info->offsets, info->strides);
+    } else {
+        stand_in = false;
+        info->num_planes = 1;
+        info->offsets[0] = 0;
+        info->strides[0] = info->stride;
+    }
+
+    info->layer_count = gralloc_handle_layer_count(hnd);
+    info->layer_stride = info->layer_count > 1 ? hnd->layer_stride : 0;
+
+    info->size = 0;
+    for (uint32_t plane = 0; plane < info->num_planes; plane++) {
+        uint32_t rows = info->height;
+        if (plane > 0 && desc && plane < desc->num_planes)
+            rows = DIV_ROUND_UP(hnd->height, desc->planes[plane].vertical_subsampling);
+        info->size = MAX(info->size, (uint64_t)info->offsets[plane] + (uint64_t)info->strides[plane] * rows);
+    }
+    info->size = MAX(info->size, (uint64_t)info->layer_stride * info->layer_count);
+    return stand_in;
+}
+
+static bool gralloc_gbm_shadow_enabled() {
+    static const bool enabled = property_get_bool(GRALLOC_SHADOW_PROP, true);
+    return enabled;
+}
+
+/*
+ * Bind a BO to the handle and stamp the entry tag into the handle.
+ * @return 0 on success, or the BO is still owned by the caller.
+ */
+static int gralloc_bo_entry_register(buffer_handle_t handle, struct gbm_bo *bo, bool allocated) {
+    struct gralloc_handle_t *hnd = gralloc_handle(handle);
+    gralloc_bo_entry_t *entry = gralloc_bo_entry_alloc();
+    if (!entry)
+        return -ENOMEM;
+
+    entry->bo = bo;
+    entry->bo_data = {};
+    entry->reserved_addr.store(nullptr, std::memory_order_relaxed);
+    entry->reserved_size = hnd->version >= 8 ? hnd->reserved_size : 0;
+    entry->cpu_lock.reset();
+    if (bo) {
+        entry->info.gbm_format = gbm_bo_get_format(bo);
+        entry->info.stride = gbm_bo_get_stride(bo);
+        entry->info.modifier = gbm_bo_get_modifier(bo);
+        entry->info.height = gbm_bo_get_height(bo);
+    } else {
+        // A linear dma-buf without a BO, the handle has the whole layout.
+        entry->info.gbm_format = hnd->gbm_format;
+        entry->info.stride = hnd->stride;
+        entry->info.modifier = hnd->modifier;
+        entry->info.height = gralloc_gm_bo_height(hnd);
+    }
+    bool stand_in = gralloc_bo_info_set_planes(&entry->info, hnd);
+    // With an implicit modifier, only the usage tells us that GBM_BO_USE_LINEAR was used.
+    entry->linear = entry->info.modifier == DRM_FORMAT_MOD_LINEAR ||
+                    (entry->info.modifier == DRM_FORMAT_MOD_INVALID &&
+                     (stand_in || (gralloc_gm_get_gbm_flags_from_android_usage(hnd->usage, hnd->format) &
+                                   GBM_BO_USE_LINEAR)));
+    entry->shadow_cpp = 0;
+    if (bo && !entry->linear && entry->info.num_planes == 1 && entry->info.layer_count == 1 &&
+        gralloc_gbm_shadow_enabled()) {
+        const gralloc_gbm_format_desc_t *desc = gralloc_get_gbm_format_desc(entry->info.gbm_format);
+        // The shadow has the stride of the BO, which may be a block stride too small for a row (AFBC).
+        if (desc && desc->bpp && desc->bpp % 8 == 0 &&
+            entry->info.stride >= (uint64_t)gbm_bo_get_width(bo) * (desc->bpp / 8))
+            entry->shadow_cpp = desc->bpp / 8;
+    }
+
+    uint32_t generation = entry->generation.load(std::memory_order_relaxed) + 1;
+    entry->handle.store(handle, std::memory_order_relaxed);
+    entry->generation.store(generation, std::memory_order_release);
+
+    if (!gbm_bo_handle_map.insert(handle, entry)) {
+        gralloc_bo_entry_release(entry);
+        return -EEXIST;
+    }
+
+    hnd->reserved = ((uint64_t)generation << 32) | entry->index;
+    gralloc_stats_bo_registered(hnd->format, hnd->usage, entry->info.size, allocated);
+    return 0;
+}
+
+/*
+ * Unbind the BO from the handle, *bo is owned by the caller now. It is
+ * nullptr if the buffer has no BO (gralloc_gbm_heap.h).
+ * @return 0, or -ENOENT if the handle isn't registered.
+ */
+static int gralloc_bo_entry_unregister(buffer_handle_t handle, struct gbm_bo **bo) {
+    gralloc_bo_entry_t *entry = gbm_bo_handle_map.erase(handle);
+    if (!entry)
+        return -ENOENT;
+
+    *bo = entry->bo;
+    struct gralloc_handle_t *hnd = gralloc_handle(handle);
+    gralloc_stats_bo_unregistered(hnd->format, hnd->usage, entry->info.size);
+
+    /*
+     * Not under a lock or an unlock of another thread, which may be using
+     * the mapping. The ones still waiting for the entry find it released
+     * (gralloc_bo_entry_is_live()) and fail.
+     */
+    {
+        std::lock_guard<std::mutex> lock(entry->cpu_lock.mutex());
+        if (entry->bo_data.lock_count)
+            log_w("bo %p is freed while locked, cnt=%d", entry->bo, entry->bo_data.lock_count);
+        gralloc_bo_entry_drop_mapping(entry);
+        void *reserved_addr = entry->reserved_addr.exchange(nullptr, std::memory_order_acquire);
+        if (reserved_addr)
+            munmap(reserved_addr, entry->reserved_size);
+        hnd->reserved = 0;
+        gralloc_bo_entry_release(entry);
+    }
+    entry->cpu_lock.notify();
+    return 0;
+}
+
+/*
+ * Whether the entry still belongs to the handle: it is released if the
+ * buffer is freed while a thread waits for its lock.
+ * Must be called with the mutex of entry->cpu_lock held.
+ */
+static bool gralloc_bo_entry_is_live(gralloc_bo_entry_t *entry, buffer_handle_t handle) {
+    return entry->handle.load(std::memory_order_relaxed) == handle;
+}
+
+static gralloc_bo_entry_t *gralloc_get_bo_entry(buffer_handle_t handle) {
+    struct gralloc_handle_t *hnd = gralloc_handle(handle);
+    if (!hnd)
+        return nullptr;
+
+    // O(1) path, resolve the tag which we stamped into the handle.
+    uint64_t tag = hnd->reserved;
+    uint32_t generation = (uint32_t)(tag >> 32);
+    uint32_t index = (uint32_t)tag;
+    if (generation && index < GRALLOC_BO_ENTRY_CHUNK_SIZE * GRALLOC_BO_ENTRY_MAX_CHUNKS) {
+        gralloc_bo_entry_t *chunk =
+                _bo_entry_chunks[index / GRALLOC_BO_ENTRY_CHUNK_SIZE].load(std::memory_order_acquire);
+        if (chunk) {
+            gralloc_bo_entry_t *entry = &chunk[index % GRALLOC_BO_ENTRY_CHUNK_SIZE];
+            if (entry->generation.load(std::memory_order_acquire) == generation &&
+                entry->handle.load(std::memory_order_relaxed) == handle)
+                return entry;
+        }
+    }
+
+    return gbm_bo_handle_map.lookup(handle);
+}
+
+// Low bits of a buffer ID which hold the pid of the allocating process, PID_MAX_LIMIT is 2^22.
+#define GRALLOC_BUFFER_ID_PID_BITS 22
+
+/*
+ * A new buffer ID: a counter of the allocating process above its whole pid.
+ * The IDs are unique until the next boot, among every allocating process:
+ *  - Live processes have distinct pids, and each counts on its own.
+ *  - The counter starts at CLOCK_BOOTTIME in milliseconds, so that a process
+ *    which gets the pid of a dead allocator (a restarted allocator) carries
+ *    on above its IDs, unless that one allocated faster than one buffer per
+ *    millisecond for its whole life.
+ *  - The 42 bits of the counter last 139 years of uptime.
+ * They only increase within a process.
+ */
+static uint64_t gralloc_gm_next_buffer_id() {
+    static std::once_flag seed_once;
+    static std::atomic<uint64_t> next_id{0};
+
+    std::call_once(seed_once, [] {
+        struct timespec ts;
+        clock_gettime(CLOCK_BOOTTIME, &ts);
+        next_id.store((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000 + 1, std::memory_order_relaxed);
+    });
+
+    uint64_t id = next_id.fetch_add(1, std::memory_order_relaxed);
+    return (id << GRALLOC_BUFFER_ID_PID_BITS) | ((uint64_t)getpid() & ((1u << GRALLOC_BUFFER_ID_PID_BITS) - 1));
+}
+
+/*
+ * Allocate the buffer of the handle from a dma-buf heap, it has no BO.
+ * Planar YUV gets the layout of its single-plane stand-in, so that the
+ * importers which use GBM can still import it.
+ * @return 0, or an error code if the buffer should be allocated by GBM.
+ */
+static int gralloc_heap_allocate_buffer(buffer_handle_t buffer_handle, uint32_t format, uint64_t reserved_size) {
+    struct gralloc_handle_t *handle = gralloc_handle(buffer_handle);
+    uint32_t bo_format = gralloc_gm_yuv_fallback_format(format);
+    uint32_t width = handle->width;
+    uint32_t height = handle->height;
+
+    if (bo_format)
+        gralloc_gm_yuv_fallback_size(format, handle->width, handle->height, &width, &height);
+    else
+        bo_format = format;
+
+    const gralloc_gbm_format_desc_t *desc = gralloc_get_gbm_format_desc(bo_format);
+    if (!desc || desc->num_planes > 1 || !desc->bpp || desc->bpp % 8)
+        return -EINVAL;
+
+    uint32_t stride = ALIGN(width * (desc->bpp / 8), GRALLOC_HEAP_STRIDE_ALIGN);
+    uint32_t layer_count = gralloc_handle_layer_count(handle);
+    uint32_t layer_rows = gralloc_gm_layer_rows(height, layer_count);
+    uint64_t image_size = (uint64_t)stride * layer_rows * layer_count;
+    size_t size = reserved_size ? ALIGN(image_size, gralloc_gm_page_size()) + reserved_size : image_size;
+    int fd = gralloc_heap_allocate(size, handle->usage);
+    if (fd < 0)
+        return fd;
+
+    handle->prime_fd = fd;
+    handle->stride = stride;
+    handle->modifier = DRM_FORMAT_MOD_LINEAR;
+    handle->gbm_format = bo_format;
+    if (bo_format != format) {
+        gralloc_gm_yuv_fallback_planes(format, stride, handle->height,
+                                       &handle->num_planes, handle->offsets, handle->strides);
+    } else {
+        handle->num_planes = 1;
+        handle->offsets[0] = 0;
+        handle->strides[0] = stride;
+    }
+    if (layer_count > 1)
+        handle->layer_stride = stride * layer_rows;
+
+    int ret = gralloc_gm_set_reserved_region(handle, image_size, reserved_size);
+    if (!ret)
+        ret = gralloc_bo_entry_register(buffer_handle, nullptr, true);
+    if (ret) {
+        close(fd);
+        handle->prime_fd = -1;
+        return ret;
+    }
+
+    log_v("allocated buffer from the heaps: prime_fd=%d, width=%d, height=%d, stride=%d, format=%d",
+          fd, handle->width, handle->height, stride, format);
+    return 0;
+}
+
+/*
+ * Create a BO with the modifiers picked for the usage, or with the implicit
+ * modifier of the driver if there are none or GBM refuses them. With
+ * fixed-rate compression the driver picks the layout; if it can't compress
+ * the BO, it is created without compression.
+ *
+ * A layered BO has layer_count layers of height rows each (see
+ * GRALLOC_LAYER_ROW_ALIGN), followed by the rows of the reserved region if
+ * there is one. Both need a plain layout: if the driver still picks one with
+ * compression data, the BO is created again as linear.
+ */
+static struct gbm_bo *gralloc_gm_create_bo(struct gbm_device *dev, uint32_t width, uint32_t height,
+                                           uint32_t format, uint32_t flags, int usage,
+                                           uint32_t layer_count, uint64_t reserved_size) {
+    uint64_t modifiers[GRALLOC_CAPS_NUM_MODIFIERS];
+    uint32_t num_modifiers = 0;
+    struct gbm_bo *bo = nullptr;
+    bool plain = layer_count > 1 || reserved_size;
+
+    if (plain) {
+        height = gralloc_gm_layer_rows(height, layer_count) * layer_count +
+                 gralloc_gm_reserved_rows(format, width, reserved_size);
+        flags &= ~GBM_BO_FIXED_COMPRESSION_MASK;
+    }
+
+    if (flags & GBM_BO_FIXED_COMPRESSION_MASK) {
+        bo = gbm_bo_create(dev, width, height, format, flags);
+        if (!bo) {
+            log_w("Failed to create BO with fixed-rate compression %#x, err=%d, retrying without.",
+                  flags & GBM_BO_FIXED_COMPRESSION_MASK, errno);
+            flags &= ~GBM_BO_FIXED_COMPRESSION_MASK;
+        }
+    }
+
+    if (!bo) {
+        num_modifiers = gralloc_gm_select_modifiers(format, flags, usage, plain, modifiers);
+        log_v("trying to create BO, size=%dx%d, fmt(gbm)=%d, usage=%x, modifiers=%u",
+              width, height, format, flags, num_modifiers);
+    }
+    if (num_modifiers) {
+        // The modifier list decides the layout, GBM rejects GBM_BO_USE_LINEAR along with it.
+        bo = gbm_bo_create_with_modifiers2(dev, width, height, format, modifiers, num_modifiers,
+                                           flags & ~GBM_BO_USE_LINEAR);
+        if (!bo)
+            log_w("Failed to create BO with %u modifiers, err=%d, retrying without.", num_modifiers, errno);
+    }
+    if (!bo)
+        bo = gbm_bo_create(dev, width, height, format, flags);
+    if (bo && plain && !(flags & GBM_BO_USE_LINEAR) &&
+        (gbm_bo_get_plane_count(bo) > 1 || gralloc_modifier_is_compressed(gbm_bo_get_modifier(bo)))) {
+        log_v("bo %p got a compressed layout, creating it linear", bo);
+        gbm_bo_destroy(bo);
+        bo = gbm_bo_create(dev, width, height, format, flags | GBM_BO_USE_LINEAR);
+    }
+    if (!bo)
+        return nullptr;
+
+    // The handle carries one dma-buf, so every plane must live in the same BO.
+    int num_planes = gbm_bo_get_plane_count(bo);
+    for (int plane = 1; plane < num_planes; plane++) {
+        if (gbm_bo_get_handle_for_plane(bo, plane).u32 != gbm_bo_get_handle_for_plane(bo, 0).u32 ||
+            plane >= GRALLOC_HANDLE_MAX_PLANES) {
+            log_w("Planes of format %d are not in one buffer, can't share them.", format);
+            gbm_bo_destroy(bo);
+            errno = EINVAL;
+            return nullptr;
+        }
+    }
+    return bo;
+}
+
+static int32_t gralloc_allocate_impl(const struct gralloc_buffer_desc *desc, int32_t *out_stride, native_handle_t **out_handle) {
+    int ret = 0;
+    size_t num_planes;
+    size_t num_fds;
+    size_t num_ints;
+    struct gbm_bo *bo = nullptr;
+    struct gbm_device *dev;
+    native_handle_t *_handle = nullptr;
+    gralloc_handle_t *handle = nullptr;
+
+    if (!gralloc_is_desc_support(desc)) {
+        log_e("Unsupported gralloc_buffer_desc, abort.");
+        return -EINVAL;
+    }
+
+    // TODO: Does Android using GBM format directly?
+    _handle = gralloc_handle_create(desc->width, desc->height, desc->android_format,
+                                    (int32_t)desc->android_usage);
+    if (!_handle) {
+        log_e("Failed to create native handle, abort.");
+        return -EINVAL;
+    }
+    buffer_handle_t buffer_handle = _handle;
+    if (!buffer_handle) {
+        log_e("Failed to convert native_handle_t to buffer_handle_t, abort.");
+        return -EINVAL;
+    }
+    handle = gralloc_handle(buffer_handle);
+    if (!handle) {
+        log_e("Failed to create gralloc_handle_t from buffer_handle_t, abort.");
+        return -EINVAL;
+    }
+    handle->usage_hi = (uint32_t)(desc->android_usage >> 32);
+    handle->buffer_id = gralloc_gm_next_buffer_id();
+    handle->layer_count = MAX(desc->layer_count, 1u);
+    uint32_t layer_count = handle->layer_count;
+
+    uint32_t format = gralloc_gm_android_format_to_gbm_format(handle->format);
+
+    // Buffers which only the CPU touches don't need the GPU driver.
+    if (gralloc_heap_is_eligible(handle->format, desc->android_usage)) {
+        ret = gralloc_heap_allocate_buffer(buffer_handle, format, desc->android_reserved_size);
+        if (!ret) {
+            *out_stride = handle->stride;
+            *out_handle = _handle;
+            return 0;
+        }
+        log_v("Failed to allocate from the dma-buf heaps, err=%d, using GBM.", ret);
+    }
+
+    // Scanout buffers go to the display node if the board has one.
+    gralloc_device_route_t route = gralloc_device_route_for_usage(desc->android_usage);
+    dev = gralloc_device_get(route);
+    if (!dev) {
+        log_e("Invalid GBM device, abort.");
+        native_handle_delete(_handle);
+        return -ENODEV;
+    }
+
+    uint32_t flags = gralloc_gm_get_gbm_flags_from_android_usage(desc->android_usage, handle->format) |
+                     gralloc_gm_fixed_compression_flags(desc->fixed_compression, desc->android_usage);
+    uint32_t width, height;
+
+    width = handle->width;
+    height = handle->height;
+    if (flags & GBM_BO_USE_CURSOR) {
+        width = ALIGN(MAX(handle->width, 64), 16);
+        height = ALIGN(MAX(handle->height, 64), 16);
+    }
+
+    // Planar YUV falls back to a single-plane stand-in if the driver can't allocate it,
+    // layered planar YUV and planar YUV with a reserved region always use it.
+    uint32_t fallback_format = gralloc_gm_yuv_fallback_format(format);
+    uint64_t reserved_size = desc->android_reserved_size;
+    bool plain = layer_count > 1 || reserved_size;
+    if (!fallback_format || (!plain && gralloc_is_gbm_format_supported(route, format, flags)))
+        bo = gralloc_gm_create_bo(dev, width, height, format, flags, handle->usage, layer_count,
+                                  reserved_size);
+    if (!bo && fallback_format) {
+        // The planes are found by their offsets, so the stand-in must be linear.
+        log_v("allocating format %d as a single-plane %d BO", format, fallback_format);
+        gralloc_gm_yuv_fallback_size(format, handle->width, handle->height, &width, &height);
+        bo = gralloc_gm_create_bo(dev, width, height, fallback_format,
+                                  (flags & ~GBM_BO_FIXED_COMPRESSION_MASK) | GBM_BO_USE_LINEAR,
+                                  handle->usage, layer_count, reserved_size);
+    }
+    if (!bo) {
+        log_e("Failed to create BO, size=%dx%d, fmt=%d, usage=%x",
+              handle->width, handle->height, handle->format, flags);
+        native_handle_delete(_handle);
+        return -errno;
+    }
+
+    handle->prime_fd = gbm_bo_get_fd(bo);
+	handle->stride = gbm_bo_get_stride(bo);
+#ifdef GBM_BO_IMPORT_FD_MODIFIER
+    handle->modifier = gbm_bo_get_modifier(bo);
+#endif
+    handle->gbm_format = gbm_bo_get_format(bo);
+    if (handle->gbm_format == fallback_format) {
+        gralloc_gm_yuv_fallback_planes(format, handle->stride, handle->height,
+                                       &handle->num_planes, handle->offsets, handle->strides);
+    } else {
+        handle->num_planes = MIN((uint32_t)gbm_bo_get_plane_count(bo), GRALLOC_HANDLE_MAX_PLANES);
+        for (uint32_t plane = 0; plane < handle->num_planes; plane++) {
+            handle->offsets[plane] = gbm_bo_get_offset(bo, plane);
+            handle->strides[plane] = gbm_bo_get_stride_for_plane(bo, plane);
+        }
+    }
+    if (layer_count > 1)
+        handle->layer_stride = handle->stride * gralloc_gm_layer_rows(height, layer_count);
+
+    ret = gralloc_gm_set_reserved_region(handle, (uint64_t)handle->stride *
+                                         gralloc_gm_layer_rows(height, layer_count) * layer_count,
+                                         reserved_size);
+    if (!ret)
+        ret = gralloc_bo_entry_register(buffer_handle, bo, true);
+    if (ret) {
+        log_e("Failed to register BO for handle %p, err=%d, abort.", buffer_handle, ret);
+        gbm_bo_destroy(bo);
+        close(handle->prime_fd);
+        native_handle_delete(_handle);
+        return ret;
+    }
+
+    *out_stride = handle->stride;
+    *out_handle = _handle;
+
+    log_v("allocated buffer: prime_fd=%d, width=%d, height=%d, handle->stride=%d, format=%d",
+        handle->prime_fd, handle->width, handle->height, handle->stride, format);
+
+    // Don't call gbm_device_destroy(dev) in gralloc_allocate().
+    return 0;
+}
+
+int32_t gralloc_allocate(const struct gralloc_buffer_desc *desc, int32_t *out_stride, native_handle_t **out_handle) {
+    uint64_t start_ns = gralloc_stats_begin();
+    int32_t ret = gralloc_allocate_impl(desc, out_stride, out_handle);
+    gralloc_stats_end(GRALLOC_STATS_ALLOCATE, start_ns, ret);
+    return ret;
+}
+
+struct gbm_bo *gralloc_get_gbm_bo_from_handle(buffer_handle_t handle) {
+    gralloc_bo_entry_t *entry = gralloc_get_bo_entry(handle);
+    return entry ? entry->bo : nullptr;
+}
+
+int gralloc_gbm_get_bo_info(buffer_handle_t handle, gralloc_bo_info_t *info) {
+    gralloc_bo_entry_t *entry = gralloc_get_bo_entry(handle);
+    if (!entry || !info)
+        return -EINVAL;
+
+    *info = entry->info;
+    return 0;
+}
+
+int gralloc_gbm_get_reserved_region(buffer_handle_t handle, void **addr, uint64_t *size) {
+    gralloc_bo_entry_t *entry = gralloc_get_bo_entry(handle);
+    if (!entry || !addr || !size)
+        return -EINVAL;
+
+    const struct gralloc_handle_t *hnd = gralloc_handle(handle);
+    if (!entry->reserved_size) {
+        *addr = nullptr;
+        *size = 0;
+        return 0;
+    }
+
+    void *reserved_addr = entry->reserved_addr.load(std::memory_order_acquire);
+    if (!reserved_addr) {
+        void *mapped = mmap(nullptr, entry->reserved_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                            hnd->prime_fd, (off_t)hnd->reserved_offset);
+        if (mapped == MAP_FAILED) {
+            log_e("Failed to map the reserved region of handle %p, err=%d", handle, errno);
+            return -errno;
+        }
+
+        // Another thread may have mapped it meanwhile, theirs wins.
+        if (entry->reserved_addr.compare_exchange_strong(reserved_addr, mapped, std::memory_order_acq_rel))
+            reserved_addr = mapped;
+        else
+            munmap(mapped, entry->reserved_size);
+    }
+
+    *addr = reserved_addr;
+    *size = entry->reserved_size;
+    return 0;
+}
+
+/*
+ * Linear BOs keep their CPU mapping after the last unlock, so that a BO which
+ * is locked every frame isn't mapped and unmapped each time. Idle mappings
+ * sit in a LRU list and are unmapped when the list exceeds its budget, when
+ * mapping fails (e.g. running out of address space in a 32-bit process), or
+ * when the BO is freed.
+ *
+ * Tiled BOs are never cached: Mesa maps them through a staging copy which is
+ * only written back by gbm_bo_unmap().
+ */
+static std::mutex _map_cache_mutex;
+static gralloc_bo_entry_t *_map_cache_head = nullptr; // least recently used
+static gralloc_bo_entry_t *_map_cache_tail = nullptr;
+static uint64_t _map_cache_bytes = 0;
+static uint32_t _map_cache_count = 0;
+static std::atomic<uint64_t> _map_cache_hits{0};
+static std::atomic<uint64_t> _map_cache_misses{0};
+static std::atomic<uint64_t> _map_cache_evictions{0};
+static std::atomic<uint64_t> _map_direct_count{0};
+static std::atomic<uint64_t> _map_gbm_count{0};
+static std::atomic<uint64_t> _map_prefault_count{0};
+static std::atomic<uint64_t> _map_prefault_bytes{0};
+static std::atomic<uint64_t> _map_lock_waits{0};
+static std::atomic<uint64_t> _map_shadow_locks{0};
+static std::atomic<uint64_t> _map_shadow_read_bytes{0};
+static std::atomic<uint64_t> _map_shadow_write_bytes{0};
+
+static uint64_t gralloc_map_cache_budget() {
+    static const uint64_t budget = [] {
+        // Leave the address space of 32-bit clients mostly alone.
+        int32_t def_mb = sizeof(void *) < 8 ? GRALLOC_MAP_CACHE_DEFAULT_MB_32 : GRALLOC_MAP_CACHE_DEFAULT_MB_64;
+        int32_t mb = property_get_int32(GRALLOC_MAP_CACHE_SIZE_PROP, def_mb);
+        return (uint64_t)(mb > 0 ? mb : 0) << 20;
+    }();
+    return budget;
+}
+
+static bool gralloc_map_cache_is_cacheable(gralloc_bo_entry_t *entry) {
+    return (entry->linear || entry->shadow_cpp) && gralloc_map_cache_budget() > 0;
+}
+
+static void gralloc_gbm_unmap(gralloc_bo_entry_t *entry) {
+    bo_data_t *bo_data = &entry->bo_data;
+
+    log_v("unmapped bo %p", entry->bo);
+    if (bo_data->map_direct || bo_data->map_shadow)
+        munmap(bo_data->map_data, bo_data->map_size);
+    else
+        gbm_bo_unmap(entry->bo, bo_data->map_data);
+    bo_data->map_data = NULL;
+    bo_data->map_addr = NULL;
+    bo_data->map_size = 0;
+    bo_data->map_flags = 0;
+    bo_data->map_direct = 0;
+    bo_data->map_y = bo_data->map_h = 0;
+    bo_data->map_populated = 0;
+    bo_data->map_shadow = 0;
+    bo_data->dirty_x = bo_data->dirty_y = bo_data->dirty_w = bo_data->dirty_h = 0;
+}
+
+// Must be called with _map_cache_mutex held.
+static void gralloc_map_cache_unlink(gralloc_bo_entry_t *entry) {
+    if (!entry->lru_linked)
+        return;
+
+    if (entry->lru_prev)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else
+        _map_cache_head = entry->lru_next;
+    if (entry->lru_next)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else
+        _map_cache_tail = entry->lru_prev;
+
+    entry->lru_prev = entry->lru_next = nullptr;
+    entry->lru_linked = false;
+    _map_cache_bytes -= entry->info.size;
+    _map_cache_count--;
+}
+
+// Must be called with _map_cache_mutex held.
+static void gralloc_map_cache_evict_locked(uint64_t max_bytes) {
+    while (_map_cache_head && _map_cache_bytes > max_bytes) {
+        gralloc_bo_entry_t *victim = _map_cache_head;
+        gralloc_map_cache_unlink(victim);
+
+        log_v("evict cached mapping of bo %p", victim->bo);
+        gralloc_gbm_unmap(victim);
+        _map_cache_evictions.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+// Park the mapping of an unlocked BO in the cache.
+static void gralloc_map_cache_park(gralloc_bo_entry_t *entry) {
+    std::lock_guard<std::mutex> lock(_map_cache_mutex);
+
+    entry->lru_prev = _map_cache_tail;
+    entry->lru_next = nullptr;
+    if (_map_cache_tail)
+        _map_cache_tail->lru_next = entry;
+    else
+        _map_cache_head = entry;
+    _map_cache_tail = entry;
+    entry->lru_linked = true;
+    _map_cache_bytes += entry->info.size;
+    _map_cache_count++;
+
+    gralloc_map_cache_evict_locked(gralloc_map_cache_budget());
+}
+
+// Take the BO out of the cache, so nobody else can evict its mapping.
+static void gralloc_map_cache_claim(gralloc_bo_entry_t *entry) {
+    std::lock_guard<std::mutex> lock(_map_cache_mutex);
+    gralloc_map_cache_unlink(entry);
+}
+
+void gralloc_gbm_trim_map_cache() {
+    std::lock_guard<std::mutex> lock(_map_cache_mutex);
+    gralloc_map_cache_evict_locked(0);
+}
+
+void gralloc_gbm_get_map_cache_stats(gralloc_map_cache_stats_t *stats) {
+    if (!stats)
+        return;
+
+    std::lock_guard<std::mutex> lock(_map_cache_mutex);
+    stats->hits = _map_cache_hits.load(std::memory_order_relaxed);
+    stats->misses = _map_cache_misses.load(std::memory_order_relaxed);
+    stats->evictions = _map_cache_evictions.load(std::memory_order_relaxed);
+    stats->direct_maps = _map_direct_count.load(std::memory_order_relaxed);
+    stats->gbm_maps = _map_gbm_count.load(std::memory_order_relaxed);
+    stats->prefaults = _map_prefault_count.load(std::memory_order_relaxed);
+    stats->prefaulted_bytes = _map_prefault_bytes.load(std::memory_order_relaxed);
+    stats->lock_waits = _map_lock_waits.load(std::memory_order_relaxed);
+    stats->shadow_locks = _map_shadow_locks.load(std::memory_order_relaxed);
+    stats->shadow_read_bytes = _map_shadow_read_bytes.load(std::memory_order_relaxed);
+    stats->shadow_write_bytes = _map_shadow_write_bytes.load(std::memory_order_relaxed);
+    stats->cached_bytes = _map_cache_bytes;
+    stats->cached_count = _map_cache_count;
+}
+
+// Called when the BO is going away, whether it was locked or not.
+static void gralloc_bo_entry_drop_mapping(gralloc_bo_entry_t *entry) {
+    gralloc_map_cache_claim(entry);
+    if (entry->bo_data.map_data)
+        gralloc_gbm_unmap(entry);
+}
+
+/*
+ * Map a linear BO by mmap()ing its dma-buf, which skips the transfer machinery
+ * of Mesa. The whole dma-buf is mapped.
+ */
+static int gralloc_gbm_map_direct(gralloc_bo_entry_t *entry, int flags, bool populate) {
+    bo_data_t *bo_data = &entry->bo_data;
+    int fd = gralloc_handle(entry->handle)->prime_fd;
+    int prot = PROT_READ;
+    off_t size;
+    void *base;
+
+    if (flags & GBM_BO_TRANSFER_WRITE)
+        prot |= PROT_WRITE;
+
+    size = lseek(fd, 0, SEEK_END);
+    if (size <= 0) {
+        log_w("Can't get the size of dma-buf %d: %s", fd, strerror(errno));
+        return -EINVAL;
+    }
+
+    base = mmap(NULL, size, prot, MAP_SHARED | (populate ? MAP_POPULATE : 0), fd, 0);
+    if (base == MAP_FAILED && errno == ENOMEM) {
+        // Maybe we are running out of address space, drop the idle mappings and retry.
+        gralloc_gbm_trim_map_cache();
+        base = mmap(NULL, size, prot, MAP_SHARED | (populate ? MAP_POPULATE : 0), fd, 0);
+    }
+    if (base == MAP_FAILED) {
+        log_w("Failed to mmap dma-buf %d: %s", fd, strerror(errno));
+        return -errno;
+    }
+
+    bo_data->map_data = base;
+    bo_data->map_size = size;
+    bo_data->map_direct = 1;
+    bo_data->map_addr = (uint8_t *)base + entry->info.offsets[0];
+    bo_data->map_flags = flags;
+    bo_data->map_y = 0;
+    bo_data->map_h = entry->info.height;
+    _map_direct_count.fetch_add(1, std::memory_order_relaxed);
+    return 0;
+}
+
+/*
+ * Map a linear shadow of a tiled BO, with the stride of the BO so that the
+ * clients address it like the BO. It is filled by the locks.
+ */
+static int gralloc_gbm_map_shadow(gralloc_bo_entry_t *entry) {
+    bo_data_t *bo_data = &entry->bo_data;
+    size_t size = (size_t)entry->info.stride * entry->info.height;
+
+    void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED && errno == ENOMEM) {
+        gralloc_gbm_trim_map_cache();
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (base == MAP_FAILED) {
+        log_w("Failed to allocate a %zu bytes shadow: %s", size, strerror(errno));
+        return -errno;
+    }
+
+    bo_data->map_data = base;
+    bo_data->map_size = size;
+    bo_data->map_shadow = 1;
+    bo_data->map_addr = base;
+    bo_data->map_flags = GBM_BO_TRANSFER_READ_WRITE;
+    bo_data->map_y = 0;
+    bo_data->map_h = entry->info.height;
+    return 0;
+}
+
+/*
+ * Copy a rectangle from the BO into its shadow, or back, through
+ * gbm_bo_map(), which only detiles or decompresses the rectangle.
+ * @return 0, or a negative error code.
+ */
+static int gralloc_gbm_shadow_transfer(gralloc_bo_entry_t *entry, int x, int y, int w, int h, bool write_back) {
+    bo_data_t *bo_data = &entry->bo_data;
+    size_t row_size = (size_t)w * entry->shadow_cpp;
+    uint8_t *shadow = (uint8_t *)bo_data->map_addr + (size_t)y * entry->info.stride + (size_t)x * entry->shadow_cpp;
+    void *map_data = NULL;
+    uint32_t stride;
+
+    uint8_t *addr = (uint8_t *)gbm_bo_map(entry->bo, x, y, w, h,
+                                          write_back ? GBM_BO_TRANSFER_WRITE : GBM_BO_TRANSFER_READ,
+                                          &stride, &map_data);
+    if (!addr) {
+        log_e("Failed to map [%d, %d %dx%d] of bo %p", x, y, w, h, entry->bo);
+        return -ENOMEM;
+    }
+
+    for (int row = 0; row < h; row++) {
+        if (write_back)
+            memcpy(addr + (size_t)row * stride, shadow + (size_t)row * entry->info.stride, row_size);
+        else
+            memcpy(shadow + (size_t)row * entry->info.stride, addr + (size_t)row * stride, row_size);
+    }
+    gbm_bo_unmap(entry->bo, map_data);
+
+    (write_back ? _map_shadow_write_bytes : _map_shadow_read_bytes)
+            .fetch_add(row_size * h, std::memory_order_relaxed);
+    return 0;
+}
+
+/*
+ * Fill a rectangle of the shadow from the BO, but for the dirty region: it
+ * holds CPU writes which have not been written back yet.
+ */
+static int gralloc_gbm_shadow_fill(gralloc_bo_entry_t *entry, int x, int y, int w, int h) {
+    bo_data_t *bo_data = &entry->bo_data;
+    int dx0 = bo_data->dirty_x, dy0 = bo_data->dirty_y;
+    int dx1 = dx0 + bo_data->dirty_w, dy1 = dy0 + bo_data->dirty_h;
+    int x1 = x + w, y1 = y + h;
+
+    if (!bo_data->dirty_w || dx0 >= x1 || dx1 <= x || dy0 >= y1 || dy1 <= y)
+        return gralloc_gbm_shadow_transfer(entry, x, y, w, h, false);
+
+    // The bands above and below the dirty region, and the parts left and right of it.
+    int top = MAX(dy0, y), bottom = MIN(dy1, y1);
+    const int parts[4][4] = {
+        {x, y, w, top - y},
+        {x, bottom, w, y1 - bottom},
+        {x, top, dx0 - x, bottom - top},
+        {dx1, top, x1 - dx1, bottom - top},
+    };
+    for (const auto& part : parts) {
+        if (part[2] <= 0 || part[3] <= 0)
+            continue;
+        int ret = gralloc_gbm_shadow_transfer(entry, part[0], part[1], part[2], part[3], false);
+        if (ret)
+            return ret;
+    }
+    return 0;
+}
+
+/*
+ * Fill the access region of a lock from the BO if it reads, and add it to
+ * the region to write back if it writes. The dirty region of a writer which
+ * locks again is not filled, it would overwrite what has not been written
+ * back. It is a bounding box, the area which it gains is filled too.
+ */
+static int gralloc_gbm_shadow_begin(gralloc_bo_entry_t *entry, int usage, int x, int y, int w, int h) {
+    bo_data_t *bo_data = &entry->bo_data;
+    int width = (int)gbm_bo_get_width(entry->bo);
+    int height = (int)gbm_bo_get_height(entry->bo);
+
+    if (w <= 0 || h <= 0 || x < 0 || y < 0 || x >= width || y >= height) {
+        x = y = 0;
+        w = width;
+        h = height;
+    }
+    w = MIN(w, width - x);
+    h = MIN(h, height - y);
+
+    _map_shadow_locks.fetch_add(1, std::memory_order_relaxed);
+    if (usage & GRALLOC_USAGE_SW_READ_MASK) {
+        int ret = gralloc_gbm_shadow_fill(entry, x, y, w, h);
+        if (ret)
+            return ret;
+    }
+
+    if (usage & GRALLOC_USAGE_SW_WRITE_MASK) {
+        if (bo_data->dirty_w) {
+            int x1 = MAX(bo_data->dirty_x + bo_data->dirty_w, x + w);
+            int y1 = MAX(bo_data->dirty_y + bo_data->dirty_h, y + h);
+            x = MIN(bo_data->dirty_x, x);
+            y = MIN(bo_data->dirty_y, y);
+            w = x1 - x;
+            h = y1 - y;
+            // The box is written back whole, what the writes don't cover must hold the pixels of the BO.
+            int ret = gralloc_gbm_shadow_fill(entry, x, y, w, h);
+            if (ret)
+                return ret;
+        }
+        bo_data->dirty_x = x;
+        bo_data->dirty_y = y;
+        bo_data->dirty_w = w;
+        bo_data->dirty_h = h;
+    }
+
+    log_v("shadow lock of bo %p, region [%d, %d %dx%d], %" PRIu64 " bytes read", entry->bo,
+          x, y, w, h, (usage & GRALLOC_USAGE_SW_READ_MASK) ? (uint64_t)w * h * entry->shadow_cpp : 0);
+    return 0;
+}
+
+/*
+ * Write the dirty region of the shadow back to the BO. It is kept dirty if
+ * that fails, or if @keep_dirty (a flush, the lock goes on).
+ */
+static int gralloc_gbm_shadow_write_back(gralloc_bo_entry_t *entry, bool keep_dirty) {
+    bo_data_t *bo_data = &entry->bo_data;
+
+    if (!bo_data->map_shadow || !bo_data->dirty_w)
+        return 0;
+
+    int ret = gralloc_gbm_shadow_transfer(entry, bo_data->dirty_x, bo_data->dirty_y,
+                                          bo_data->dirty_w, bo_data->dirty_h, true);
+    if (ret)
+        return ret;
+
+    log_v("wrote back [%d, %d %dx%d] of bo %p", bo_data->dirty_x, bo_data->dirty_y,
+          bo_data->dirty_w, bo_data->dirty_h, entry->bo);
+    if (!keep_dirty)
+        bo_data->dirty_x = bo_data->dirty_y = bo_data->dirty_w = bo_data->dirty_h = 0;
+    return 0;
+}
+
+/*
+ * Which prefault the lock usage asks for (GRALLOC_PREFAULT_READ_PROP and
+ * GRALLOC_PREFAULT_WRITE_PROP).
+ * @return PROT_NONE, PROT_READ, or PROT_WRITE.
+ */
+static int gralloc_gm_prefault_for_usage(int usage) {
+    static const int32_t read_policy = property_get_int32(GRALLOC_PREFAULT_READ_PROP, GRALLOC_PREFAULT_OFTEN);
+    static const int32_t write_policy = property_get_int32(GRALLOC_PREFAULT_WRITE_PROP, GRALLOC_PREFAULT_OFTEN);
+    int sw_read = usage & GRALLOC_USAGE_SW_READ_MASK;
+    int sw_write = usage & GRALLOC_USAGE_SW_WRITE_MASK;
+
+    if (sw_write && (write_policy == GRALLOC_PREFAULT_ALWAYS ||
+                     (write_policy == GRALLOC_PREFAULT_OFTEN && sw_write == GRALLOC_USAGE_SW_WRITE_OFTEN)))
+        return PROT_WRITE;
+    if (sw_read && (read_policy == GRALLOC_PREFAULT_ALWAYS ||
+                    (read_policy == GRALLOC_PREFAULT_OFTEN && sw_read == GRALLOC_USAGE_SW_READ_OFTEN)))
+        return PROT_READ;
+    return PROT_NONE;
+}
+
+// Fault in the pages of [addr, addr + len) (gralloc_gbm_prefault.h).
+static void gralloc_gm_prefault(void *addr, size_t len, int prot) {
+    size_t bytes = gralloc_prefault_range(addr, len, prot, gralloc_gm_page_size());
+
+    if (!bytes)
+        return;
+    _map_prefault_count.fetch_add(1, std::memory_order_relaxed);
+    _map_prefault_bytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+/*
+ * Prefault the rows [y, y + h) of the mapping, or all of it if the rows are
+ * all of the BO.
+ */
+static void gralloc_gbm_prefault_rows(gralloc_bo_entry_t *entry, int y, int h, int prot) {
+    bo_data_t *bo_data = &entry->bo_data;
+    bool whole = y == 0 && (uint32_t)h >= entry->info.height;
+
+    if (prot == PROT_NONE || bo_data->map_populated)
+        return;
+    // A write prefault of a read-only mapping would fail, fault it in for reading.
+    if (!(bo_data->map_flags & GBM_BO_TRANSFER_WRITE))
+        prot = PROT_READ;
+
+    if (whole && bo_data->map_direct)
+        gralloc_gm_prefault(bo_data->map_data, bo_data->map_size, prot);
+    else
+        gralloc_gm_prefault((uint8_t *)bo_data->map_addr + (size_t)y * entry->info.stride,
+                            (size_t)h * entry->info.stride, prot);
+    bo_data->map_populated = whole;
+}
+
+/*
+ * Map the rows [y, y + h) of the BO, or the whole BO if h is 0.
+ *
+ * We always transfer full rows: then the stride of the transfer matches the
+ * stride of the BO and the returned address can still be given to the client
+ * as the address of pixel (0, 0). If the backend picks another stride for
+ * the partial transfer, we fall back to map the whole BO.
+ */
+static int gralloc_gbm_map(gralloc_bo_entry_t *entry, int enable_write, int prefault, int y, int h, void **addr) {
+    int flags = GBM_BO_TRANSFER_READ;
+    struct gbm_bo *bo = entry->bo;
+    bo_data_t *bo_data = &entry->bo_data;
+    bool cacheable = gralloc_map_cache_is_cacheable(entry);
+    uint32_t width = bo ? gbm_bo_get_width(bo) : 0;
+    uint32_t height = entry->info.height;
+    uint32_t stride;
+    void *map_addr;
+
+    if (enable_write)
+        flags |= GBM_BO_TRANSFER_WRITE;
+
+    // The mapping of a linear BO is kept around, so it always covers the whole BO.
+    // The rows of the chroma planes and of the other layers aren't the rows of the image, map all of them.
+    if (cacheable || entry->info.num_planes > 1 || entry->info.layer_count > 1 ||
+        h <= 0 || y < 0 || (uint32_t)y >= height) {
+        y = 0;
+        h = height;
+    }
+    h = MIN((uint32_t)h, height - y);
+
+    if (cacheable)
+        gralloc_map_cache_claim(entry);
+
+    if (bo_data->map_data) {
+        if ((bo_data->map_flags & flags) == flags &&
+            bo_data->map_y <= y && y + h <= bo_data->map_y + bo_data->map_h) {
+            _map_cache_hits.fetch_add(1, std::memory_order_relaxed);
+            gralloc_gbm_prefault_rows(entry, y, h, prefault);
+            *addr = bo_data->map_addr;
+            return 0;
+        }
+        // The mapping can't be upgraded or moved while someone is using it.
+        if (bo_data->lock_count)
+            return -EBUSY;
+        gralloc_gbm_unmap(entry);
+    }
+
+    _map_cache_misses.fetch_add(1, std::memory_order_relaxed);
 
-    if ((_gbm_dev_fd > 0) && _gbm_dev) {
-        *dev = _gbm_dev;
-        log_v("reusing existed GBM device.");
-        return 0;
+    // A cached mapping will be reused later, so ask for everything the usage allows.
+    if (cacheable && (gralloc_handle(entry->handle)->usage & GRALLOC_USAGE_SW_WRITE_MASK))
+        flags |= GBM_BO_TRANSFER_WRITE;
+
+    // Linear BOs are mapped directly, Mesa's path is kept for tiled or compressed ones.
+    if (entry->linear) {
+        // MAP_POPULATE covers the whole dma-buf, only worth it if the whole BO is locked.
+        bool populate = prefault != PROT_NONE && y == 0 && (uint32_t)h >= height;
+        if (!gralloc_gbm_map_direct(entry, flags, populate)) {
+            log_v("mapped bo %p directly at %p", bo, bo_data->map_addr);
+            // MAP_POPULATE skips VM_PFNMAP mappings, so check the pages anyway.
+            gralloc_gbm_prefault_rows(entry, y, h, prefault);
+            *addr = bo_data->map_addr;
+            return 0;
+        }
+        if (!bo) {
+            log_e("Failed to map dma-buf %d", gralloc_handle(entry->handle)->prime_fd);
+            return -ENOMEM;
+        }
+        log_w("Failed to map linear bo %p directly, fall back to gbm_bo_map()", bo);
     }
 
-    if (fd < 0) {
-        log_e("Invalid fd to create GBM device, fd=%d", fd);
-        return -EINVAL;
+    // Tiled and compressed BOs get a shadow, the locks copy the regions they use.
+    if (entry->shadow_cpp) {
+        if (!gralloc_gbm_map_shadow(entry)) {
+            log_v("mapped shadow of bo %p at %p", bo, bo_data->map_addr);
+            *addr = bo_data->map_addr;
+            return 0;
+        }
+        log_w("Failed to map a shadow of bo %p, fall back to gbm_bo_map()", bo);
     }
 
-    _gbm_dev = gbm_create_device(fd);
-    if (!_gbm_dev) {
-        log_e("Failed to create GBM device, fd=%d", fd);
-        _gbm_dev_fd = -1;
-        return -EINVAL;
+    map_addr = gbm_bo_map(bo, 0, y, width, h, flags, &stride, &bo_data->map_data);
+    if (map_addr && y != 0 && stride != gbm_bo_get_stride(bo)) {
+        log_v("partial transfer of bo %p has stride %u, map the whole BO", bo, stride);
+        gbm_bo_unmap(bo, bo_data->map_data);
+        bo_data->map_data = NULL;
+        y = 0;
+        h = height;
+        map_addr = gbm_bo_map(bo, 0, 0, width, height, flags, &stride, &bo_data->map_data);
+    }
+    if (map_addr == NULL) {
+        // Maybe we are running out of address space, drop the idle mappings and retry.
+        gralloc_gbm_trim_map_cache();
+        y = 0;
+        h = height;
+        map_addr = gbm_bo_map(bo, 0, 0, width, height, flags, &stride, &bo_data->map_data);
+    }
+    if (map_addr == NULL) {
+        log_e("Failed to map bo %p", bo);
+        return -ENOMEM;
     }
 
-    _gbm_dev_fd = gbm_device_get_fd(_gbm_dev);
-    log_i("Created the GBM device with backend '%s'.", gbm_device_get_backend_name(_gbm_dev));
+    assert(stride == gbm_bo_get_stride(bo));
 
-    *dev = _gbm_dev;
-    return 0;
-}
+    _map_gbm_count.fetch_add(1, std::memory_order_relaxed);
 
-bool gralloc_is_format_supported() {
-    // TODO: Finish the pixel format checking.
+    // Point to the pixel (0, 0) even if only some rows were mapped.
+    bo_data->map_addr = (uint8_t *)map_addr - (size_t)y * stride;
+    bo_data->map_flags = flags;
+    bo_data->map_y = y;
+    bo_data->map_h = h;
+    log_v("mapped bo %p rows [%d, %d) at %p", bo, y, y + h, bo_data->map_addr);
 
-    return true;
+    gralloc_gbm_prefault_rows(entry, y, h, prefault);
+    *addr = bo_data->map_addr;
+    return 0;
 }
 
-bool gralloc_is_desc_support(const struct gralloc_buffer_desc* desc) {
-    uint32_t max_texture_size = gralloc_get_max_texture_2d_size();
-    if (!gralloc_is_format_supported())
-        return false;
+static int gralloc_dma_buf_sync(int fd, uint64_t flags) {
+    struct dma_buf_sync sync = { .flags = flags };
+    int ret;
 
-    return desc->width <= max_texture_size && desc->height <= max_texture_size;
+    do {
+        ret = ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
+    } while (ret && (errno == EINTR || errno == EAGAIN));
+
+    if (ret) {
+        log_e("DMA_BUF_IOCTL_SYNC(0x%llx) failed on fd %d: %s",
+              (unsigned long long)flags, fd, strerror(errno));
+        return -errno;
+    }
+    return 0;
 }
 
-int32_t gralloc_allocate(const struct gralloc_buffer_desc *desc, int32_t *out_stride, native_handle_t **out_handle) {
-    int ret = 0;
-    size_t num_planes;
-    size_t num_fds;
-    size_t num_ints;
-    struct gbm_bo *bo = nullptr;
-    struct gbm_device *dev;
-    native_handle_t *_handle = nullptr;
-    gralloc_handle_t *handle = nullptr;
+/*
+ * Start the CPU access window of a direct (linear) mapping. Staged mappings
+ * of tiled BOs are kept coherent by Mesa's transfer, so they are skipped.
+ */
+static int gralloc_gbm_begin_cpu_access(gralloc_bo_entry_t *entry, int usage) {
+    uint64_t flags = 0;
 
-    if (!gralloc_is_desc_support(desc)) {
-        log_e("Unsupported gralloc_buffer_desc, abort.");
-        return -EINVAL;
-    }
+    if (!entry->linear)
+        return 0;
 
-    ret = gralloc_gbm_device_create(_gbm_dev_fd, &dev);
-    if (!dev) {
-        log_e("Invalid GBM device, abort.");
+    if (usage & GRALLOC_USAGE_SW_READ_MASK)
+        flags |= DMA_BUF_SYNC_READ;
+    if (usage & GRALLOC_USAGE_SW_WRITE_MASK)
+        flags |= DMA_BUF_SYNC_WRITE;
+    if (!flags)
+        return 0;
+
+    int ret = gralloc_dma_buf_sync(gralloc_handle(entry->handle)->prime_fd, DMA_BUF_SYNC_START | flags);
+    if (ret)
         return ret;
-    }
 
-    // TODO: Does Android using GBM format directly?
-    _handle = gralloc_handle_create(desc->width, desc->height, desc->android_format, desc->android_usage);
-    if (!_handle) {
-        log_e("Failed to create native handle, abort.");
-        return -EINVAL;
-    }
-    buffer_handle_t buffer_handle = _handle;
-    if (!buffer_handle) {
-        log_e("Failed to convert native_handle_t to buffer_handle_t, abort.");
-        return -EINVAL;
-    }
-    handle = gralloc_handle(buffer_handle);
-    if (!handle) {
-        log_e("Failed to create gralloc_handle_t from buffer_handle_t, abort.");
-        return -EINVAL;
-    }
+    entry->bo_data.sync_flags = flags;
+    return 0;
+}
 
-    int format = gralloc_gm_android_format_to_gbm_format(handle->format);
-    int flags = gralloc_gm_get_gbm_flags_from_android_usage(handle->usage, handle->format);
-    int width, height;
+static void gralloc_gbm_end_cpu_access(gralloc_bo_entry_t *entry) {
+    if (!entry->bo_data.sync_flags)
+        return;
 
-    width = handle->width;
-    height = handle->height;
-    if (flags & GBM_BO_USE_CURSOR) {
-        width = ALIGN(MAX(handle->width, 64), 16);
-        height = ALIGN(MAX(handle->height, 64), 16);
-    }
+    gralloc_dma_buf_sync(gralloc_handle(entry->handle)->prime_fd,
+                         DMA_BUF_SYNC_END | entry->bo_data.sync_flags);
+    entry->bo_data.sync_flags = 0;
+}
 
-    /*
-     * For YV12, we request GR88, so halve the width since we're getting
-     * 16bpp. Then increase the height by 1.5 for the U and V planes.
-     */
-    if (handle->format == HAL_PIXEL_FORMAT_YV12) {
-        width = ALIGN(handle->width, 32) / 2;
-        height += ALIGN(handle->height, 2) / 2;
-    }
+// Close and reopen the CPU access window, flushing or invalidating CPU caches.
+static int gralloc_gbm_resync_cpu_access(buffer_handle_t handle, uint64_t flags) {
+    gralloc_bo_entry_t *entry = gralloc_get_bo_entry(handle);
+    if (!entry)
+        return -EINVAL;
 
-    log_v("trying to create BO, size=%dx%d, fmt(gbm)=%d, usage=%x",
-          handle->width, handle->height, format, flags);
-    bo = gbm_bo_create(dev, width, height, format,
-               flags);
-    if (!bo) {
-        log_e("Failed to create BO, size=%dx%d, fmt=%d, usage=%x",
-              handle->width, handle->height, handle->format, flags);
-        native_handle_delete(_handle);
-        return -errno;
+    std::lock_guard<std::mutex> lock(entry->cpu_lock.mutex());
+    if (!gralloc_bo_entry_is_live(entry, handle))
+        return -EINVAL;
+    if (!entry->bo_data.lock_count) {
+        log_e("Can't sync bo %p, it isn't locked.", entry->bo);
+        return -EINVAL;
     }
 
-    handle->prime_fd = gbm_bo_get_fd(bo);
-	handle->stride = gbm_bo_get_stride(bo);
-#ifdef GBM_BO_IMPORT_FD_MODIFIER
-    handle->modifier = gbm_bo_get_modifier(bo);
-#endif
-
-    {
-        // std::lock_guard<std::mutex> lock(_gbm_bo_handle_map_mutex);
-        gbm_bo_handle_map.emplace(buffer_handle, bo);
+    // A shadow is written back now, its region stays dirty for the writes to come.
+    if (flags & DMA_BUF_SYNC_WRITE) {
+        int ret = gralloc_gbm_shadow_write_back(entry, true);
+        if (ret)
+            return ret;
     }
 
-    *out_stride = handle->stride;
-    *out_handle = _handle;
-
-    log_v("allocated buffer: prime_fd=%d, width=%d, height=%d, handle->stride=%d, format=%d",
-        handle->prime_fd, handle->width, handle->height, handle->stride, format);
+    // Only the intents which the lock asked for are kept open.
+    flags &= entry->bo_data.sync_flags;
+    if (!flags)
+        return 0;
 
-    // Don't call gbm_device_destroy(dev) in gralloc_allocate().
-    return 0;
+    int fd = gralloc_handle(handle)->prime_fd;
+    int ret = gralloc_dma_buf_sync(fd, DMA_BUF_SYNC_END | flags);
+    if (ret)
+        return ret;
+    return gralloc_dma_buf_sync(fd, DMA_BUF_SYNC_START | flags);
 }
 
-struct gbm_bo *gralloc_get_gbm_bo_from_handle(buffer_handle_t handle) {
-    // std::lock_guard<std::mutex> lock(_gbm_bo_handle_map_mutex);
-    auto it = gbm_bo_handle_map.find(handle);
-    return (it != gbm_bo_handle_map.end()) ? it->second : nullptr;
+int gralloc_gbm_bo_flush(buffer_handle_t handle) {
+    return gralloc_gbm_resync_cpu_access(handle, DMA_BUF_SYNC_WRITE);
 }
 
-void gralloc_gbm_destroy_user_data(struct gbm_bo *bo, void *data) {
-    bo_data_t *bo_data = (bo_data_t *)data;
-    delete bo_data;
-
-    (void)bo;
+int gralloc_gbm_bo_reread(buffer_handle_t handle) {
+    return gralloc_gbm_resync_cpu_access(handle, DMA_BUF_SYNC_READ);
 }
 
-static int gralloc_gbm_map(buffer_handle_t handle, int enable_write, void **addr) {
-    int err = 0;
-    int flags = GBM_BO_TRANSFER_READ;
-    struct gbm_bo *bo = gralloc_get_gbm_bo_from_handle(handle);
-    bo_data_t *bo_data = (bo_data_t *)gbm_bo_get_user_data(bo);
-    uint32_t stride;
-
-    if (bo_data->map_data)
-        return -EINVAL;
-
-    if (enable_write)
-        flags |= GBM_BO_TRANSFER_WRITE;
-
-    *addr = gbm_bo_map(bo, 0, 0, gbm_bo_get_width(bo), gbm_bo_get_height(bo),
-                       flags, &stride, &bo_data->map_data);
-    log_v("mapped bo %p at %p", bo, *addr);
-    if (*addr == NULL)
-        return -ENOMEM;
+// Called when the last lock of the BO is dropped.
+static void gralloc_gbm_release_mapping(gralloc_bo_entry_t *entry) {
+    if (!entry->bo_data.map_data)
+        return;
 
-    assert(stride == gbm_bo_get_stride(bo));
+    // A staged mapping writes back when it's unmapped, it can't be parked.
+    if (gralloc_map_cache_is_cacheable(entry) && (entry->linear || entry->bo_data.map_shadow))
+        gralloc_map_cache_park(entry);
+    else
+        gralloc_gbm_unmap(entry);
+}
 
-    return err;
+static int gralloc_gm_lock_timeout() {
+    static const int timeout_ms = property_get_int32(GRALLOC_LOCK_TIMEOUT_PROP, GRALLOC_LOCK_DEFAULT_TIMEOUT_MS);
+    return timeout_ms;
 }
 
-static void gralloc_gbm_unmap(struct gbm_bo *bo) {
-    bo_data_t *bo_data = (bo_data_t *)gbm_bo_get_user_data(bo);
+/*
+ * Let the kernel wait for the acquire fence: a linear BO which isn't locked
+ * yet starts its CPU access with DMA_BUF_IOCTL_SYNC, which waits for the
+ * fences of the dma-buf. Once imported, the fence is also waited for by the
+ * implicit-sync users of the dma-buf, not only by us.
+ * Must be called with the mutex of entry->cpu_lock held, by the lock which goes on to
+ * gralloc_gbm_begin_cpu_access() without releasing it.
+ * @return true if the fence has signaled or has been imported, false if the
+ *         caller has to wait for it.
+ */
+static bool gralloc_gbm_import_acquire_fence(gralloc_bo_entry_t *entry, int usage, int fence_fd) {
+    if (gralloc_fence_is_signaled(fence_fd) == 1)
+        return true;
+
+    if (!entry->linear || entry->bo_data.lock_count ||
+        !(usage & (GRALLOC_USAGE_SW_READ_MASK | GRALLOC_USAGE_SW_WRITE_MASK)))
+        return false;
 
-    log_v("unmapped bo %p", bo);
-    gbm_bo_unmap(bo, bo_data->map_data);
-    bo_data->map_data = NULL;
+    // The producer of the acquire fence writes the buffer.
+    return !gralloc_dma_buf_import_fence(gralloc_handle(entry->handle)->prime_fd, fence_fd, true);
 }
 
-int gralloc_gbm_bo_lock(buffer_handle_t handle,
-                        int usage, int /*x*/, int /*y*/, int /*w*/, int /*h*/,
-                        void **addr)
+/*
+ * @fence_fd the acquire fence, -1 if none. It is owned by the caller.
+ */
+static int gralloc_gbm_bo_lock_impl(buffer_handle_t handle,
+                        int usage, int x, int y, int w, int h,
+                        void **addr, int fence_fd)
 {
     struct gralloc_handle_t *gbm_handle = gralloc_handle(handle);
-    struct gbm_bo *bo = gralloc_get_gbm_bo_from_handle(handle);
+    gralloc_bo_entry_t *entry = gralloc_get_bo_entry(handle);
     bo_data_t *bo_data;
+    int err = 0;
 
-    if (!bo)
+    if (!entry)
         return -EINVAL;
 
     if ((gbm_handle->usage & usage) != (uint32_t)usage) {
@@ -480,147 +1762,337 @@ int gralloc_gbm_bo_lock(buffer_handle_t handle,
         }
     }
 
-    bo_data = (bo_data_t *)gbm_bo_get_user_data(bo);
-    if (!bo_data) {
-        bo_data = new struct bo_data();
-        gbm_bo_set_user_data(bo, bo_data, gralloc_gbm_destroy_user_data);
-    }
+    bo_data = &entry->bo_data;
+    bool write = usage & GRALLOC_USAGE_SW_WRITE_MASK;
+    pid_t tid = gettid();
+    int timeout_ms = gralloc_gm_lock_timeout();
+    bool waited = false, timed_out = timeout_ms <= 0;
+    GrallocBoLock::Clock::time_point deadline;
 
-    log_v("lock bo %p, cnt=%d, usage=%x, prime_fd=%d", bo, bo_data->lock_count, usage, gbm_handle->prime_fd);
+    std::unique_lock<std::mutex> lock(entry->cpu_lock.mutex());
+    log_v("lock bo %p, cnt=%d, usage=%x, prime_fd=%d", entry->bo, bo_data->lock_count, usage, gbm_handle->prime_fd);
 
-    /* allow multiple locks with compatible usages */
-    if (bo_data->lock_count && (bo_data->locked_for & usage) != usage)
-        return -EINVAL;
+    /*
+     * An imported fence is only waited for by the DMA_BUF_IOCTL_SYNC of the
+     * lock which starts the CPU access. The import is decided under the lock,
+     * and a lock which can import it takes the BO below without waiting, so
+     * it's this lock which issues the SYNC. Any other fence is waited for
+     * here, without holding the lock.
+     */
+    if (fence_fd >= 0 && !gralloc_gbm_import_acquire_fence(entry, usage, fence_fd)) {
+        lock.unlock();
+        err = gralloc_fence_wait(fence_fd, gralloc_fence_default_timeout());
+        if (err)
+            return err;
+        lock.lock();
+    }
+
+    /*
+     * Wait for the writer to go, or for the readers if we write. The mapping
+     * is shared by all of the locks: it is only replaced once the last lock
+     * is dropped (-EBUSY), if it doesn't cover the rows we want. A thread
+     * never waits for its own locks, that would be until the timeout.
+     */
+    for (;;) {
+        if (!gralloc_bo_entry_is_live(entry, handle)) {
+            log_e("Buffer %p was freed while waiting for its lock", handle);
+            return -EINVAL;
+        }
+        err = entry->cpu_lock.check(write, tid);
+        if (err == -EDEADLK) {
+            log_e("bo %p is locked for reading by this thread, it can't be locked for writing", entry->bo);
+            return -EBUSY;
+        }
+        if (!err) {
+            int lock_usage = usage | bo_data->locked_for;
+            if (!(lock_usage & (GRALLOC_USAGE_SW_WRITE_MASK | GRALLOC_USAGE_SW_READ_MASK)))
+                break;
+            err = gralloc_gbm_map(entry, !!(lock_usage & GRALLOC_USAGE_SW_WRITE_MASK),
+                                  gralloc_gm_prefault_for_usage(usage), y, h, addr);
+            if (err != -EBUSY)
+                break;
+            if (entry->cpu_lock.held(tid)) {
+                log_e("The mapping of bo %p locked by this thread doesn't cover rows [%d, %d)",
+                      entry->bo, y, y + h);
+                return -EBUSY;
+            }
+        }
+        if (timed_out) {
+            log_e("Timed out waiting for the other locks of bo %p, usage=%x", entry->bo, usage);
+            return -EBUSY;
+        }
 
-    usage |= bo_data->locked_for;
+        if (!waited) {
+            _map_lock_waits.fetch_add(1, std::memory_order_relaxed);
+            deadline = GrallocBoLock::Clock::now() + std::chrono::milliseconds(timeout_ms);
+            waited = true;
+        }
+        // One last try after the timeout.
+        timed_out = !entry->cpu_lock.wait(lock, deadline);
+    }
+    if (err)
+        return err;
 
-    if (usage & (GRALLOC_USAGE_SW_WRITE_MASK |
-             GRALLOC_USAGE_SW_READ_MASK)) {
-        /* the driver is supposed to wait for the bo */
-        int write = !!(usage & GRALLOC_USAGE_SW_WRITE_MASK);
-        int err = gralloc_gbm_map(handle, write, addr);
-        if (err)
+    if (bo_data->map_shadow && (usage & (GRALLOC_USAGE_SW_WRITE_MASK | GRALLOC_USAGE_SW_READ_MASK))) {
+        err = gralloc_gbm_shadow_begin(entry, usage, x, y, w, h);
+        if (err) {
+            if (!bo_data->lock_count)
+                gralloc_gbm_release_mapping(entry);
             return err;
+        }
     }
-    else {
-        /* kernel handles the synchronization here */
+
+    if (!bo_data->lock_count && (usage & (GRALLOC_USAGE_SW_WRITE_MASK | GRALLOC_USAGE_SW_READ_MASK))) {
+        err = gralloc_gbm_begin_cpu_access(entry, usage);
+        if (err) {
+            gralloc_gbm_release_mapping(entry);
+            return err;
+        }
     }
 
+    entry->cpu_lock.acquire(write, tid);
     bo_data->lock_count++;
     bo_data->locked_for |= usage;
 
     return 0;
 }
 
-int gralloc_gbm_bo_unlock(buffer_handle_t handle) {
-    struct gbm_bo *bo = gralloc_get_gbm_bo_from_handle(handle);
+static int gralloc_gbm_bo_lock_fenced(buffer_handle_t handle, int usage, int x, int y, int w, int h,
+                                      void **addr, int fence_fd) {
+    uint64_t start_ns = gralloc_stats_begin();
+    int ret = gralloc_gbm_bo_lock_impl(handle, usage, x, y, w, h, addr, fence_fd);
+    gralloc_stats_end(GRALLOC_STATS_LOCK, start_ns, ret);
+    return ret;
+}
+
+int gralloc_gbm_bo_lock(buffer_handle_t handle, int usage, int x, int y, int w, int h, void **addr) {
+    return gralloc_gbm_bo_lock_fenced(handle, usage, x, y, w, h, addr, -1);
+}
+
+/*
+ * @queued_work set if the unlock left work to the GPU: the write-back of a
+ * staged mapping, or of the dirty region of a shadow.
+ */
+static int gralloc_gbm_bo_unlock_impl(buffer_handle_t handle, bool *queued_work) {
+    gralloc_bo_entry_t *entry = gralloc_get_bo_entry(handle);
     bo_data_t *bo_data;
-    if (!bo)
+    *queued_work = false;
+    if (!entry)
         return -EINVAL;
 
-    bo_data = (bo_data_t *)gbm_bo_get_user_data(bo);
-
-    int mapped = bo_data->locked_for &
-        (GRALLOC_USAGE_SW_WRITE_MASK | GRALLOC_USAGE_SW_READ_MASK);
+    bo_data = &entry->bo_data;
 
+    std::unique_lock<std::mutex> lock(entry->cpu_lock.mutex());
+    if (!gralloc_bo_entry_is_live(entry, handle))
+        return -EINVAL;
     if (!bo_data->lock_count) {
         log_v("unlock on already unlocked BO");
         return 0;
     }
 
-    if (mapped)
-        gralloc_gbm_unmap(bo);
-
+    bool released = entry->cpu_lock.release(gettid());
     bo_data->lock_count--;
-    if (!bo_data->lock_count)
+    if (!bo_data->lock_count) {
         bo_data->locked_for = 0;
+        *queued_work = bo_data->map_shadow ? bo_data->dirty_w != 0 :
+                       bo_data->map_data && !bo_data->map_direct &&
+                       (bo_data->map_flags & GBM_BO_TRANSFER_WRITE);
+        if (gralloc_gbm_shadow_write_back(entry, false)) {
+            log_e("Lost the CPU writes to bo %p", entry->bo);
+            gralloc_gbm_unmap(entry);
+            *queued_work = false;
+        }
+        gralloc_gbm_end_cpu_access(entry);
+        gralloc_gbm_release_mapping(entry);
+    }
 
+    if (released) {
+        lock.unlock();
+        entry->cpu_lock.notify();
+    }
     return 0;
 }
 
-int gralloc_gbm_bo_lock_ycbcr(buffer_handle_t handle,
+static int gralloc_gbm_bo_unlock_queued(buffer_handle_t handle, bool *queued_work) {
+    uint64_t start_ns = gralloc_stats_begin();
+    int ret = gralloc_gbm_bo_unlock_impl(handle, queued_work);
+    gralloc_stats_end(GRALLOC_STATS_UNLOCK, start_ns, ret);
+    return ret;
+}
+
+int gralloc_gbm_bo_unlock(buffer_handle_t handle) {
+    bool queued_work;
+    return gralloc_gbm_bo_unlock_queued(handle, &queued_work);
+}
+
+static int gralloc_gbm_bo_lock_ycbcr_fenced(buffer_handle_t handle,
                                 int usage, int x, int y, int w, int h,
-                                struct android_ycbcr *ycbcr) {
+                                struct android_ycbcr *ycbcr, int fence_fd) {
     struct gralloc_handle_t *hnd = gralloc_handle(handle);
-    int ystride, cstride;
+    const gralloc_android_format_desc_t *android_desc;
+    const gralloc_gbm_format_desc_t *desc;
+    gralloc_bo_entry_t *entry;
     void *addr = 0;
     int err;
 
     log_v("handle %p, hnd %p, usage 0x%x", handle, hnd, usage);
 
-    err = gralloc_gbm_bo_lock(handle, usage, x, y, w, h, &addr);
+    entry = gralloc_get_bo_entry(handle);
+    android_desc = hnd ? gralloc_get_android_format_desc(hnd->format) : nullptr;
+    desc = android_desc ? gralloc_get_gbm_format_desc(android_desc->gbm_format) : nullptr;
+    if (!entry || !desc || desc->num_planes < 2 || entry->info.num_planes < desc->num_planes) {
+        log_e("Can not lock buffer, invalid format: 0x%x", hnd ? hnd->format : 0);
+        return -EINVAL;
+    }
+
+    // The chroma planes follow the luma rows, so map the whole buffer.
+    err = gralloc_gbm_bo_lock_fenced(handle, usage, 0, 0, 0, 0, &addr, fence_fd);
     if (err)
         return err;
 
-    memset(ycbcr->reserved, 0, sizeof(ycbcr->reserved));
-
-    switch (hnd->format) {
-    case HAL_PIXEL_FORMAT_YCrCb_420_SP:
-        ystride = cstride = ALIGN(hnd->width, 16);
-        ycbcr->y = addr;
-        ycbcr->cr = (unsigned char *)addr + ystride * hnd->height;
-        ycbcr->cb = (unsigned char *)addr + ystride * hnd->height + 1;
-        ycbcr->ystride = ystride;
-        ycbcr->cstride = cstride;
-        ycbcr->chroma_step = 2;
-        break;
-    case HAL_PIXEL_FORMAT_YV12:
-        ystride = hnd->width;
-        cstride = ALIGN(ystride / 2, 16);
-        ycbcr->y = addr;
-        ycbcr->cr = (unsigned char *)addr + ystride * hnd->height;
-        ycbcr->cb = (unsigned char *)addr + ystride * hnd->height + cstride * hnd->height / 2;
-        ycbcr->ystride = ystride;
-        ycbcr->cstride = cstride;
-        ycbcr->chroma_step = 1;
-        break;
-    default:
-        log_e("Can not lock buffer, invalid format: 0x%x", hnd->format);
+    // gbm_bo_map() only maps the first plane of a BO which has several ones.
+    if (!entry->bo_data.map_direct && gbm_bo_get_plane_count(entry->bo) > 1) {
+        log_e("Can not lock the chroma planes of a non-linear buffer, format: 0x%x", hnd->format);
+        gralloc_gbm_bo_unlock(handle);
         return -EINVAL;
     }
 
+    memset(ycbcr, 0, sizeof(*ycbcr));
+    ycbcr->y = addr;
+    ycbcr->ystride = entry->info.strides[0];
+
+    // Find Cb and Cr in the plane layouts, addr points to the first plane.
+    for (uint32_t plane = 1; plane < desc->num_planes; plane++) {
+        const gralloc_plane_desc_t *plane_desc = &desc->planes[plane];
+        uint8_t *plane_addr = (uint8_t *)addr + entry->info.offsets[plane] - entry->info.offsets[0];
+
+        for (uint32_t comp = 0; comp < plane_desc->num_components; comp++) {
+            uint8_t *comp_addr = plane_addr + plane_desc->components[comp].offset_bits / 8;
+            if (plane_desc->components[comp].type == GRALLOC_COMPONENT_CB)
+                ycbcr->cb = comp_addr;
+            else if (plane_desc->components[comp].type == GRALLOC_COMPONENT_CR)
+                ycbcr->cr = comp_addr;
+        }
+        ycbcr->cstride = entry->info.strides[plane];
+        ycbcr->chroma_step = plane_desc->sample_increment_bits / 8;
+    }
+
     return 0;
 }
 
+int gralloc_gbm_bo_lock_ycbcr(buffer_handle_t handle,
+                                int usage, int x, int y, int w, int h,
+                                struct android_ycbcr *ycbcr) {
+    return gralloc_gbm_bo_lock_ycbcr_fenced(handle, usage, x, y, w, h, ycbcr, -1);
+}
+
 int gralloc_gbm_bo_lock_async(buffer_handle_t handle, int usage, int x, int y, int w, int h, void **addr, int fence_fd) {
-    // Waiting for fence signal
-    if (fence_fd >= 0) {
-        int err = sync_wait(fence_fd, 3000);
-        if (err < 0) return err;
+    int err = gralloc_gbm_bo_lock_fenced(handle, usage, x, y, w, h, addr, fence_fd);
+    if (fence_fd >= 0)
         close(fence_fd);
+    return err;
+}
+
+typedef struct gralloc_deferred_lock {
+    buffer_handle_t handle;
+    int usage;
+    int x, y, w, h;
+    gralloc_lock_callback_t callback;
+    void *data;
+    int status; // of the fence
+} gralloc_deferred_lock_t;
+
+// Deferred locks whose fence is done, taken in order by the lock worker.
+static std::once_flag _deferred_lock_once;
+static std::mutex _deferred_lock_mutex;
+static std::condition_variable _deferred_lock_cond;
+static std::deque<gralloc_deferred_lock_t *> _deferred_lock_queue;
+
+static void gralloc_gbm_deferred_lock_worker() {
+    pthread_setname_np(pthread_self(), "gralloc_lock");
+
+    for (;;) {
+        gralloc_deferred_lock_t *lock;
+        {
+            std::unique_lock<std::mutex> guard(_deferred_lock_mutex);
+            _deferred_lock_cond.wait(guard, [] { return !_deferred_lock_queue.empty(); });
+            lock = _deferred_lock_queue.front();
+            _deferred_lock_queue.pop_front();
+        }
+
+        void *addr = nullptr;
+        int status = lock->status;
+        if (!status)
+            status = gralloc_gbm_bo_lock(lock->handle, lock->usage, lock->x, lock->y, lock->w, lock->h, &addr);
+        lock->callback(status, addr, lock->data);
+        delete lock;
+    }
+}
+
+// Runs on the fence worker, which only hands the lock over.
+static void gralloc_gbm_bo_lock_signaled(int status, void *data) {
+    auto *lock = static_cast<gralloc_deferred_lock_t *>(data);
+
+    lock->status = status;
+    {
+        std::lock_guard<std::mutex> guard(_deferred_lock_mutex);
+        _deferred_lock_queue.push_back(lock);
+    }
+    _deferred_lock_cond.notify_one();
+}
+
+int gralloc_gbm_bo_lock_deferred(buffer_handle_t handle, int usage, int x, int y, int w, int h,
+                                 int fence_fd, gralloc_lock_callback_t callback, void *data) {
+    auto *lock = new (std::nothrow) gralloc_deferred_lock_t{handle, usage, x, y, w, h, callback, data, 0};
+    if (!lock || !callback) {
+        delete lock;
+        if (fence_fd >= 0)
+            close(fence_fd);
+        return lock ? -EINVAL : -ENOMEM;
     }
-    return gralloc_gbm_bo_lock(handle, usage, x, y, w, h, addr);
+
+    std::call_once(_deferred_lock_once, [] { std::thread(gralloc_gbm_deferred_lock_worker).detach(); });
+
+    int err = gralloc_fence_wait_async(fence_fd, gralloc_fence_default_timeout(),
+                                       gralloc_gbm_bo_lock_signaled, lock);
+    if (err)
+        delete lock;
+    return err;
 }
 
 int gralloc_gbm_bo_unlock_async(buffer_handle_t handle, int *fence_fd) {
-    int ret = gralloc_gbm_bo_unlock(handle);
+    bool queued_work;
+    int ret = gralloc_gbm_bo_unlock_queued(handle, &queued_work);
     if (ret != 0) {
         return ret;
     }
-    
-    if (fence_fd) {
-        *fence_fd = -1;
-    }
+
+    if (!fence_fd)
+        return 0;
+
+    /*
+     * The CPU access is over, but the write-back of a staged mapping or of a
+     * shadow may still run on the GPU: the fences which a reader has to wait
+     * for cover it. Nothing is pending after any other unlock.
+     */
+    *fence_fd = -1;
+    if (queued_work)
+        gralloc_dma_buf_export_fence(gralloc_handle(handle)->prime_fd, false, fence_fd);
     return 0;
 }
 
 int gralloc_gbm_bo_lock_async_ycbcr(buffer_handle_t handle, int usage, int x, int y, int w, int h, struct android_ycbcr *ycbcr, int fence_fd) {
-    // Waiting for fence signal
-    if (fence_fd >= 0) {
-        int err = sync_wait(fence_fd, 3000); // timeout: 3s
-        if (err < 0) {
-            log_e("sync_wait failed: %s", strerror(-err));
-            return err;
-        }
+    int err = gralloc_gbm_bo_lock_ycbcr_fenced(handle, usage, x, y, w, h, ycbcr, fence_fd);
+    if (fence_fd >= 0)
         close(fence_fd);
-    }
-    return gralloc_gbm_bo_lock_ycbcr(handle, usage, x, y, w, h, ycbcr);
+    return err;
 }
 
-int gralloc_gm_buffer_import(buffer_handle_t buffer_handle) {
+static int gralloc_gm_buffer_import_impl(buffer_handle_t buffer_handle) {
     struct gbm_bo *bo;
     struct gbm_device *dev = nullptr;
     struct gralloc_handle_t *handle = gralloc_handle(buffer_handle);
+    gralloc_bo_cache_key_t key;
 #ifdef GBM_BO_IMPORT_FD_MODIFIER
     struct gbm_import_fd_modifier_data data;
 #else
@@ -632,15 +2104,30 @@ int gralloc_gm_buffer_import(buffer_handle_t buffer_handle) {
         return -EINVAL;
     }
 
-    {
-        // std::lock_guard<std::mutex> lock(_gbm_bo_handle_map_mutex);
-        if (gbm_bo_handle_map.count(buffer_handle)) {
-            log_e("Duplicated buffer was requested to be imported.");
-            return -EINVAL;
-        }
+    // The fields of its version must fit in the handle before we read them.
+    if (!gralloc_handle_validate(buffer_handle)) {
+        log_e("Not a gralloc handle, or too short for its version: numFds=%d numInts=%d",
+              buffer_handle->numFds, buffer_handle->numInts);
+        return -EINVAL;
+    }
+
+    if (gbm_bo_handle_map.contains(buffer_handle)) {
+        log_e("Duplicated buffer was requested to be imported.");
+        return -EINVAL;
+    }
+
+    // Linear buffers of the heap usages are mapped without GBM, like the allocator did.
+    if (gralloc_heap_is_eligible(handle->format, gralloc_handle_usage(handle)) &&
+        handle->version >= 5 && handle->num_planes && handle->modifier == DRM_FORMAT_MOD_LINEAR) {
+        int ret = gralloc_bo_entry_register(buffer_handle, nullptr, false);
+        if (ret)
+            log_e("Failed to register imported dma-buf, err=%d.", ret);
+        return ret ? -EINVAL : 0;
     }
 
-    gralloc_gbm_device_create(_gbm_dev_fd, &dev);
+    // The same device which allocated it, so the import stays on one device.
+    gralloc_device_route_t route = gralloc_device_route_for_usage(handle->usage);
+    dev = gralloc_device_get(route);
     if (!dev) {
         log_e("Invalid GBM device.");
         return -EINVAL;
@@ -651,53 +2138,100 @@ int gralloc_gm_buffer_import(buffer_handle_t buffer_handle) {
         return -EINVAL;
     }
 
-    int format = gralloc_gm_android_format_to_gbm_format(handle->format);
+    uint32_t format = gralloc_gm_android_format_to_gbm_format(handle->format);
     if (format == 0) {
         log_e("Unsupported format: %d", handle->format);
         return -EINVAL;
     }
 
+    // The handles made before version 5 always carry planar YUV in a stand-in BO.
+    bool has_planes = handle->version >= 5 && handle->num_planes;
+    uint32_t bo_format = has_planes ? handle->gbm_format : gralloc_gm_yuv_fallback_format(format);
+    if (!bo_format)
+        bo_format = format;
+
     memset(&data, 0, sizeof(data));
     data.width = handle->width;
     data.height = handle->height;
-    data.format = format;
+    data.format = bo_format;
     
     if (handle->usage & GRALLOC_USAGE_CURSOR) {
         data.width = ALIGN(MAX(handle->width, 64), 16);
         data.height = ALIGN(MAX(handle->height, 64), 16);
     }
 
-    /* Adjust the width and height for a GBM GR88 buffer */
-    if (handle->format == HAL_PIXEL_FORMAT_YV12) {
-        data.width = ALIGN(handle->width, 32) / 2;
-        data.height = handle->height + ALIGN(handle->height, 2) / 2;
-    }
+    /* Adjust the width and height for a single-plane stand-in */
+    if (bo_format != format)
+        gralloc_gm_yuv_fallback_size(format, handle->width, handle->height, &data.width, &data.height);
+
+    // A layered BO has all of the layers below each other.
+    uint32_t layer_count = gralloc_handle_layer_count(handle);
+    data.height = gralloc_gm_layer_rows(data.height, layer_count) * layer_count;
 
 #ifdef GBM_BO_IMPORT_FD_MODIFIER
     data.num_fds = 1;
     data.fds[0] = handle->prime_fd;
     data.strides[0] = handle->stride;
     data.modifier = handle->modifier;
-    bo = gbm_bo_import(dev, GBM_BO_IMPORT_FD_MODIFIER, &data, 0);
+    // Every plane of a planar BO lives in the same dma-buf.
+    if (has_planes && bo_format == format) {
+        data.num_fds = MIN(handle->num_planes, GRALLOC_HANDLE_MAX_PLANES);
+        for (uint32_t plane = 0; plane < data.num_fds; plane++) {
+            data.fds[plane] = handle->prime_fd;
+            data.strides[plane] = handle->strides[plane];
+            data.offsets[plane] = handle->offsets[plane];
+        }
+    }
 #else
     data.fd = handle->prime_fd;
     data.stride = handle->stride;
-    bo = gbm_bo_import(dev, GBM_BO_IMPORT_FD, &data, 0);
 #endif
 
-    if (!bo) {
-        log_e("gbm_bo_import failed: %s (width=%d, height=%d, format=%d, stride=%d)",
-              strerror(errno), data.width, data.height, format, 
-              #ifdef GBM_BO_IMPORT_FD_MODIFIER
-              data.strides[0]
-              #else
-              data.stride
-              #endif
-              );
+    // Another handle of the dma-buf may have imported it already (gralloc_gbm_bo_cache.h).
+    int ret = gralloc_bo_cache_make_key(handle->prime_fd, &key);
+    if (ret) {
+        log_e("Failed to stat prime_fd %d, err=%d", handle->prime_fd, ret);
         return -EINVAL;
     }
+    key.route = route;
+    key.format = data.format;
+    key.width = data.width;
+    key.height = data.height;
+    key.stride = handle->stride;
+    key.modifier = handle->modifier;
+
+    bo = gralloc_bo_cache_get(&key);
+    if (!bo) {
+#ifdef GBM_BO_IMPORT_FD_MODIFIER
+        bo = gbm_bo_import(dev, GBM_BO_IMPORT_FD_MODIFIER, &data, 0);
+#else
+        bo = gbm_bo_import(dev, GBM_BO_IMPORT_FD, &data, 0);
+#endif
+
+        if (!bo) {
+            log_e("gbm_bo_import failed: %s (width=%d, height=%d, format=%d, stride=%d)",
+                  strerror(errno), data.width, data.height, format, 
+                  #ifdef GBM_BO_IMPORT_FD_MODIFIER
+                  data.strides[0]
+                  #else
+                  data.stride
+                  #endif
+                  );
+            return -EINVAL;
+        }
+
+        bo = gralloc_bo_cache_add(&key, bo);
+        if (!bo)
+            return -ENOMEM;
+    }
 
-    gbm_bo_handle_map.emplace(buffer_handle, bo);
+    // Another thread may have imported the same handle meanwhile.
+    ret = gralloc_bo_entry_register(buffer_handle, bo, false);
+    if (ret) {
+        log_e("Failed to register imported BO, err=%d.", ret);
+        gralloc_bo_cache_put(bo);
+        return -EINVAL;
+    }
 
     log_v("imported buffer: bo %p, prime_fd=%d, width=%d, height=%d, handle->stride=%d, format=%d",
         bo, handle->prime_fd, handle->width, handle->height, handle->stride, format);
@@ -706,34 +2240,32 @@ int gralloc_gm_buffer_import(buffer_handle_t buffer_handle) {
 
 }
 
-int gralloc_gm_buffer_free(buffer_handle_t handle) {
-    struct gbm_bo *bo = gralloc_get_gbm_bo_from_handle(handle);
+int gralloc_gm_buffer_import(buffer_handle_t buffer_handle) {
+    uint64_t start_ns = gralloc_stats_begin();
+    int ret = gralloc_gm_buffer_import_impl(buffer_handle);
+    gralloc_stats_end(GRALLOC_STATS_IMPORT, start_ns, ret);
+    return ret;
+}
+
+static int gralloc_gm_buffer_free_impl(buffer_handle_t handle) {
     auto hnd = gralloc_handle(handle);
 
     if (!hnd) {
-        log_e("Failed to convert buffer_handle_t to gralloc_handle_t, err=%d", -errno);
-        return -errno;
-    }
-
-    if (!bo) {
-        log_e("Failed to get BO from handle, err=%d", -errno);
-        return -errno;
-    }
-
-    // std::lock_guard<std::mutex> lock(_gbm_bo_handle_map_mutex);
-    bo = gralloc_get_gbm_bo_from_handle(handle);
-    if (!bo) {
-        log_e("Failed to get BO from handle, err=%d", -errno);
-        return -errno;
+        log_e("Failed to convert buffer_handle_t to gralloc_handle_t.");
+        return -EINVAL;
     }
-    gbm_bo_handle_map.erase(handle);
 
-    auto it_bo = gbm_bo_handle_map.find(handle);
-    if (it_bo != gbm_bo_handle_map.end()) {
-        gbm_bo_handle_map.erase(it_bo);
+    // Only the thread which removes the entry owns the BO from now on.
+    struct gbm_bo *bo = nullptr;
+    if (gralloc_bo_entry_unregister(handle, &bo)) {
+        log_e("Failed to get BO from handle %p.", handle);
+        return -EINVAL;
     }
 
-    gbm_bo_destroy(bo);
+    // Imported BOs may be shared with other handles, the cache decides.
+    // The BO is destroyed by the reaper, off this thread.
+    if (bo && !gralloc_bo_cache_put(bo))
+        gralloc_reaper_destroy(bo);
 
     log_v("freed buffer: prime_fd=%d, width=%d, height=%d, hnd->stride=%d",
         hnd->prime_fd, hnd->width, hnd->height, hnd->stride);
@@ -741,10 +2273,20 @@ int gralloc_gm_buffer_free(buffer_handle_t handle) {
     return 0;
 }
 
+int gralloc_gm_buffer_free(buffer_handle_t handle) {
+    uint64_t start_ns = gralloc_stats_begin();
+    int ret = gralloc_gm_buffer_free_impl(handle);
+    gralloc_stats_end(GRALLOC_STATS_FREE, start_ns, ret);
+    return ret;
+}
+
+void gralloc_gm_buffer_free_drain() {
+    gralloc_reaper_drain();
+}
+
 __attribute__((destructor)) void _cleanup_all() {
-    _gbm_dev_fd = -1;
-    if (_gbm_dev) {
-        gbm_device_destroy(_gbm_dev);
-        _gbm_dev = nullptr;
-    }
+    gralloc_bo_cache_trim();
+    // The devices must outlive their BOs.
+    gralloc_reaper_drain();
+    gralloc_device_manager_deinit();
 }
\ No newline at end of file
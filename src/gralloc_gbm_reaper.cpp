@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2025  Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ *
+ * Authors:
+ *      Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ */
+
+#include "gralloc_gbm_reaper.h"
+
+#define LOG_TAG "libgralloc_gm"
+
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <cutils/properties.h>
+
+#include "log.h"
+
+static std::once_flag _reaper_once;
+static std::mutex _reaper_mutex;
+static std::condition_variable _reaper_work_cond; // wakes the worker up
+static std::condition_variable _reaper_done_cond; // wakes gralloc_reaper_drain() up
+static std::vector<struct gbm_bo *> _reaper_queue;
+static bool _reaper_enabled = false;
+static gralloc_reaper_stats_t _reaper_stats = {};
+
+static void gralloc_reaper_worker() {
+    std::vector<struct gbm_bo *> batch;
+
+    pthread_setname_np(pthread_self(), "gralloc_reaper");
+    if (setpriority(PRIO_PROCESS, gettid(), GRALLOC_REAPER_NICE))
+        log_w("Failed to lower the priority of the reaper, err=%d", errno);
+
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(_reaper_mutex);
+            _reaper_work_cond.wait(lock, [] { return !_reaper_queue.empty(); });
+            batch.swap(_reaper_queue);
+            _reaper_stats.batches++;
+            if (batch.size() > _reaper_stats.max_batch)
+                _reaper_stats.max_batch = (uint32_t)batch.size();
+        }
+
+        for (struct gbm_bo *bo : batch)
+            gbm_bo_destroy(bo);
+        log_v("destroyed %zu BOs", batch.size());
+
+        {
+            std::lock_guard<std::mutex> lock(_reaper_mutex);
+            _reaper_stats.destroyed += batch.size();
+        }
+        _reaper_done_cond.notify_all();
+        batch.clear();
+    }
+}
+
+static void gralloc_reaper_init() {
+    if (!property_get_bool(GRALLOC_REAPER_PROP, true)) {
+        log_i("BOs are destroyed by the threads which free them.");
+        return;
+    }
+
+    _reaper_queue.reserve(GRALLOC_REAPER_MAX_PENDING);
+    std::thread(gralloc_reaper_worker).detach();
+    _reaper_enabled = true;
+}
+
+void gralloc_reaper_destroy(struct gbm_bo *bo) {
+    if (!bo)
+        return;
+
+    std::call_once(_reaper_once, gralloc_reaper_init);
+    {
+        std::lock_guard<std::mutex> lock(_reaper_mutex);
+        if (_reaper_enabled && _reaper_queue.size() < GRALLOC_REAPER_MAX_PENDING) {
+            _reaper_queue.push_back(bo);
+            _reaper_stats.queued++;
+            bo = nullptr;
+        } else {
+            _reaper_stats.inline_destroys++;
+        }
+    }
+
+    if (bo)
+        gbm_bo_destroy(bo);
+    else
+        _reaper_work_cond.notify_one();
+}
+
+void gralloc_reaper_drain() {
+    std::unique_lock<std::mutex> lock(_reaper_mutex);
+    uint64_t queued = _reaper_stats.queued;
+
+    _reaper_done_cond.wait(lock, [queued] { return _reaper_stats.destroyed >= queued; });
+}
+
+void gralloc_reaper_get_stats(gralloc_reaper_stats_t *stats) {
+    std::lock_guard<std::mutex> lock(_reaper_mutex);
+
+    *stats = _reaper_stats;
+    stats->pending = (uint32_t)(_reaper_stats.queued - _reaper_stats.destroyed);
+}
@@ -0,0 +1,210 @@
+/*
+ * Copyright (C) 2025  Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ *
+ * Authors:
+ *      Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ */
+
+#include "gralloc_gbm_stats.h"
+
+#define LOG_TAG "libgralloc_gm"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include <atomic>
+
+#include <hardware/gralloc.h>
+
+#include "gralloc_gbm_formats.h"
+
+#define GRALLOC_STATS_NUM_FORMATS \
+    (sizeof(gralloc_formats::kAndroidFormats) / sizeof(gralloc_formats::kAndroidFormats[0]))
+
+static_assert(GRALLOC_STATS_NUM_FORMATS <= GRALLOC_STATS_MAX_FORMATS,
+              "raise GRALLOC_STATS_MAX_FORMATS");
+static_assert((GRALLOC_STATS_SHARDS & (GRALLOC_STATS_SHARDS - 1)) == 0,
+              "GRALLOC_STATS_SHARDS must be a power of two");
+
+static const char *const _stats_op_names[GRALLOC_STATS_NUM_OPS] = {
+    "allocate", "import", "lock", "unlock", "free",
+};
+
+const char *gralloc_stats_op_name(gralloc_stats_op_t op) {
+    return op < GRALLOC_STATS_NUM_OPS ? _stats_op_names[op] : "unknown";
+}
+
+static uint64_t gralloc_stats_bucket_lower(uint32_t bucket) {
+    if (bucket < GRALLOC_STATS_SUB_BUCKETS)
+        return bucket;
+
+    uint32_t exponent = bucket / GRALLOC_STATS_SUB_BUCKETS + GRALLOC_STATS_SUB_BUCKET_BITS - 1;
+    uint64_t sub = bucket % GRALLOC_STATS_SUB_BUCKETS;
+    return (GRALLOC_STATS_SUB_BUCKETS + sub) << (exponent - GRALLOC_STATS_SUB_BUCKET_BITS);
+}
+
+uint64_t gralloc_stats_hist_percentile(const uint64_t *latency_ns, double percentile) {
+    uint64_t total = 0, seen = 0;
+
+    for (uint32_t i = 0; i < GRALLOC_STATS_HIST_BUCKETS; i++)
+        total += latency_ns[i];
+    if (!total)
+        return 0;
+
+    uint64_t rank = (uint64_t)(percentile / 100.0 * (double)total + 0.5);
+    if (rank < 1)
+        rank = 1;
+    for (uint32_t i = 0; i < GRALLOC_STATS_HIST_BUCKETS; i++) {
+        seen += latency_ns[i];
+        if (seen >= rank)
+            return i + 1 < GRALLOC_STATS_HIST_BUCKETS ? gralloc_stats_bucket_lower(i + 1) - 1 : UINT64_MAX;
+    }
+    return UINT64_MAX;
+}
+
+#if GRALLOC_STATS
+
+typedef struct gralloc_stats_shard_gauge {
+    std::atomic<int64_t> live_count;
+    std::atomic<int64_t> live_bytes;
+    std::atomic<uint64_t> allocated_bytes;
+} gralloc_stats_shard_gauge_t;
+
+typedef struct alignas(64) gralloc_stats_shard {
+    std::atomic<uint64_t> count[GRALLOC_STATS_NUM_OPS];
+    std::atomic<uint64_t> errors[GRALLOC_STATS_NUM_OPS];
+    gralloc_stats_shard_gauge_t formats[GRALLOC_STATS_NUM_FORMATS];
+    gralloc_stats_shard_gauge_t usages[GRALLOC_STATS_NUM_USAGE_CLASSES];
+    std::atomic<uint64_t> latency_ns[GRALLOC_STATS_NUM_OPS][GRALLOC_STATS_HIST_BUCKETS];
+} gralloc_stats_shard_t;
+
+static gralloc_stats_shard_t _stats_shards[GRALLOC_STATS_SHARDS];
+static std::atomic<uint32_t> _stats_next_shard{0};
+
+static gralloc_stats_shard_t *gralloc_stats_shard() {
+    static thread_local gralloc_stats_shard_t *shard = nullptr;
+    if (!shard)
+        shard = &_stats_shards[_stats_next_shard.fetch_add(1, std::memory_order_relaxed) &
+                               (GRALLOC_STATS_SHARDS - 1)];
+    return shard;
+}
+
+static uint32_t gralloc_stats_bucket(uint64_t ns) {
+    if (ns < GRALLOC_STATS_SUB_BUCKETS)
+        return (uint32_t)ns;
+
+    uint32_t exponent = 63 - __builtin_clzll(ns);
+    uint32_t bucket = (exponent - GRALLOC_STATS_SUB_BUCKET_BITS + 1) * GRALLOC_STATS_SUB_BUCKETS +
+                      (uint32_t)((ns >> (exponent - GRALLOC_STATS_SUB_BUCKET_BITS)) &
+                                 (GRALLOC_STATS_SUB_BUCKETS - 1));
+    return bucket < GRALLOC_STATS_HIST_BUCKETS ? bucket : GRALLOC_STATS_HIST_BUCKETS - 1;
+}
+
+static int gralloc_stats_format_index(uint32_t android_format) {
+    const gralloc_android_format_desc_t *desc = gralloc_get_android_format_desc(android_format);
+    return desc ? (int)(desc - gralloc_formats::kAndroidFormats) : -1;
+}
+
+static gralloc_stats_usage_class_t gralloc_stats_usage_class(uint32_t usage) {
+    if (usage & GRALLOC_USAGE_HW_CAMERA_MASK)
+        return GRALLOC_STATS_USAGE_CAMERA;
+    if (usage & GRALLOC_USAGE_HW_VIDEO_ENCODER)
+        return GRALLOC_STATS_USAGE_VIDEO;
+    if (usage & (GRALLOC_USAGE_HW_FB | GRALLOC_USAGE_CURSOR))
+        return GRALLOC_STATS_USAGE_DISPLAY;
+    if (usage & GRALLOC_USAGE_HW_RENDER)
+        return GRALLOC_STATS_USAGE_RENDER;
+    if (usage & (GRALLOC_USAGE_HW_TEXTURE | GRALLOC_USAGE_HW_COMPOSER))
+        return GRALLOC_STATS_USAGE_TEXTURE;
+    if (usage & (GRALLOC_USAGE_SW_READ_MASK | GRALLOC_USAGE_SW_WRITE_MASK))
+        return GRALLOC_STATS_USAGE_CPU;
+    return GRALLOC_STATS_USAGE_OTHER;
+}
+
+uint64_t gralloc_stats_begin() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void gralloc_stats_end(gralloc_stats_op_t op, uint64_t start_ns, int err) {
+    gralloc_stats_shard_t *shard = gralloc_stats_shard();
+
+    shard->count[op].fetch_add(1, std::memory_order_relaxed);
+    if (err)
+        shard->errors[op].fetch_add(1, std::memory_order_relaxed);
+    shard->latency_ns[op][gralloc_stats_bucket(gralloc_stats_begin() - start_ns)].fetch_add(
+            1, std::memory_order_relaxed);
+}
+
+static void gralloc_stats_gauge_add(gralloc_stats_shard_gauge_t *gauge, int64_t count, int64_t size,
+                                    bool allocated) {
+    gauge->live_count.fetch_add(count, std::memory_order_relaxed);
+    gauge->live_bytes.fetch_add(size, std::memory_order_relaxed);
+    if (allocated)
+        gauge->allocated_bytes.fetch_add((uint64_t)size, std::memory_order_relaxed);
+}
+
+void gralloc_stats_bo_registered(uint32_t android_format, uint32_t usage, uint64_t size, bool allocated) {
+    gralloc_stats_shard_t *shard = gralloc_stats_shard();
+    int format = gralloc_stats_format_index(android_format);
+
+    if (format >= 0)
+        gralloc_stats_gauge_add(&shard->formats[format], 1, (int64_t)size, allocated);
+    gralloc_stats_gauge_add(&shard->usages[gralloc_stats_usage_class(usage)], 1, (int64_t)size, allocated);
+}
+
+void gralloc_stats_bo_unregistered(uint32_t android_format, uint32_t usage, uint64_t size) {
+    gralloc_stats_shard_t *shard = gralloc_stats_shard();
+    int format = gralloc_stats_format_index(android_format);
+
+    // Another shard may go negative, only the sum makes sense.
+    if (format >= 0)
+        gralloc_stats_gauge_add(&shard->formats[format], -1, -(int64_t)size, false);
+    gralloc_stats_gauge_add(&shard->usages[gralloc_stats_usage_class(usage)], -1, -(int64_t)size, false);
+}
+
+static void gralloc_stats_gauge_sum(gralloc_stats_gauge_t *sum, const gralloc_stats_shard_gauge_t *gauge) {
+    sum->live_count += gauge->live_count.load(std::memory_order_relaxed);
+    sum->live_bytes += gauge->live_bytes.load(std::memory_order_relaxed);
+    sum->allocated_bytes += gauge->allocated_bytes.load(std::memory_order_relaxed);
+}
+
+int gralloc_stats_get_snapshot(gralloc_stats_snapshot_t *snapshot) {
+    if (!snapshot)
+        return -EINVAL;
+
+    memset(snapshot, 0, sizeof(*snapshot));
+    for (const auto& shard : _stats_shards) {
+        for (uint32_t op = 0; op < GRALLOC_STATS_NUM_OPS; op++) {
+            snapshot->ops[op].count += shard.count[op].load(std::memory_order_relaxed);
+            snapshot->ops[op].errors += shard.errors[op].load(std::memory_order_relaxed);
+            for (uint32_t i = 0; i < GRALLOC_STATS_HIST_BUCKETS; i++)
+                snapshot->ops[op].latency_ns[i] += shard.latency_ns[op][i].load(std::memory_order_relaxed);
+        }
+        for (uint32_t i = 0; i < GRALLOC_STATS_NUM_FORMATS; i++)
+            gralloc_stats_gauge_sum(&snapshot->format_gauges[i], &shard.formats[i]);
+        for (uint32_t i = 0; i < GRALLOC_STATS_NUM_USAGE_CLASSES; i++)
+            gralloc_stats_gauge_sum(&snapshot->usage_gauges[i], &shard.usages[i]);
+    }
+
+    snapshot->num_formats = GRALLOC_STATS_NUM_FORMATS;
+    for (uint32_t i = 0; i < GRALLOC_STATS_NUM_FORMATS; i++)
+        snapshot->formats[i] = gralloc_formats::kAndroidFormats[i].android_format;
+
+    gralloc_gbm_get_map_cache_stats(&snapshot->map_cache);
+    gralloc_bo_cache_get_stats(&snapshot->bo_cache);
+    gralloc_fence_get_stats(&snapshot->fence);
+    gralloc_reaper_get_stats(&snapshot->reaper);
+    return 0;
+}
+
+#else
+
+int gralloc_stats_get_snapshot(gralloc_stats_snapshot_t *snapshot) {
+    (void)snapshot;
+    return -ENOTSUP;
+}
+
+#endif // GRALLOC_STATS
@@ -27,12 +27,15 @@
 #define __ANDROID_GRALLOC_HANDLE_H__
 
 #include <cutils/native_handle.h>
+#include <stddef.h>
 #include <stdint.h>
 
 /* support users of drm_gralloc/gbm_gralloc */
 #define gralloc_gbm_handle_t gralloc_handle_t
 #define gralloc_drm_handle_t gralloc_handle_t
 
+#define GRALLOC_HANDLE_MAX_PLANES 4
+
 struct gralloc_handle_t {
 	native_handle_t base;
 
@@ -65,11 +68,31 @@ struct gralloc_handle_t {
 
 	union {
 		void *data; /* pointer to struct gralloc_gbm_bo_t */
-		uint64_t reserved;
+		uint64_t reserved; /* gralloc_gm: per-process BO entry tag */
 	} __attribute__((aligned(8)));
+
+	/* since version 5 */
+	uint32_t gbm_format; /* format of the BO, may be a single-plane stand-in of a YUV format */
+	uint32_t num_planes; /* number of planes, all of them live in prime_fd */
+	uint32_t offsets[GRALLOC_HANDLE_MAX_PLANES]; /* offset of each plane in bytes */
+	uint32_t strides[GRALLOC_HANDLE_MAX_PLANES]; /* stride of each plane in bytes */
+
+	/* since version 6 */
+	uint32_t usage_hi; /* bits 32-63 of the Android usage, e.g. FRONT_BUFFER */
+
+	/* since version 7 */
+	uint32_t layer_count; /* number of layers, 0 or 1 if the buffer isn't layered */
+	uint32_t layer_stride; /* bytes from a layer to the next one, planes are per layer */
+
+	/* since version 8 */
+	uint64_t reserved_offset __attribute__((aligned(8))); /* page aligned offset of the reserved region in prime_fd */
+	uint64_t reserved_size; /* bytes of the reserved region, 0 if there's none */
+
+	/* since version 9 */
+	uint64_t buffer_id; /* unique until reboot, stamped by the allocator */
 };
 
-#define GRALLOC_HANDLE_VERSION 4
+#define GRALLOC_HANDLE_VERSION 9
 #define GRALLOC_HANDLE_MAGIC 0x60585350
 #define GRALLOC_HANDLE_NUM_FDS 1
 #define GRALLOC_HANDLE_NUM_INTS (	\
@@ -81,6 +104,71 @@ static inline struct gralloc_handle_t *gralloc_handle(buffer_handle_t handle)
 	return (struct gralloc_handle_t *)handle;
 }
 
+#define GRALLOC_HANDLE_FIELDS_END(field) \
+	(offsetof(struct gralloc_handle_t, field) + sizeof(((struct gralloc_handle_t *)0)->field) - \
+	 sizeof(native_handle_t))
+
+/**
+ * The bytes after native_handle_t which a handle of the version carries,
+ * the fields of the later versions are beyond them.
+ */
+static inline size_t gralloc_handle_version_size(uint32_t version)
+{
+	if (version >= 9)
+		return GRALLOC_HANDLE_FIELDS_END(buffer_id);
+	if (version >= 8)
+		return GRALLOC_HANDLE_FIELDS_END(reserved_size);
+	if (version >= 7)
+		return GRALLOC_HANDLE_FIELDS_END(layer_stride);
+	if (version >= 6)
+		return GRALLOC_HANDLE_FIELDS_END(usage_hi);
+	if (version >= 5)
+		return GRALLOC_HANDLE_FIELDS_END(strides);
+	return GRALLOC_HANDLE_FIELDS_END(reserved);
+}
+
+/**
+ * Whether a native handle, e.g. one received from another process, is a
+ * gralloc handle with room for all of the fields of its version. Nothing
+ * else of the handle may be read before.
+ */
+static inline int gralloc_handle_validate(const native_handle_t *nhandle)
+{
+	const struct gralloc_handle_t *handle = (const struct gralloc_handle_t *)nhandle;
+	size_t size;
+
+	if (!nhandle || nhandle->version != (int)sizeof(native_handle_t) ||
+	    nhandle->numFds != GRALLOC_HANDLE_NUM_FDS || nhandle->numInts < 0)
+		return 0;
+
+	size = sizeof(int) * ((size_t)nhandle->numFds + (size_t)nhandle->numInts);
+	if (size < gralloc_handle_version_size(0) || handle->magic != GRALLOC_HANDLE_MAGIC)
+		return 0;
+	return size >= gralloc_handle_version_size(handle->version);
+}
+
+/**
+ * The whole 64-bit Android usage of the buffer.
+ */
+static inline uint64_t gralloc_handle_usage(const struct gralloc_handle_t *handle)
+{
+	uint64_t usage = handle->usage;
+
+	if (handle->version >= 6)
+		usage |= (uint64_t)handle->usage_hi << 32;
+	return usage;
+}
+
+/**
+ * The number of layers of the buffer, at least 1.
+ */
+static inline uint32_t gralloc_handle_layer_count(const struct gralloc_handle_t *handle)
+{
+	if (handle->version >= 7 && handle->layer_count > 1)
+		return handle->layer_count;
+	return 1;
+}
+
 /**
  * Create a buffer handle.
  */
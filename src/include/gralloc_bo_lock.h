@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2025  Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ *
+ * Authors:
+ *      Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ */
+
+#ifndef _GRALLOC_BO_LOCK_H_
+#define _GRALLOC_BO_LOCK_H_
+
+#include <errno.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <iterator>
+#include <mutex>
+#include <vector>
+
+/*
+ * GrallocBoLock
+ * The CPU lock state of a BO: any number of readers, or one writer thread
+ * which may lock again, for reading or for writing.
+ *
+ * The owners are tracked by thread id, so that a thread never waits for its
+ * own locks: a reader asking to write is refused at once (-EDEADLK), as is
+ * any wait of a thread which holds a lock already (see held()).
+ *
+ * The caller holds mutex() around every call, and maps the BO under it too,
+ * so that the first lock of a BO sets up the CPU access alone.
+ */
+class GrallocBoLock {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    GrallocBoLock() = default;
+    GrallocBoLock(const GrallocBoLock&) = delete;
+    GrallocBoLock& operator=(const GrallocBoLock&) = delete;
+
+    std::mutex& mutex() { return mMutex; }
+
+    // For a reused BO entry, nothing holds it.
+    void reset() {
+        mReaders.clear();
+        mWriters = 0;
+        mWriterTid = 0;
+    }
+
+    /*
+     * Whether @tid can take the lock now.
+     * @return 0 if it can, -EAGAIN if it has to wait for other threads, or
+     *         -EDEADLK if it would wait for a read lock of its own.
+     */
+    int check(bool write, pid_t tid) const {
+        if (mWriters)
+            return mWriterTid == tid ? 0 : -EAGAIN;
+        if (!write || mReaders.empty())
+            return 0;
+        return holdsRead(tid) ? -EDEADLK : -EAGAIN;
+    }
+
+    // Whether @tid holds a lock, a wait of its own would never end.
+    bool held(pid_t tid) const {
+        return (mWriters && mWriterTid == tid) || holdsRead(tid);
+    }
+
+    uint32_t count() const { return mWriters + (uint32_t)mReaders.size(); }
+
+    void acquire(bool write, pid_t tid) {
+        if (write) {
+            mWriters++;
+            mWriterTid = tid;
+        } else {
+            mReaders.push_back(tid);
+        }
+    }
+
+    /*
+     * Drop a lock of @tid, its reads first: they are nested in its writes.
+     * gralloc lets any thread unlock, so the lock of another thread is
+     * dropped if @tid has none.
+     * @return true if nothing holds the lock anymore, the waiters are to be
+     *         notified then.
+     */
+    bool release(pid_t tid) {
+        auto it = std::find(mReaders.rbegin(), mReaders.rend(), tid);
+        if (it != mReaders.rend())
+            mReaders.erase(std::next(it).base());
+        else if (mWriters)
+            mWriters--;
+        else if (!mReaders.empty())
+            mReaders.pop_back();
+        return !count();
+    }
+
+    // Wait for the last unlock. @return false once @deadline has passed.
+    bool wait(std::unique_lock<std::mutex>& lock, Clock::time_point deadline) {
+        return mCond.wait_until(lock, deadline) != std::cv_status::timeout;
+    }
+
+    void notify() { mCond.notify_all(); }
+
+  private:
+    bool holdsRead(pid_t tid) const {
+        return std::find(mReaders.begin(), mReaders.end(), tid) != mReaders.end();
+    }
+
+    std::mutex mMutex;
+    std::condition_variable mCond;
+    std::vector<pid_t> mReaders; // one tid per read lock
+    uint32_t mWriters = 0;
+    pid_t mWriterTid = 0;
+};
+
+#endif // _GRALLOC_BO_LOCK_H_
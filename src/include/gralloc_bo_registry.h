@@ -0,0 +1,269 @@
+/*
+ * Copyright (C) 2025  Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ *
+ * Authors:
+ *      Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ */
+
+#ifndef _GRALLOC_BO_REGISTRY_H_
+#define _GRALLOC_BO_REGISTRY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+#include <atomic>
+#include <mutex>
+
+#include <cutils/native_handle.h>
+
+/*
+ * GrallocHandleRegistry
+ * A sharded [buffer_handle_t, T*] map shared by every thread of the process
+ * (binder threads of the allocator, SurfaceFlinger and app threads calling
+ * the mapper).
+ *
+ * Each shard is an open-addressed table with linear probing, guarded by a
+ * mutex for writers and a sequence counter for readers:
+ *  - lookup() never takes a lock. It probes the table and retries only if a
+ *    writer touched the same shard in the meantime.
+ *  - insert()/erase() hold the shard mutex for a few stores. Erase uses
+ *    backward-shift deletion, so tables never fill up with tombstones.
+ *  - Tables only grow. A replaced table is kept until the registry dies,
+ *    because a reader may still be probing it. Since the capacity doubles on
+ *    each growth, the retired tables never exceed the size of the live one.
+ */
+template <typename T, size_t kShardBits = 4>
+class GrallocHandleRegistry {
+  public:
+    GrallocHandleRegistry() = default;
+    GrallocHandleRegistry(const GrallocHandleRegistry&) = delete;
+    GrallocHandleRegistry& operator=(const GrallocHandleRegistry&) = delete;
+
+    ~GrallocHandleRegistry() {
+        for (auto& shard : mShards) {
+            freeTable(shard.table.load(std::memory_order_relaxed));
+            while (shard.retired) {
+                Table* next = shard.retired->retired_next;
+                freeTable(shard.retired);
+                shard.retired = next;
+            }
+        }
+    }
+
+    // Lock-free, returns nullptr if the handle is not registered.
+    T* lookup(buffer_handle_t handle) const {
+        const uintptr_t key = reinterpret_cast<uintptr_t>(handle);
+        const uint64_t hash = hashKey(key);
+        const Shard& shard = mShards[shardIndex(hash)];
+        T* value;
+        uint32_t seq;
+
+        do {
+            seq = shard.seq.load(std::memory_order_acquire);
+            while (seq & 1) {
+                seq = shard.seq.load(std::memory_order_acquire);
+            }
+
+            value = nullptr;
+            const Table* table = shard.table.load(std::memory_order_acquire);
+            if (table) {
+                for (size_t i = hash & table->mask, n = 0; n <= table->mask;
+                     i = (i + 1) & table->mask, n++) {
+                    uintptr_t slot_key = table->slots[i].key.load(std::memory_order_relaxed);
+                    if (slot_key == key) {
+                        value = table->slots[i].value.load(std::memory_order_relaxed);
+                        break;
+                    }
+                    if (slot_key == kEmptyKey)
+                        break;
+                }
+            }
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+        } while (shard.seq.load(std::memory_order_relaxed) != seq);
+
+        return value;
+    }
+
+    bool contains(buffer_handle_t handle) const {
+        return lookup(handle) != nullptr;
+    }
+
+    // Returns false if the handle has been registered already.
+    bool insert(buffer_handle_t handle, T* value) {
+        const uintptr_t key = reinterpret_cast<uintptr_t>(handle);
+        const uint64_t hash = hashKey(key);
+        Shard& shard = mShards[shardIndex(hash)];
+
+        if (key == kEmptyKey || !value)
+            return false;
+
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        Table* table = shard.table.load(std::memory_order_relaxed);
+        if (table && findSlot(table, key, hash) >= 0)
+            return false;
+
+        if (!table || (shard.count + 1) * 4 > (table->mask + 1) * 3) {
+            Table* grown = allocTable(table ? (table->mask + 1) * 2 : kInitialCapacity);
+            if (!grown)
+                return false;
+            if (table) {
+                for (size_t i = 0; i <= table->mask; i++) {
+                    uintptr_t k = table->slots[i].key.load(std::memory_order_relaxed);
+                    if (k != kEmptyKey)
+                        placeSlot(grown, k, table->slots[i].value.load(std::memory_order_relaxed));
+                }
+                table->retired_next = shard.retired;
+                shard.retired = table;
+            }
+            // A fresh table is invisible to readers until it is published.
+            shard.table.store(grown, std::memory_order_release);
+            table = grown;
+        }
+
+        beginWrite(shard);
+        placeSlot(table, key, value);
+        endWrite(shard);
+        shard.count++;
+        return true;
+    }
+
+    // Removes the handle and returns its value, or nullptr if not registered.
+    T* erase(buffer_handle_t handle) {
+        const uintptr_t key = reinterpret_cast<uintptr_t>(handle);
+        const uint64_t hash = hashKey(key);
+        Shard& shard = mShards[shardIndex(hash)];
+
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        Table* table = shard.table.load(std::memory_order_relaxed);
+        if (!table)
+            return nullptr;
+
+        ssize_t found = findSlot(table, key, hash);
+        if (found < 0)
+            return nullptr;
+
+        size_t hole = static_cast<size_t>(found);
+        T* value = table->slots[hole].value.load(std::memory_order_relaxed);
+
+        beginWrite(shard);
+        // Backward-shift deletion: pull later members of the probe chain
+        // into the hole so that no lookup stops early at an empty slot.
+        for (size_t i = (hole + 1) & table->mask;; i = (i + 1) & table->mask) {
+            uintptr_t k = table->slots[i].key.load(std::memory_order_relaxed);
+            if (k == kEmptyKey)
+                break;
+            size_t home = hashKey(k) & table->mask;
+            if (((i - home) & table->mask) >= ((i - hole) & table->mask)) {
+                table->slots[hole].key.store(k, std::memory_order_relaxed);
+                table->slots[hole].value.store(
+                        table->slots[i].value.load(std::memory_order_relaxed),
+                        std::memory_order_relaxed);
+                hole = i;
+            }
+        }
+        table->slots[hole].key.store(kEmptyKey, std::memory_order_relaxed);
+        table->slots[hole].value.store(nullptr, std::memory_order_relaxed);
+        endWrite(shard);
+
+        shard.count--;
+        return value;
+    }
+
+    // Number of registered handles, shards are counted one after another.
+    size_t size() const {
+        size_t total = 0;
+        for (const auto& shard : mShards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            total += shard.count;
+        }
+        return total;
+    }
+
+  private:
+    static constexpr uintptr_t kEmptyKey = 0;
+    static constexpr size_t kInitialCapacity = 16;
+    static constexpr size_t kShards = size_t(1) << kShardBits;
+
+    struct Slot {
+        std::atomic<uintptr_t> key;
+        std::atomic<T*> value;
+    };
+
+    struct Table {
+        size_t mask;
+        Table* retired_next;
+        Slot slots[];
+    };
+
+    struct alignas(64) Shard {
+        mutable std::mutex mutex;
+        std::atomic<uint32_t> seq{0};
+        std::atomic<Table*> table{nullptr};
+        size_t count = 0;
+        Table* retired = nullptr;
+    };
+
+    static uint64_t hashKey(uintptr_t key) {
+        // murmur3 fmix64, handles are heap pointers with zero low bits.
+        uint64_t h = static_cast<uint64_t>(key);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    static size_t shardIndex(uint64_t hash) {
+        return static_cast<size_t>(hash >> (64 - kShardBits));
+    }
+
+    static Table* allocTable(size_t capacity) {
+        void* mem = calloc(1, sizeof(Table) + capacity * sizeof(Slot));
+        if (!mem)
+            return nullptr;
+        Table* table = static_cast<Table*>(mem);
+        table->mask = capacity - 1;
+        return table;
+    }
+
+    static void freeTable(Table* table) {
+        free(table);
+    }
+
+    static ssize_t findSlot(const Table* table, uintptr_t key, uint64_t hash) {
+        for (size_t i = hash & table->mask, n = 0; n <= table->mask;
+             i = (i + 1) & table->mask, n++) {
+            uintptr_t k = table->slots[i].key.load(std::memory_order_relaxed);
+            if (k == key)
+                return static_cast<ssize_t>(i);
+            if (k == kEmptyKey)
+                return -1;
+        }
+        return -1;
+    }
+
+    static void placeSlot(Table* table, uintptr_t key, T* value) {
+        size_t i = hashKey(key) & table->mask;
+        while (table->slots[i].key.load(std::memory_order_relaxed) != kEmptyKey)
+            i = (i + 1) & table->mask;
+        table->slots[i].value.store(value, std::memory_order_relaxed);
+        table->slots[i].key.store(key, std::memory_order_relaxed);
+    }
+
+    static void beginWrite(Shard& shard) {
+        shard.seq.store(shard.seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    static void endWrite(Shard& shard) {
+        shard.seq.store(shard.seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    Shard mShards[kShards];
+};
+
+#endif // _GRALLOC_BO_REGISTRY_H_
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2025  Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ *
+ * Authors:
+ *      Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ */
+
+#ifndef _GRALLOC_GBM_BO_CACHE_H_
+#define _GRALLOC_GBM_BO_CACHE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <mesa/gbm.h>
+
+/*
+ * Imported BOs, shared by all of the handles of a dma-buf in this process.
+ * A dma-buf is identified by the inode of its file, which every fd of it
+ * (dup'ed, or received over binder) has in common.
+ *
+ * The BO is refcounted by the handles which use it. When the last one is
+ * freed, the BO stays in a grace list for GRALLOC_BO_CACHE_GRACE_PROP ms
+ * (0 turns it off), so that a swapchain which frees and imports its buffers
+ * again gets them back without gbm_bo_import(). The BO keeps the dma-buf
+ * alive meanwhile, so its inode can't be reused by another buffer. Expired
+ * BOs are destroyed by the next cache operation, or by
+ * gralloc_bo_cache_trim().
+ */
+#define GRALLOC_BO_CACHE_GRACE_PROP "vendor.gralloc.import_grace_ms"
+#define GRALLOC_BO_CACHE_DEFAULT_GRACE_MS 1000
+// More BOs in the grace list than this push out the oldest ones.
+#define GRALLOC_BO_CACHE_MAX_PARKED 64
+
+/*
+ * The dma-buf and how it is imported, the same dma-buf imported with another
+ * layout or on another device is another BO.
+ */
+typedef struct gralloc_bo_cache_key {
+    dev_t dev;
+    ino_t ino;
+    uint32_t route;
+    uint32_t format;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint64_t modifier;
+} gralloc_bo_cache_key_t;
+
+typedef struct gralloc_bo_cache_stats {
+    uint64_t hits;         // imports which got a BO in use by another handle
+    uint64_t grace_hits;   // imports which got a BO back from the grace list
+    uint64_t misses;       // imports which called gbm_bo_import()
+    uint64_t expired;      // BOs destroyed after their grace period, or pushed out
+    uint32_t live_count;   // BOs in use by a handle
+    uint32_t parked_count; // BOs in the grace list
+} gralloc_bo_cache_stats_t;
+
+/*
+ * Fill the identity of the dma-buf in the key, the caller fills the rest.
+ * @return 0, or a negative error code if the fd can't be stat'ed.
+ */
+int gralloc_bo_cache_make_key(int prime_fd, gralloc_bo_cache_key_t *key);
+/*
+ * @return the BO of the key with a new reference, or nullptr if it has to be
+ *         imported.
+ */
+struct gbm_bo *gralloc_bo_cache_get(const gralloc_bo_cache_key_t *key);
+/*
+ * Add a BO which has just been imported, with one reference. If another
+ * thread has added the key meanwhile, the BO is destroyed and theirs is
+ * returned with a new reference.
+ * @return the BO to use, or nullptr if the cache is out of memory (the BO
+ *         is destroyed too).
+ */
+struct gbm_bo *gralloc_bo_cache_add(const gralloc_bo_cache_key_t *key, struct gbm_bo *bo);
+/*
+ * Drop a reference, the last one moves the BO to the grace list.
+ * @return false if the BO isn't in the cache, the caller still owns it.
+ */
+bool gralloc_bo_cache_put(struct gbm_bo *bo);
+/*
+ * Destroy all of the BOs in the grace list.
+ */
+void gralloc_bo_cache_trim();
+void gralloc_bo_cache_get_stats(gralloc_bo_cache_stats_t *stats);
+
+#endif // _GRALLOC_GBM_BO_CACHE_H_
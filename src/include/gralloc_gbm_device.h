@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2025  Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ *
+ * Authors:
+ *      Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ */
+
+#ifndef _GRALLOC_GBM_DEVICE_H_
+#define _GRALLOC_GBM_DEVICE_H_
+
+#include <mesa/gbm.h>
+
+/*
+ * The DRM nodes which we allocate from. Some boards have a display-only KMS
+ * node (card*) besides the render node of the GPU, e.g. a display controller
+ * driver next to panfrost. BOs which are scanned out are allocated on the
+ * display node, the others on the render node, each route with its own GBM
+ * device. Both routes use the same device if there's only one node.
+ *
+ * The render node is GRALLOC_DEFAULT_DEVICE_PROP if it is set, or the first
+ * render node found in /dev/dri. The display node is
+ * GRALLOC_DISPLAY_DEVICE_PROP: a path, "auto" to look for a KMS node of
+ * another device than the render node, or "none" (default). Only the
+ * allocator opens it: the mapper runs in every app, which can't open card
+ * nodes, and imports on the render node.
+ *
+ * The framebuffer and cursor BOs go to the display node. The composer BOs
+ * go there too if GRALLOC_DISPLAY_COMPOSER_PROP is set, for the boards
+ * whose composer scans them out as overlays.
+ */
+#define GRALLOC_DISPLAY_DEVICE_PROP "vendor.gralloc.display_device"
+#define GRALLOC_DISPLAY_DEVICE_AUTO "auto"
+#define GRALLOC_DISPLAY_DEVICE_NONE "none"
+#define GRALLOC_DISPLAY_COMPOSER_PROP "vendor.gralloc.display_composer"
+
+typedef enum gralloc_device_route {
+    GRALLOC_DEVICE_RENDER = 0,
+    GRALLOC_DEVICE_DISPLAY,
+    GRALLOC_DEVICE_NUM_ROUTES,
+} gralloc_device_route_t;
+
+/*
+ * Open the nodes and create their GBM devices, once per process.
+ * @render_fd the fd of the render node, or -1 to find it. It is kept by
+ *            the device manager, and ignored if it is initialized already.
+ * @return 0, or -ENODEV if there's no usable render node.
+ */
+int gralloc_device_manager_init(int render_fd);
+/*
+ * Open the display node, for the allocator only. The device manager must be
+ * initialized.
+ * @return 0, also if there's no display node.
+ */
+int gralloc_device_manager_init_display();
+/*
+ * The route of a BO with the Android usage. GRALLOC_DEVICE_DISPLAY is only
+ * returned if the display node is another device than the render node, so
+ * the route can be used as an index of per-device state.
+ */
+gralloc_device_route_t gralloc_device_route_for_usage(int usage);
+/*
+ * The GBM device of the route, initializing the device manager if needed.
+ * @return nullptr if there's no device.
+ */
+struct gbm_device *gralloc_device_get(gralloc_device_route_t route);
+/*
+ * Path of the node behind the route, for the logs.
+ */
+const char *gralloc_device_get_path(gralloc_device_route_t route);
+void gralloc_device_manager_deinit();
+
+#endif // _GRALLOC_GBM_DEVICE_H_
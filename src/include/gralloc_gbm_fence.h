@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2025  Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ *
+ * Authors:
+ *      Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ */
+
+#ifndef _GRALLOC_GBM_FENCE_H_
+#define _GRALLOC_GBM_FENCE_H_
+
+#include <stdint.h>
+
+/*
+ * Fence handling of the lock paths. A fence can be:
+ *  - skipped, if it has signaled already (checked first, without blocking),
+ *  - waited for with poll() by the caller: gralloc_fence_wait(),
+ *  - handed over to a shared epoll worker which calls back when it signals:
+ *    gralloc_fence_wait_async() and gralloc_fence_notify_eventfd().
+ */
+
+#define GRALLOC_FENCE_TIMEOUT_PROP "vendor.gralloc.fence_timeout_ms"
+#define GRALLOC_FENCE_DEFAULT_TIMEOUT_MS 3000
+
+// Bucket 0 counts the waits shorter than 1us, bucket n those in [2^(n-1), 2^n) us.
+#define GRALLOC_FENCE_HIST_BUCKETS 24
+
+typedef struct gralloc_fence_stats {
+    uint64_t signaled;     // fences which had signaled when we got them
+    uint64_t waits;        // fences waited for by the caller
+    uint64_t deferred;     // fences handed over to the worker
+    uint64_t timeouts;     // waits which timed out
+    uint64_t errors;       // fences which signaled with an error, or failed to poll
+    uint64_t exported;     // sync_files exported from dma-bufs
+    uint64_t imported;     // sync_files imported into dma-bufs
+    uint64_t wait_us[GRALLOC_FENCE_HIST_BUCKETS];     // latency of the waits
+    uint64_t deferred_us[GRALLOC_FENCE_HIST_BUCKETS]; // latency of the deferred fences
+} gralloc_fence_stats_t;
+
+/*
+ * Called by the worker thread when the fence has signaled.
+ * @status 0, -EIO if the fence signaled with an error, or -ETIME.
+ */
+typedef void (*gralloc_fence_callback_t)(int status, void *data);
+
+/*
+ * Timeout of the fence waits in the lock paths, GRALLOC_FENCE_TIMEOUT_PROP.
+ */
+int gralloc_fence_default_timeout();
+/*
+ * @return 1 if the fence has signaled, 0 if not, or a negative error code.
+ * A fd of -1 is a signaled fence.
+ */
+int gralloc_fence_is_signaled(int fence_fd);
+/*
+ * Wait for the fence with poll(), the fence is not closed.
+ * @timeout_ms -1 waits forever.
+ * @return 0, -ETIME, -EIO if the fence signaled with an error.
+ */
+int gralloc_fence_wait(int fence_fd, int timeout_ms);
+/*
+ * Call back from the worker thread once the fence has signaled, the fence is
+ * owned and closed by us. If the fence has signaled already, the callback is
+ * called by the caller thread before returning.
+ * @timeout_ms -1 waits forever.
+ * @return 0 if the callback has been or will be called, or an error code.
+ */
+int gralloc_fence_wait_async(int fence_fd, int timeout_ms, gralloc_fence_callback_t callback, void *data);
+/*
+ * Add 1 to the eventfd counter once the fence has signaled, or 2 if it
+ * signaled with an error or timed out. The fence is owned by us, the eventfd
+ * is not, it must be kept open until it has been written.
+ */
+int gralloc_fence_notify_eventfd(int fence_fd, int timeout_ms, int event_fd);
+/*
+ * Implicit fences of dma-bufs, DMA_BUF_IOCTL_EXPORT/IMPORT_SYNC_FILE.
+ * Both return -ENOTSUP if the kernel is older than 6.0.
+ *
+ * Export a sync_file of the fences which a reader (write = false) or a
+ * writer (write = true) of the dma-buf must wait for.
+ */
+int gralloc_dma_buf_export_fence(int dmabuf_fd, bool write, int *fence_fd);
+/*
+ * Add the fence to the dma-buf as a read or a write, so that implicit-sync
+ * users of the dma-buf wait for it as well. The fence is not closed.
+ */
+int gralloc_dma_buf_import_fence(int dmabuf_fd, int fence_fd, bool write);
+void gralloc_fence_get_stats(gralloc_fence_stats_t *stats);
+
+#endif // _GRALLOC_GBM_FENCE_H_
@@ -0,0 +1,236 @@
+/*
+ * Copyright (C) 2025  Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ *
+ * Authors:
+ *      Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ */
+
+#ifndef _GRALLOC_GBM_FORMAT_CAPS_H_
+#define _GRALLOC_GBM_FORMAT_CAPS_H_
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <mesa/gbm.h>
+
+#include "gralloc_gbm_formats.h"
+#include "gralloc_gbm_modifiers.h"
+
+/*
+ * Format capability cache
+ * What the GBM device can allocate, probed once per driver and kept as one
+ * bit per (GBM format, usage class). A usage class is a combination of the
+ * GBM flags which change the answer of gbm_device_is_format_supported().
+ *
+ * The table is saved to a file, keyed by the GBM backend, the DRM driver and
+ * the vendor build, so the next boot with the same driver loads it instead
+ * of probing again. A table written by a build with other format tables is
+ * stale too (layout_hash).
+ */
+#define GRALLOC_CAPS_MAGIC 0x53504143 // "CAPS"
+#define GRALLOC_CAPS_VERSION 1
+#define GRALLOC_CAPS_CLASS_BITS 4
+#define GRALLOC_CAPS_NUM_CLASSES (1 << GRALLOC_CAPS_CLASS_BITS)
+
+static constexpr uint32_t kGrallocCapsClassFlags[GRALLOC_CAPS_CLASS_BITS] = {
+    GBM_BO_USE_SCANOUT, GBM_BO_USE_CURSOR, GBM_BO_USE_RENDERING, GBM_BO_USE_LINEAR,
+};
+
+#define GRALLOC_CAPS_NUM_FORMATS (sizeof(gralloc_formats::kGbmFormats) / sizeof(gralloc_formats::kGbmFormats[0]))
+
+typedef struct gralloc_format_caps {
+    uint16_t classes;   // bit n: the format can be allocated with the usage class n
+    uint8_t modifiers;  // bit n: the format supports kGrallocCapsModifiers[n]
+    uint8_t reserved;
+} gralloc_format_caps_t;
+
+typedef struct gralloc_format_caps_file {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_formats;
+    uint32_t layout_hash; // of the probed formats, classes and modifiers
+    char key[256];        // backend, driver and build the table was probed on
+    gralloc_format_caps_t caps[GRALLOC_CAPS_NUM_FORMATS];
+} gralloc_format_caps_file_t;
+
+static_assert(GRALLOC_CAPS_NUM_MODIFIERS <= 8,
+              "gralloc_format_caps_t.modifiers holds 8 modifiers");
+
+static inline uint32_t gralloc_format_caps_class(uint32_t flags) {
+    uint32_t cls = 0;
+    for (uint32_t i = 0; i < GRALLOC_CAPS_CLASS_BITS; i++) {
+        if (flags & kGrallocCapsClassFlags[i])
+            cls |= 1u << i;
+    }
+    return cls;
+}
+
+static inline uint32_t gralloc_format_caps_class_to_flags(uint32_t cls) {
+    uint32_t flags = 0;
+    for (uint32_t i = 0; i < GRALLOC_CAPS_CLASS_BITS; i++) {
+        if (cls & (1u << i))
+            flags |= kGrallocCapsClassFlags[i];
+    }
+    return flags;
+}
+
+static inline uint32_t gralloc_format_caps_layout_hash() {
+    // FNV-1a, a cache written by a build with other tables must not be used.
+    uint32_t hash = 2166136261u;
+    auto mix = [&hash](uint64_t value) {
+        for (int i = 0; i < 8; i++, value >>= 8) {
+            hash ^= (uint32_t)(value & 0xff);
+            hash *= 16777619u;
+        }
+    };
+
+    for (const auto& desc : gralloc_formats::kGbmFormats)
+        mix(desc.gbm_format);
+    for (uint32_t flags : kGrallocCapsClassFlags)
+        mix(flags);
+    for (uint64_t modifier : kGrallocCapsModifiers)
+        mix(modifier);
+    return hash;
+}
+
+// Fill the header of a table probed on the device described by @key.
+static inline void gralloc_format_caps_init(gralloc_format_caps_file_t *caps_file, const char *key) {
+    caps_file->magic = GRALLOC_CAPS_MAGIC;
+    caps_file->version = GRALLOC_CAPS_VERSION;
+    caps_file->num_formats = GRALLOC_CAPS_NUM_FORMATS;
+    caps_file->layout_hash = gralloc_format_caps_layout_hash();
+    snprintf(caps_file->key, sizeof(caps_file->key), "%s", key);
+}
+
+/*
+ * Load the caps saved at @path, if their header matches the one of @expected.
+ * @return 0, -ESTALE if the file is of another device, build or layout, or
+ *         another negative error code if it can't be read.
+ */
+static inline int gralloc_format_caps_load(const char *path, gralloc_format_caps_file_t *expected) {
+    gralloc_format_caps_file_t file;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -errno;
+
+    ssize_t size = TEMP_FAILURE_RETRY(read(fd, &file, sizeof(file)));
+    close(fd);
+
+    if (size != (ssize_t)sizeof(file) ||
+        file.magic != expected->magic || file.version != expected->version ||
+        file.num_formats != expected->num_formats || file.layout_hash != expected->layout_hash ||
+        strncmp(file.key, expected->key, sizeof(file.key))) {
+        return -ESTALE;
+    }
+
+    memcpy(expected->caps, file.caps, sizeof(file.caps));
+    return 0;
+}
+
+/*
+ * Save the caps to @path, through a temporary file which is renamed over it.
+ * The parent directory is created if needed.
+ * @return 0, or a negative error code.
+ */
+static inline int gralloc_format_caps_save(const char *path, const gralloc_format_caps_file_t *caps_file) {
+    char tmp_path[PATH_MAX];
+    char dir[PATH_MAX];
+    char *slash;
+    int ret = 0;
+
+    // Create the parent directory, it is fine if it exists already.
+    snprintf(dir, sizeof(dir), "%s", path);
+    slash = strrchr(dir, '/');
+    if (slash && slash != dir) {
+        *slash = '\0';
+        mkdir(dir, 0770);
+    }
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+    if (fd < 0)
+        return -errno;
+
+    ssize_t size = TEMP_FAILURE_RETRY(write(fd, caps_file, sizeof(*caps_file)));
+    if (size != (ssize_t)sizeof(*caps_file))
+        ret = size < 0 ? -errno : -EIO;
+    else if (fsync(fd))
+        ret = -errno;
+    close(fd);
+
+    if (!ret && rename(tmp_path, path))
+        ret = -errno;
+    if (ret)
+        unlink(tmp_path);
+    return ret;
+}
+
+/*
+ * Load the caps of @caps_file, its header filled in by
+ * gralloc_format_caps_init(), from @path. If they are missing or stale,
+ * @probe(caps_file) probes them and they are saved to @path (saving is best
+ * effort, @save_err gets its result).
+ * @return true if the caps have been probed.
+ */
+template <typename Probe>
+static inline bool gralloc_format_caps_load_or_probe(const char *path, gralloc_format_caps_file_t *caps_file,
+                                                     Probe probe, int *save_err) {
+    *save_err = 0;
+    if (!gralloc_format_caps_load(path, caps_file))
+        return false;
+
+    memset(caps_file->caps, 0, sizeof(caps_file->caps));
+    probe(caps_file);
+    *save_err = gralloc_format_caps_save(path, caps_file);
+    return true;
+}
+
+static inline const gralloc_format_caps_t *gralloc_format_caps_find(const gralloc_format_caps_file_t *caps_file,
+                                                                   uint32_t gbm_format) {
+    const gralloc_gbm_format_desc_t *desc = gralloc_get_gbm_format_desc(gbm_format);
+    if (!desc)
+        return nullptr;
+    return &caps_file->caps[desc - gralloc_formats::kGbmFormats];
+}
+
+/*
+ * Whether the probed caps allow a BO of the GBM format with the flags. The
+ * caps only know the formats of kGbmFormats, the others (e.g., the
+ * placeholder of HAL_PIXEL_FORMAT_IMPLEMENTATION_DEFINED) are left to
+ * gbm_bo_create().
+ */
+static inline bool gralloc_format_caps_gbm_supported(const gralloc_format_caps_file_t *caps_file,
+                                                     uint32_t gbm_format, uint32_t flags) {
+    const gralloc_format_caps_t *caps = gralloc_format_caps_find(caps_file, gbm_format);
+    if (!caps)
+        return true;
+
+    return caps->classes & (1u << gralloc_format_caps_class(flags));
+}
+
+/*
+ * Same for an Android format, planar YUV is fine if its single-plane stand-in
+ * (gralloc_gm_yuv_fallback_format()) is.
+ * @return false for the formats which gralloc_gm doesn't know.
+ */
+static inline bool gralloc_format_caps_supported(const gralloc_format_caps_file_t *caps_file,
+                                                 uint32_t android_format, uint32_t flags) {
+    const gralloc_android_format_desc_t *desc = gralloc_get_android_format_desc(android_format);
+    if (!desc)
+        return false;
+
+    if (gralloc_format_caps_gbm_supported(caps_file, desc->gbm_format, flags))
+        return true;
+
+    uint32_t fallback_format = gralloc_gm_yuv_fallback_format(desc->gbm_format);
+    return fallback_format && gralloc_format_caps_gbm_supported(caps_file, fallback_format, flags);
+}
+
+#endif // _GRALLOC_GBM_FORMAT_CAPS_H_
@@ -0,0 +1,384 @@
+/*
+ * Copyright (C) 2025  Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ *
+ * Authors:
+ *      Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ */
+
+#ifndef _GRALLOC_GBM_FORMATS_H_
+#define _GRALLOC_GBM_FORMATS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <array>
+
+#include <hardware/gralloc.h>
+#include <mesa/gbm.h>
+
+/*
+ * All of the format knowledge of gralloc_gm lives in the tables below: the
+ * Android to GBM format conversion, the bpp of GBM formats and the plane
+ * layouts reported by the mapper. The tables and their hash indexes are built
+ * at compile time, so lookups are O(1) and nothing is allocated at startup.
+ */
+
+#define GRALLOC_GBM_FORMAT_P010 __gbm_fourcc_code('P', '0', '1', '0')
+// Placeholder of HAL_PIXEL_FORMAT_IMPLEMENTATION_DEFINED, it isn't a real GBM format.
+#define GRALLOC_GBM_FORMAT_IMPL_DEFINED __gbm_fourcc_code('9', '9', '9', '8')
+
+// Same values with android.hardware.graphics.common.PlaneLayoutComponentType
+#define GRALLOC_COMPONENT_Y (1LL << 0)
+#define GRALLOC_COMPONENT_CB (1LL << 1)
+#define GRALLOC_COMPONENT_CR (1LL << 2)
+#define GRALLOC_COMPONENT_R (1LL << 10)
+#define GRALLOC_COMPONENT_G (1LL << 11)
+#define GRALLOC_COMPONENT_B (1LL << 12)
+#define GRALLOC_COMPONENT_A (1LL << 30)
+
+#define GRALLOC_MAX_FORMAT_PLANES 3
+#define GRALLOC_MAX_PLANE_COMPONENTS 4
+
+typedef struct gralloc_component_desc {
+    int64_t type;
+    uint8_t offset_bits;
+    uint8_t size_bits;
+} gralloc_component_desc_t;
+
+typedef struct gralloc_plane_desc {
+    uint8_t num_components;
+    gralloc_component_desc_t components[GRALLOC_MAX_PLANE_COMPONENTS];
+    uint8_t sample_increment_bits;
+    uint8_t horizontal_subsampling;
+    uint8_t vertical_subsampling;
+} gralloc_plane_desc_t;
+
+typedef struct gralloc_gbm_format_desc {
+    uint32_t gbm_format;
+    uint8_t bpp;
+    uint8_t num_planes; // 0 if we don't know the plane layouts
+    gralloc_plane_desc_t planes[GRALLOC_MAX_FORMAT_PLANES];
+} gralloc_gbm_format_desc_t;
+
+typedef struct gralloc_android_format_desc {
+    uint32_t android_format;
+    uint32_t gbm_format;
+} gralloc_android_format_desc_t;
+
+namespace gralloc_formats {
+
+constexpr gralloc_plane_desc_t packed(uint8_t increment, gralloc_component_desc_t c0,
+                                      gralloc_component_desc_t c1 = {},
+                                      gralloc_component_desc_t c2 = {},
+                                      gralloc_component_desc_t c3 = {}) {
+    uint8_t n = c3.type ? 4 : c2.type ? 3 : c1.type ? 2 : 1;
+    return {n, {c0, c1, c2, c3}, increment, 1, 1};
+}
+
+constexpr gralloc_plane_desc_t subsampled(gralloc_plane_desc_t plane, uint8_t h, uint8_t v) {
+    plane.horizontal_subsampling = h;
+    plane.vertical_subsampling = v;
+    return plane;
+}
+
+constexpr gralloc_gbm_format_desc_t fmt(uint32_t gbm_format, uint8_t bpp,
+                                        gralloc_plane_desc_t p0 = {},
+                                        gralloc_plane_desc_t p1 = {},
+                                        gralloc_plane_desc_t p2 = {}) {
+    uint8_t n = p2.num_components ? 3 : p1.num_components ? 2 : p0.num_components ? 1 : 0;
+    return {gbm_format, bpp, n, {p0, p1, p2}};
+}
+
+constexpr gralloc_component_desc_t Y = {GRALLOC_COMPONENT_Y, 0, 8};
+constexpr gralloc_component_desc_t R8 = {GRALLOC_COMPONENT_R, 0, 8};
+constexpr gralloc_component_desc_t G8 = {GRALLOC_COMPONENT_G, 8, 8};
+constexpr gralloc_component_desc_t B8 = {GRALLOC_COMPONENT_B, 16, 8};
+
+inline constexpr gralloc_gbm_format_desc_t kGbmFormats[] = {
+    fmt(GBM_FORMAT_C8, 8),
+    fmt(GBM_FORMAT_RGB332, 8),
+    fmt(GBM_FORMAT_BGR233, 8),
+    fmt(GBM_FORMAT_R8, 8, packed(8, R8)),
+
+    // Planar/semi-planar YUV420 formats
+    fmt(GBM_FORMAT_YUV420, 12),
+    fmt(GBM_FORMAT_NV12, 12,
+        packed(8, Y),
+        subsampled(packed(16, {GRALLOC_COMPONENT_CB, 0, 8}, {GRALLOC_COMPONENT_CR, 8, 8}), 2, 2)),
+    fmt(GBM_FORMAT_NV21, 12,
+        packed(8, Y),
+        subsampled(packed(16, {GRALLOC_COMPONENT_CR, 0, 8}, {GRALLOC_COMPONENT_CB, 8, 8}), 2, 2)),
+    fmt(GBM_FORMAT_YVU420, 12,
+        packed(8, Y),
+        subsampled(packed(8, {GRALLOC_COMPONENT_CR, 0, 8}), 2, 2),
+        subsampled(packed(8, {GRALLOC_COMPONENT_CB, 0, 8}), 2, 2)),
+    fmt(GRALLOC_GBM_FORMAT_P010, 24,
+        packed(16, {GRALLOC_COMPONENT_Y, 6, 10}),
+        subsampled(packed(32, {GRALLOC_COMPONENT_CB, 6, 10}, {GRALLOC_COMPONENT_CR, 22, 10}), 2, 2)),
+
+    fmt(GBM_FORMAT_XRGB4444, 16),
+    fmt(GBM_FORMAT_XBGR4444, 16),
+    fmt(GBM_FORMAT_RGBX4444, 16),
+    fmt(GBM_FORMAT_BGRX4444, 16),
+    fmt(GBM_FORMAT_ARGB4444, 16),
+    fmt(GBM_FORMAT_ABGR4444, 16),
+    fmt(GBM_FORMAT_RGBA4444, 16),
+    fmt(GBM_FORMAT_BGRA4444, 16),
+    fmt(GBM_FORMAT_XRGB1555, 16),
+    fmt(GBM_FORMAT_XBGR1555, 16),
+    fmt(GBM_FORMAT_RGBX5551, 16),
+    fmt(GBM_FORMAT_BGRX5551, 16),
+    fmt(GBM_FORMAT_ARGB1555, 16),
+    fmt(GBM_FORMAT_ABGR1555, 16),
+    fmt(GBM_FORMAT_RGBA5551, 16),
+    fmt(GBM_FORMAT_BGRA5551, 16),
+    fmt(GBM_FORMAT_RGB565, 16,
+        packed(16, {GRALLOC_COMPONENT_B, 0, 5}, {GRALLOC_COMPONENT_G, 5, 6},
+               {GRALLOC_COMPONENT_R, 11, 5})),
+    fmt(GBM_FORMAT_BGR565, 16),
+
+    // Packed YUV422, e.g., UYVY
+    fmt(GBM_FORMAT_YUYV, 16),
+    fmt(GBM_FORMAT_YVYU, 16),
+    fmt(GBM_FORMAT_UYVY, 16),
+    fmt(GBM_FORMAT_VYUY, 16),
+    fmt(GBM_FORMAT_YUV422, 16),
+
+    fmt(GBM_FORMAT_R16, 16, packed(16, {GRALLOC_COMPONENT_R, 0, 16})),
+    fmt(GBM_FORMAT_GR88, 16),
+
+    fmt(GBM_FORMAT_RGB888, 24),
+    fmt(GBM_FORMAT_BGR888, 24, packed(24, R8, G8, B8)),
+    fmt(GBM_FORMAT_YUV444, 24),
+
+    fmt(GBM_FORMAT_XRGB8888, 32,
+        packed(32, {GRALLOC_COMPONENT_B, 16, 8}, G8, {GRALLOC_COMPONENT_R, 0, 8})),
+    fmt(GBM_FORMAT_XBGR8888, 32, packed(32, R8, G8, B8)),
+    fmt(GBM_FORMAT_RGBX8888, 32,
+        packed(32, {GRALLOC_COMPONENT_B, 16, 8}, G8, {GRALLOC_COMPONENT_R, 0, 8})),
+    fmt(GBM_FORMAT_BGRX8888, 32),
+    fmt(GBM_FORMAT_ARGB8888, 32,
+        packed(32, {GRALLOC_COMPONENT_B, 0, 8}, G8, {GRALLOC_COMPONENT_R, 16, 8},
+               {GRALLOC_COMPONENT_A, 24, 8})),
+    fmt(GBM_FORMAT_ABGR8888, 32, packed(32, R8, G8, B8, {GRALLOC_COMPONENT_A, 24, 8})),
+    fmt(GBM_FORMAT_RGBA8888, 32),
+    fmt(GBM_FORMAT_BGRA8888, 32),
+    fmt(GBM_FORMAT_XRGB2101010, 32),
+    fmt(GBM_FORMAT_XBGR2101010, 32),
+    fmt(GBM_FORMAT_ARGB2101010, 32),
+    fmt(GBM_FORMAT_ABGR2101010, 32,
+        packed(32, {GRALLOC_COMPONENT_R, 0, 10}, {GRALLOC_COMPONENT_G, 10, 10},
+               {GRALLOC_COMPONENT_B, 20, 10}, {GRALLOC_COMPONENT_A, 30, 2})),
+    fmt(GBM_FORMAT_RG1616, 32),
+
+    fmt(GBM_FORMAT_XBGR16161616, 64),
+    fmt(GBM_FORMAT_ABGR16161616, 64),
+    fmt(GBM_FORMAT_XBGR16161616F, 64),
+    fmt(GBM_FORMAT_ABGR16161616F, 64,
+        packed(64, {GRALLOC_COMPONENT_R, 0, 16}, {GRALLOC_COMPONENT_G, 16, 16},
+               {GRALLOC_COMPONENT_B, 32, 16}, {GRALLOC_COMPONENT_A, 48, 16})),
+};
+
+// The GBM supported formats can be found at gbm_dri_visuals_table[]
+// in <mesa_dir>/src/gbm/backends/dri/gbm_dri.c
+// The DRI supported formats can be found at dri2_format_table[]
+// in <mesa_dir>/src/gallium/frontends/dri/dri_helpers.c
+//
+// The order of color format should be reversed
+// while converting Android format to GBM format.
+inline constexpr gralloc_android_format_desc_t kAndroidFormats[] = {
+    {HAL_PIXEL_FORMAT_RGBA_8888, GBM_FORMAT_ABGR8888},     // not GBM_FORMAT_RGBA8888
+    {HAL_PIXEL_FORMAT_RGBX_8888, GBM_FORMAT_XBGR8888},     // not GBM_FORMAT_RGBX8888
+    {HAL_PIXEL_FORMAT_RGB_888, GBM_FORMAT_BGR888},         // not GBM_FORMAT_RGB888
+    {HAL_PIXEL_FORMAT_RGB_565, GBM_FORMAT_BGR565},         // not GBM_FORMAT_RGB565
+    {HAL_PIXEL_FORMAT_BGRA_8888, GBM_FORMAT_ARGB8888},     // not GBM_FORMAT_BGRA8888
+    {HAL_PIXEL_FORMAT_RAW16, GBM_FORMAT_R16},
+    {HAL_PIXEL_FORMAT_YV12, GBM_FORMAT_YVU420},
+    {HAL_PIXEL_FORMAT_Y8, GBM_FORMAT_R8},
+    {HAL_PIXEL_FORMAT_Y16, GBM_FORMAT_R16},
+    {HAL_PIXEL_FORMAT_RGBA_FP16, GBM_FORMAT_ABGR16161616F},
+    {HAL_PIXEL_FORMAT_RGBA_1010102, GBM_FORMAT_ABGR2101010}, // not GBM_FORMAT_RGBA1010102
+    {HAL_PIXEL_FORMAT_YCbCr_422_SP, GBM_FORMAT_YUV422},
+    {HAL_PIXEL_FORMAT_YCbCr_420_888, GBM_FORMAT_NV12},
+    {HAL_PIXEL_FORMAT_YCrCb_420_SP, GBM_FORMAT_NV21},
+    {HAL_PIXEL_FORMAT_YCBCR_P010, GRALLOC_GBM_FORMAT_P010},
+    // Choose GBM_FORMAT_R8 because <system/graphics.h> requires the buffers
+    // with a format HAL_PIXEL_FORMAT_BLOB have a height of 1, and width
+    // equal to their size in bytes.
+    {HAL_PIXEL_FORMAT_BLOB, GBM_FORMAT_R8},
+    {HAL_PIXEL_FORMAT_IMPLEMENTATION_DEFINED, GRALLOC_GBM_FORMAT_IMPL_DEFINED},
+};
+
+/*
+ * Compile-time open-addressed index: a slot holds the position of the entry
+ * in the table plus one, or 0 if it is empty.
+ */
+template <size_t N>
+struct FormatIndex {
+    // Keep the load factor at or below 1/4 so that probe chains stay short.
+    static constexpr size_t bitsFor(size_t n) {
+        size_t bits = 1;
+        while ((size_t(1) << bits) < n * 4)
+            bits++;
+        return bits;
+    }
+    static constexpr size_t kBits = bitsFor(N);
+    static constexpr size_t kSize = size_t(1) << kBits;
+
+    std::array<uint8_t, kSize> slots{};
+    size_t max_probe = 0;
+
+    static constexpr size_t hash(uint32_t key) {
+        return (uint32_t)(key * 0x9E3779B1u) >> (32 - kBits);
+    }
+};
+
+template <size_t N, typename T, typename K>
+constexpr FormatIndex<N> buildIndex(const T (&table)[N], K key) {
+    static_assert(N < 255, "the index only holds 8-bit positions");
+    FormatIndex<N> index;
+    for (size_t i = 0; i < N; i++) {
+        size_t slot = FormatIndex<N>::hash(key(table[i]));
+        size_t probe = 0;
+        while (index.slots[slot]) {
+            slot = (slot + 1) & (FormatIndex<N>::kSize - 1);
+            probe++;
+        }
+        index.slots[slot] = (uint8_t)(i + 1);
+        if (probe > index.max_probe)
+            index.max_probe = probe;
+    }
+    return index;
+}
+
+template <size_t N, typename T, typename K>
+constexpr const T *findIndexed(const FormatIndex<N>& index, const T (&table)[N], K key,
+                               uint32_t value) {
+    size_t slot = FormatIndex<N>::hash(value);
+    for (size_t probe = 0; probe <= index.max_probe; probe++) {
+        uint8_t pos = index.slots[slot];
+        if (!pos)
+            return nullptr;
+        if (key(table[pos - 1]) == value)
+            return &table[pos - 1];
+        slot = (slot + 1) & (FormatIndex<N>::kSize - 1);
+    }
+    return nullptr;
+}
+
+constexpr uint32_t gbmKey(const gralloc_gbm_format_desc_t& desc) { return desc.gbm_format; }
+constexpr uint32_t androidKey(const gralloc_android_format_desc_t& desc) { return desc.android_format; }
+
+inline constexpr auto kGbmFormatIndex = buildIndex(kGbmFormats, gbmKey);
+inline constexpr auto kAndroidFormatIndex = buildIndex(kAndroidFormats, androidKey);
+
+constexpr const gralloc_gbm_format_desc_t *findGbm(uint32_t gbm_format) {
+    return findIndexed(kGbmFormatIndex, kGbmFormats, gbmKey, gbm_format);
+}
+
+constexpr const gralloc_android_format_desc_t *findAndroid(uint32_t android_format) {
+    return findIndexed(kAndroidFormatIndex, kAndroidFormats, androidKey, android_format);
+}
+
+// Consistency checks of the tables, evaluated at compile time.
+
+template <size_t N, typename T, typename K>
+constexpr bool hasUniqueKeys(const T (&table)[N], K key) {
+    for (size_t i = 0; i < N; i++)
+        for (size_t j = i + 1; j < N; j++)
+            if (key(table[i]) == key(table[j]))
+                return false;
+    return true;
+}
+
+// The planes must add up to the bpp, and the components must fit in their sample.
+constexpr bool hasConsistentPlanes(const gralloc_gbm_format_desc_t& desc) {
+    if (!desc.num_planes)
+        return true;
+
+    unsigned bits_per_4_pixels = 0;
+    for (size_t p = 0; p < desc.num_planes; p++) {
+        const gralloc_plane_desc_t& plane = desc.planes[p];
+        unsigned subsampling = plane.horizontal_subsampling * plane.vertical_subsampling;
+        if (!subsampling || 4 % subsampling || !plane.num_components)
+            return false;
+        bits_per_4_pixels += plane.sample_increment_bits * (4 / subsampling);
+
+        uint64_t used = 0;
+        for (size_t c = 0; c < plane.num_components; c++) {
+            const gralloc_component_desc_t& comp = plane.components[c];
+            if (!comp.size_bits || comp.size_bits >= 64 ||
+                comp.offset_bits + comp.size_bits > plane.sample_increment_bits)
+                return false;
+            uint64_t mask = ((1ULL << comp.size_bits) - 1) << comp.offset_bits;
+            if (used & mask)
+                return false;
+            used |= mask;
+        }
+    }
+    return bits_per_4_pixels == desc.bpp * 4u;
+}
+
+constexpr bool allPlanesConsistent() {
+    for (const auto& desc : kGbmFormats)
+        if (!desc.bpp || !hasConsistentPlanes(desc))
+            return false;
+    return true;
+}
+
+constexpr bool allAndroidFormatsKnown() {
+    for (const auto& desc : kAndroidFormats)
+        if (desc.gbm_format != GRALLOC_GBM_FORMAT_IMPL_DEFINED && !findGbm(desc.gbm_format))
+            return false;
+    return true;
+}
+
+constexpr bool allIndexed() {
+    for (const auto& desc : kGbmFormats)
+        if (findGbm(desc.gbm_format) != &desc)
+            return false;
+    for (const auto& desc : kAndroidFormats)
+        if (findAndroid(desc.android_format) != &desc)
+            return false;
+    return true;
+}
+
+static_assert(hasUniqueKeys(kGbmFormats, gbmKey), "duplicated GBM format");
+static_assert(hasUniqueKeys(kAndroidFormats, androidKey), "duplicated Android format");
+static_assert(allPlanesConsistent(), "plane layouts don't match the bpp of the format");
+static_assert(allAndroidFormatsKnown(), "Android format converts to an unknown GBM format");
+static_assert(allIndexed(), "format index is broken");
+static_assert(kGbmFormatIndex.max_probe <= 4 && kAndroidFormatIndex.max_probe <= 4,
+              "format index has too long probe chains");
+
+} // namespace gralloc_formats
+
+static inline const gralloc_gbm_format_desc_t *gralloc_get_gbm_format_desc(uint32_t gbm_format) {
+    return gralloc_formats::findGbm(gbm_format);
+}
+
+static inline const gralloc_android_format_desc_t *gralloc_get_android_format_desc(uint32_t android_format) {
+    return gralloc_formats::findAndroid(android_format);
+}
+
+/*
+ * Single-plane stand-ins of the planar YUV formats, for the drivers which
+ * can't allocate them: the chroma planes are stacked below the luma rows of
+ * a taller BO. YV12 keeps the GR88 layout which was used before.
+ * @return the format of the stand-in BO, or 0 if the format has none.
+ */
+static inline uint32_t gralloc_gm_yuv_fallback_format(uint32_t gbm_format) {
+    switch (gbm_format) {
+    case GBM_FORMAT_YVU420:
+        return GBM_FORMAT_GR88;
+    case GBM_FORMAT_NV12:
+    case GBM_FORMAT_NV21:
+        return GBM_FORMAT_R8;
+    case GRALLOC_GBM_FORMAT_P010:
+        return GBM_FORMAT_R16;
+    default:
+        return 0;
+    }
+}
+
+#endif // _GRALLOC_GBM_FORMATS_H_
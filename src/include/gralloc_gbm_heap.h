@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2025  Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ *
+ * Authors:
+ *      Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ */
+
+#ifndef _GRALLOC_GBM_HEAP_H_
+#define _GRALLOC_GBM_HEAP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * DMA-BUF heap backend
+ * Buffers which no device but the CPU (and the camera) touches are
+ * allocated from the system heaps instead of GBM: BLOB buffers and the
+ * CPU-only usages. They are linear, so the handles look like the ones of
+ * linear GBM BOs and the processes which import them don't need GBM either.
+ *
+ * The CPU-heavy usages get the cached "system" heap, the others
+ * "system-uncached" if the kernel has it.
+ */
+#define GRALLOC_HEAP_PROP "vendor.gralloc.dmabuf_heap"
+#define GRALLOC_HEAP_SYSTEM "system"
+#define GRALLOC_HEAP_SYSTEM_UNCACHED "system-uncached"
+
+// Stride alignment of the heap buffers, what the cache lines and most DMA engines want.
+#define GRALLOC_HEAP_STRIDE_ALIGN 64
+
+/*
+ * Whether a buffer with the format and usage belongs to the heaps. It only
+ * depends on its arguments (and GRALLOC_HEAP_PROP), so the allocator and the
+ * importers agree on it.
+ * @usage the whole 64-bit Android usage.
+ */
+bool gralloc_heap_is_eligible(uint32_t android_format, uint64_t usage);
+/*
+ * @return the fd of a new dma-buf of the size, or a negative error code.
+ */
+int gralloc_heap_allocate(size_t size, uint32_t usage);
+
+#endif // _GRALLOC_GBM_HEAP_H_
@@ -17,37 +17,167 @@
 #define GRALLOC_DEFAULT_DEVICE_PATH "/dev/dri/renderD128"
 
 #define MAX(A, B) ((A) > (B) ? (A) : (B))
+#define MIN(A, B) ((A) < (B) ? (A) : (B))
 #define ALIGN(A, B) (((A) + (B)-1) & ~((B)-1))
 #define IS_ALIGNED(A, B) (ALIGN((A), (B)) == (A))
 #define DIV_ROUND_UP(n, d) (((n) + (d)-1) / (d))
 
+// BufferUsage bits which gralloc0 has no name for
+#define GRALLOC_GM_USAGE_VIDEO_DECODER (1ULL << 22)
+#define GRALLOC_GM_USAGE_GPU_DATA_BUFFER (1ULL << 24)
+#define GRALLOC_GM_USAGE_FRONT_BUFFER (1ULL << 32)
+
+/*
+ * Fixed-rate (lossy) compression of the GPU-only video buffers, which trade
+ * quality for memory bandwidth. GRALLOC_FIXED_COMPRESSION_PROP is the policy:
+ * "none" (default), "default" to let the driver pick the rate, or the bits
+ * per component, 1 to 12. An allocation can ask for it with the vendor
+ * option GRALLOC_FIXED_COMPRESSION_OPTION in
+ * BufferDescriptorInfo.additionalOptions, whose value is the bits per
+ * component, 0 for the driver default or -1 for none. The option overrides
+ * the policy and applies to any buffer without CPU access.
+ */
+#define GRALLOC_FIXED_COMPRESSION_PROP "vendor.gralloc.fixed_compression"
+#define GRALLOC_FIXED_COMPRESSION_OPTION "vendor.gralloc.gm.FixedCompression"
+// Values of gralloc_buffer_desc.fixed_compression besides the bits per component
+#define GRALLOC_FIXED_COMPRESSION_POLICY 0   // not requested, follow the policy
+#define GRALLOC_FIXED_COMPRESSION_NONE -1
+#define GRALLOC_FIXED_COMPRESSION_DEFAULT -2 // the driver picks the rate
+#define GRALLOC_FIXED_COMPRESSION_MAX_BPC 12
+
+/*
+ * Layered buffers (multiview, texture arrays) are one allocation with the
+ * layers stacked below each other. Every layer starts on a multiple of
+ * GRALLOC_LAYER_ROW_ALIGN rows, a whole number of tile rows of the tiled
+ * layouts, and has its own planes. Compressed layouts can't be split into
+ * layers, so layered BOs never get one.
+ */
+#define GRALLOC_MAX_LAYER_COUNT 64
+#define GRALLOC_LAYER_ROW_ALIGN 64
+
+/*
+ * The reserved region (BufferDescriptorInfo.reservedSize) is per-buffer side
+ * data of the clients. It lives in the dma-buf of the buffer, after the
+ * pixels and page aligned, so that the handle keeps the single fd which
+ * the users of gralloc_handle.h expect. The BO gets the rows to hold it,
+ * and like a layered BO never a compressed layout.
+ */
+#define GRALLOC_MAX_RESERVED_SIZE (64u << 20)
+
 typedef struct gralloc_buffer_desc {
     uint32_t width;
     uint32_t height;
     uint32_t android_format;       // Android PixelFormat
-    uint32_t android_usage;        // Android usage
+    uint64_t android_usage;        // Android usage (BufferUsage)
     uint32_t android_reserved_size;
     uint32_t gbm_format;       // GBM FourCC format
     uint32_t flags;        // gbm_bo_flags combinations
-    uint32_t layer_count;  // Number of layout
+    uint32_t layer_count;  // Number of layers, 0 is 1
+    int32_t fixed_compression; // GRALLOC_FIXED_COMPRESSION_*, or the bits per component
 } gralloc_buffer_desc_t;
 
+#define GRALLOC_FORMAT_CAPS_PATH_PROP "vendor.gralloc.format_caps_path"
+#define GRALLOC_FORMAT_CAPS_DEFAULT_PATH "/data/vendor/gralloc/format_caps"
+
+// Whether the display controller can scan out compressed (AFBC) buffers
+#define GRALLOC_SCANOUT_COMPRESSION_PROP "vendor.gralloc.scanout_compression"
+
+#define GRALLOC_MAP_CACHE_SIZE_PROP "vendor.gralloc.map_cache_mb"
+#define GRALLOC_MAP_CACHE_DEFAULT_MB_32 64
+#define GRALLOC_MAP_CACHE_DEFAULT_MB_64 512
+
+/*
+ * CPU locks of tiled or compressed single-plane BOs go through a linear
+ * shadow in system memory. A read lock fills it from the BO for the access
+ * region only, and the regions locked for writing are written back on flush
+ * and on the last unlock, so Mesa detiles or decompresses the rectangles
+ * which are used rather than the whole surface. Idle shadows are kept in the
+ * map cache and share its budget (GRALLOC_MAP_CACHE_SIZE_PROP).
+ */
+#define GRALLOC_SHADOW_PROP "vendor.gralloc.shadow"
+
+/*
+ * Prefault the locked rows, so that the first CPU pass over a freshly mapped
+ * buffer doesn't take a page fault per page. One policy for the read usage,
+ * one for the write usage of the lock; a lock with both prefaults for write.
+ */
+#define GRALLOC_PREFAULT_READ_PROP "vendor.gralloc.prefault_read"
+#define GRALLOC_PREFAULT_WRITE_PROP "vendor.gralloc.prefault_write"
+#define GRALLOC_PREFAULT_NEVER 0
+#define GRALLOC_PREFAULT_OFTEN 1  // only SW_READ_OFTEN / SW_WRITE_OFTEN (default)
+#define GRALLOC_PREFAULT_ALWAYS 2 // any CPU usage
+
+/*
+ * How long a CPU lock waits for the locks of other threads on the same BO
+ * before failing with -EBUSY. 0 or less doesn't wait.
+ */
+#define GRALLOC_LOCK_TIMEOUT_PROP "vendor.gralloc.lock_timeout_ms"
+#define GRALLOC_LOCK_DEFAULT_TIMEOUT_MS 500
+
 typedef struct bo_data {
 	void *map_data;
+	void *map_addr;  // CPU address of the mapping, kept while map_data is set
+	size_t map_size; // size of the direct mapping
+	int map_flags;   // gbm_bo_transfer_flags of the mapping
+	int map_direct;  // map_data is a mmap() of the dma-buf, not a gbm_bo_map() cookie
+	int map_y;       // first row covered by the mapping
+	int map_h;       // number of rows covered by the mapping
+	int map_populated; // the whole mapping has been prefaulted
+	int map_shadow;  // map_data is a linear shadow of a tiled BO, not a gbm_bo_map() cookie
+	int dirty_x, dirty_y, dirty_w, dirty_h; // region of the shadow to write back
+	uint64_t sync_flags; // DMA_BUF_SYNC_READ/WRITE of the open CPU access window
 	int lock_count;
 	int locked_for;
 } bo_data_t;
 
+/*
+ * Metadata of a registered BO, cached when it was allocated or imported.
+ */
+typedef struct gralloc_bo_info {
+    uint32_t gbm_format;   // GBM FourCC format of the BO
+    uint32_t stride;       // stride of plane 0 in bytes
+    uint64_t modifier;     // format modifier of the BO
+    uint64_t size;         // allocation size in bytes
+    uint32_t height;       // rows of plane 0 of all layers, more than the buffer height for a YUV stand-in
+    uint32_t num_planes;   // number of planes of the pixel format
+    uint32_t offsets[GRALLOC_HANDLE_MAX_PLANES]; // offset of each plane in bytes
+    uint32_t strides[GRALLOC_HANDLE_MAX_PLANES]; // stride of each plane in bytes
+    uint32_t layer_count;  // number of layers, the planes above are the ones of layer 0
+    uint32_t layer_stride; // bytes from a layer to the next one
+} gralloc_bo_info_t;
+
+typedef struct gralloc_map_cache_stats {
+    uint64_t hits;          // locks served by an existing mapping
+    uint64_t misses;        // locks which had to map the BO
+    uint64_t evictions;     // idle mappings dropped from the cache
+    uint64_t cached_bytes;  // size of the idle mappings in the cache
+    uint32_t cached_count;  // number of the idle mappings in the cache
+    uint64_t direct_maps;   // mappings done by mmap() on the dma-buf
+    uint64_t gbm_maps;      // mappings done by gbm_bo_map()
+    uint64_t prefaults;     // locks which prefaulted their rows
+    uint64_t prefaulted_bytes;
+    uint64_t lock_waits;    // locks which had to wait for the locks of other threads
+    uint64_t shadow_locks;  // locks served by a shadow
+    uint64_t shadow_read_bytes;  // copied from the BOs into their shadows
+    uint64_t shadow_write_bytes; // written back from the shadows
+} gralloc_map_cache_stats_t;
+
 /*
  * gralloc_gbm_device_init()
- * Initialize a GBM device (not create), we create the device by using
- * gralloc_gbm_device_create().
- * @return the fd of GBM device
+ * Open the render node and create its GBM device (gralloc_gbm_device.h).
+ * @return the fd of the render GBM device
  */
 int gralloc_gbm_device_init();
+/*
+ * gralloc_gbm_allocator_device_init()
+ * gralloc_gbm_device_init(), plus the display node if the board has one.
+ * Only for the allocator, the mapper never opens the display node.
+ * @return the fd of the render GBM device
+ */
+int gralloc_gbm_allocator_device_init();
 
 uint32_t gralloc_gm_android_format_to_gbm_format(uint32_t android_format);
-unsigned int gralloc_gm_get_gbm_flags_from_android_usage(int usage, int format);
+unsigned int gralloc_gm_get_gbm_flags_from_android_usage(uint64_t usage, int format);
 int gralloc_gm_get_bpp_from_gbm_format(int gbm_format);
 int gralloc_gm_get_bytes_per_pixel_from_gbm_format(int gbm_format);
 int gralloc_gm_get_bytes_per_pixel_from_android_format(int android_format);
@@ -57,24 +187,66 @@ inline static int gralloc_get_max_texture_2d_size() {
     return UINT32_MAX;
 }
 /*
- * Create or reuse a GBM device.
+ * Create or reuse the render GBM device, fd is only used if no render node
+ * has been opened yet.
  * @return Error code.
  */
 int gralloc_gbm_device_create(int fd, struct gbm_device **dev);
-bool gralloc_is_format_supported();
+/*
+ * Probe which formats and usages the GBM device can allocate, or load the
+ * result of an earlier probe on the same driver. The queries below probe
+ * lazily if this hasn't been called.
+ */
+int gralloc_gbm_probe_format_caps();
+bool gralloc_is_format_supported(uint32_t android_format, uint64_t android_usage);
 bool gralloc_is_desc_support(const struct gralloc_buffer_desc* desc);
 int32_t gralloc_allocate(const struct gralloc_buffer_desc *desc, int32_t *out_stride, native_handle_t **out_handle);
 struct gbm_bo *gralloc_get_gbm_bo_from_handle(buffer_handle_t handle);
-void gralloc_gbm_destroy_user_data(struct gbm_bo *bo, void *data);
-static int gralloc_gbm_map(buffer_handle_t handle, int enable_write, void **addr);
-static void gralloc_gbm_unmap(struct gbm_bo *bo);
-int gralloc_gbm_bo_lock(buffer_handle_t handle, int usage, int /*x*/, int /*y*/, int /*w*/, int /*h*/, void **addr);
+int gralloc_gbm_get_bo_info(buffer_handle_t handle, gralloc_bo_info_t *info);
+/*
+ * Map the reserved region of the buffer, read-write. The mapping is made by
+ * the first call and kept until the buffer is freed.
+ * @return 0, *addr is nullptr and *size 0 if the buffer has no reserved region.
+ */
+int gralloc_gbm_get_reserved_region(buffer_handle_t handle, void **addr, uint64_t *size);
+/*
+ * Unmap all of the idle mappings kept for unlocked linear BOs,
+ * e.g. when the process is running out of address space.
+ */
+void gralloc_gbm_trim_map_cache();
+void gralloc_gbm_get_map_cache_stats(gralloc_map_cache_stats_t *stats);
+/*
+ * Lock the BO for the CPU access. Only the rows of the access region are
+ * mapped when the backend allows it, but *addr always points to pixel (0, 0).
+ */
+int gralloc_gbm_bo_lock(buffer_handle_t handle, int usage, int x, int y, int w, int h, void **addr);
 int gralloc_gbm_bo_unlock(buffer_handle_t handle);
+/*
+ * Make the CPU writes of a locked BO visible to the devices (flush), or the
+ * device writes visible to the CPU (reread), without unlocking the BO.
+ */
+int gralloc_gbm_bo_flush(buffer_handle_t handle);
+int gralloc_gbm_bo_reread(buffer_handle_t handle);
 int gralloc_gbm_bo_lock_ycbcr(buffer_handle_t handle, int usage, int x, int y, int w, int h, struct android_ycbcr *ycbcr);
 int gralloc_gbm_bo_lock_async(buffer_handle_t handle, int usage, int x, int y, int w, int h, void **addr, int fence_fd);
+/*
+ * Lock the BO once the fence has signaled, without blocking the caller. The
+ * lock is taken, and the callback runs, on a worker thread of its own: the
+ * lock may wait for the other locks of the BO, which must not hold up the
+ * fence worker. The fence is owned by gralloc_gm.
+ * @err of the callback: 0 and addr of the BO, or an error code.
+ */
+typedef void (*gralloc_lock_callback_t)(int err, void *addr, void *data);
+int gralloc_gbm_bo_lock_deferred(buffer_handle_t handle, int usage, int x, int y, int w, int h,
+                                 int fence_fd, gralloc_lock_callback_t callback, void *data);
 int gralloc_gbm_bo_unlock_async(buffer_handle_t handle, int *fence_fd);
 int gralloc_gbm_bo_lock_async_ycbcr(buffer_handle_t handle, int usage, int x, int y, int w, int h, struct android_ycbcr *ycbcr, int fence_fd);
 int gralloc_gm_buffer_import(buffer_handle_t buffer_handle);
 int gralloc_gm_buffer_free(buffer_handle_t handle);
+/*
+ * The BOs of freed buffers are destroyed later by a worker (gralloc_gbm_reaper.h),
+ * wait until the ones freed so far are gone.
+ */
+void gralloc_gm_buffer_free_drain();
 
 #endif // _GRALLOC_GBM_MESA_H_
\ No newline at end of file
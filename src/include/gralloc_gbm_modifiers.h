@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2025  Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ *
+ * Authors:
+ *      Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ */
+
+#ifndef _GRALLOC_GBM_MODIFIERS_H_
+#define _GRALLOC_GBM_MODIFIERS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <drm_fourcc.h>
+#include <hardware/gralloc.h>
+#include <mesa/gbm.h>
+
+/*
+ * The modifiers which gralloc_gm knows. Their support per format is probed
+ * into the format caps (bit n is kGrallocCapsModifiers[n]), and they are the
+ * candidates which gralloc_allocate() offers to GBM.
+ */
+static constexpr uint64_t kGrallocCapsModifiers[] = {
+    DRM_FORMAT_MOD_LINEAR,
+    // Mali (panfrost/panthor): AFBC and 16x16 u-interleaved tiling
+    DRM_FORMAT_MOD_ARM_AFBC(AFBC_FORMAT_MOD_BLOCK_SIZE_16x16 | AFBC_FORMAT_MOD_SPARSE |
+                            AFBC_FORMAT_MOD_YTR),
+    DRM_FORMAT_MOD_ARM_AFBC(AFBC_FORMAT_MOD_BLOCK_SIZE_16x16 | AFBC_FORMAT_MOD_SPARSE),
+    DRM_FORMAT_MOD_ARM_AFBC(AFBC_FORMAT_MOD_BLOCK_SIZE_16x16 | AFBC_FORMAT_MOD_SPARSE |
+                            AFBC_FORMAT_MOD_SPLIT | AFBC_FORMAT_MOD_YTR),
+    DRM_FORMAT_MOD_ARM_AFBC(AFBC_FORMAT_MOD_BLOCK_SIZE_32x8 | AFBC_FORMAT_MOD_SPARSE |
+                            AFBC_FORMAT_MOD_YTR),
+    DRM_FORMAT_MOD_ARM_16X16_BLOCK_U_INTERLEAVED,
+};
+
+#define GRALLOC_CAPS_NUM_MODIFIERS (sizeof(kGrallocCapsModifiers) / sizeof(kGrallocCapsModifiers[0]))
+#define GRALLOC_CAPS_LINEAR_MODIFIER (1u << 0)
+
+static inline bool gralloc_modifier_is_compressed(uint64_t modifier) {
+    return (modifier >> 52) == ((DRM_FORMAT_MOD_VENDOR_ARM << 4) | DRM_FORMAT_MOD_ARM_TYPE_AFBC);
+}
+
+/*
+ * Pick the modifiers which GBM may choose from for a new BO:
+ *  - CPU access, cursor or GBM_BO_USE_LINEAR: linear only, so the BO can be
+ *    mapped directly.
+ *  - GPU only (render/texture, maybe protected): the compressed and tiled
+ *    layouts which the driver supports for the format, plus linear.
+ *  - Other consumers (display, video, camera...) may not understand those
+ *    layouts, so they get linear too, unless @scanout_compression says that
+ *    the display controller can scan out AFBC
+ *    (GRALLOC_SCANOUT_COMPRESSION_PROP).
+ *  - Front buffer rendering never gets a compressed layout, its headers
+ *    would be out of sync with the pixels which the display is reading.
+ *    Neither do layered BOs or BOs with a reserved region (@uncompressed),
+ *    the layers and the region couldn't be found by their offsets.
+ * @supported the modifiers which the device supports for the format, bit n
+ *            is kGrallocCapsModifiers[n].
+ * Returns the number of modifiers, 0 if we should let the driver decide.
+ */
+static inline uint32_t gralloc_modifiers_select(uint32_t supported, uint32_t flags, int usage,
+                                                bool uncompressed, bool scanout_compression,
+                                                uint64_t *modifiers) {
+    const int cpu_usage = GRALLOC_USAGE_SW_READ_MASK | GRALLOC_USAGE_SW_WRITE_MASK |
+                          GRALLOC_USAGE_CURSOR | GRALLOC_USAGE_RENDERSCRIPT;
+    const int scanout_usage = GRALLOC_USAGE_HW_FB | GRALLOC_USAGE_HW_COMPOSER;
+    const int other_usage = GRALLOC_USAGE_HW_2D | GRALLOC_USAGE_EXTERNAL_DISP |
+                            GRALLOC_USAGE_HW_VIDEO_ENCODER | GRALLOC_USAGE_HW_CAMERA_MASK;
+    uint32_t allowed, count = 0;
+
+    if ((usage & (cpu_usage | other_usage)) || (flags & GBM_BO_USE_LINEAR))
+        allowed = GRALLOC_CAPS_LINEAR_MODIFIER;
+    else if ((usage & scanout_usage) && !scanout_compression)
+        allowed = GRALLOC_CAPS_LINEAR_MODIFIER;
+    else if (usage & (GRALLOC_USAGE_HW_RENDER | GRALLOC_USAGE_HW_TEXTURE | scanout_usage))
+        allowed = ~0u;
+    else
+        allowed = GRALLOC_CAPS_LINEAR_MODIFIER;
+
+    allowed &= supported;
+    if (flags & GBM_BO_USE_FRONT_RENDERING)
+        uncompressed = true;
+    for (uint32_t m = 0; m < GRALLOC_CAPS_NUM_MODIFIERS; m++) {
+        if (uncompressed && gralloc_modifier_is_compressed(kGrallocCapsModifiers[m]))
+            continue;
+        if (allowed & (1u << m))
+            modifiers[count++] = kGrallocCapsModifiers[m];
+    }
+    return count;
+}
+
+#endif // _GRALLOC_GBM_MODIFIERS_H_
@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2025  Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ *
+ * Authors:
+ *      Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ */
+
+#ifndef _GRALLOC_GBM_PREFAULT_H_
+#define _GRALLOC_GBM_PREFAULT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#define MADV_POPULATE_WRITE 23
+#endif
+
+/*
+ * Fault in the pages of [addr, addr + len), for reading or for writing
+ * (@prot PROT_READ or PROT_WRITE). MADV_POPULATE_READ/WRITE (Linux 5.14)
+ * does it in one call; it refuses the VM_PFNMAP mappings of some exporters,
+ * which get a read of every page instead.
+ * @return the bytes of the page aligned range.
+ */
+static inline size_t gralloc_prefault_range(void *addr, size_t len, int prot, size_t page_size) {
+    uintptr_t start = (uintptr_t)addr & ~(uintptr_t)(page_size - 1);
+    uintptr_t end = ((uintptr_t)addr + len + page_size - 1) & ~(uintptr_t)(page_size - 1);
+
+    if (!len)
+        return 0;
+
+    if (!madvise((void *)start, end - start, prot == PROT_WRITE ? MADV_POPULATE_WRITE : MADV_POPULATE_READ))
+        return end - start;
+
+    // Only helps the shmem backed GEM objects, harmless for the others.
+    madvise((void *)start, end - start, MADV_WILLNEED);
+    for (uintptr_t page = start; page < end; page += page_size)
+        (void)*(volatile const uint8_t *)page;
+    return end - start;
+}
+
+#endif // _GRALLOC_GBM_PREFAULT_H_
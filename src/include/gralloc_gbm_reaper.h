@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2025  Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ *
+ * Authors:
+ *      Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ */
+
+#ifndef _GRALLOC_GBM_REAPER_H_
+#define _GRALLOC_GBM_REAPER_H_
+
+#include <stdint.h>
+
+#include <mesa/gbm.h>
+
+/*
+ * Deferred BO destruction
+ * gbm_bo_destroy() closes GEM handles and tears down the resources of the
+ * driver, which is too slow for the threads which free buffers (the main
+ * thread of SurfaceFlinger, binder threads). The handle is invalidated by
+ * the caller right away, and the BOs are handed over to a low priority
+ * worker which destroys them in batches: everything queued while it was
+ * busy is destroyed in the next round.
+ *
+ * GRALLOC_REAPER_PROP turns the worker off, the BOs are then destroyed by
+ * the caller. So are they when more than GRALLOC_REAPER_MAX_PENDING are
+ * waiting, which bounds the memory held by dead BOs.
+ */
+#define GRALLOC_REAPER_PROP "vendor.gralloc.async_destroy"
+#define GRALLOC_REAPER_MAX_PENDING 1024
+// Nice value of the worker, ANDROID_PRIORITY_BACKGROUND.
+#define GRALLOC_REAPER_NICE 10
+
+typedef struct gralloc_reaper_stats {
+    uint64_t queued;    // BOs handed over to the worker
+    uint64_t destroyed; // BOs destroyed by the worker
+    uint64_t batches;   // rounds of the worker
+    uint64_t inline_destroys; // BOs destroyed by the caller
+    uint32_t pending;   // BOs waiting for the worker
+    uint32_t max_batch; // most BOs destroyed in one round
+} gralloc_reaper_stats_t;
+
+/*
+ * Destroy the BO, now or later, it is owned by the reaper from now on.
+ * The BO must not be in use by any handle anymore.
+ */
+void gralloc_reaper_destroy(struct gbm_bo *bo);
+/*
+ * Wait until every BO queued before the call has been destroyed.
+ */
+void gralloc_reaper_drain();
+void gralloc_reaper_get_stats(gralloc_reaper_stats_t *stats);
+
+#endif // _GRALLOC_GBM_REAPER_H_
@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2025  Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ *
+ * Authors:
+ *      Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ */
+
+#ifndef _GRALLOC_GBM_STATS_H_
+#define _GRALLOC_GBM_STATS_H_
+
+#include <stdint.h>
+
+#include "gralloc_gbm_bo_cache.h"
+#include "gralloc_gbm_fence.h"
+#include "gralloc_gbm_mesa.h"
+#include "gralloc_gbm_reaper.h"
+
+/*
+ * Counters and latencies of the buffer operations of this process, and the
+ * gauges of the BOs registered in it. Build with -DGRALLOC_STATS=0 to
+ * compile all of it out, gralloc_stats_get_snapshot() returns -ENOTSUP then.
+ *
+ * Counters, gauges and histograms are striped over GRALLOC_STATS_SHARDS
+ * shards, a thread always updates the same one, so that binder threads
+ * don't bounce their cache lines. The histograms are log-linear (HDR): every power of two of
+ * nanoseconds is split into 2^GRALLOC_STATS_SUB_BUCKET_BITS buckets, the
+ * error of a recorded latency is below 12.5%.
+ */
+#ifndef GRALLOC_STATS
+#define GRALLOC_STATS 1
+#endif
+
+#define GRALLOC_STATS_SHARDS 16
+#define GRALLOC_STATS_SUB_BUCKET_BITS 3
+#define GRALLOC_STATS_SUB_BUCKETS (1 << GRALLOC_STATS_SUB_BUCKET_BITS)
+// Up to 2^36 ns (68 s), longer latencies go to the last bucket.
+#define GRALLOC_STATS_HIST_BUCKETS (35 * GRALLOC_STATS_SUB_BUCKETS)
+// Slots of the per-format gauges, one per entry of kAndroidFormats.
+#define GRALLOC_STATS_MAX_FORMATS 24
+
+typedef enum gralloc_stats_op {
+    GRALLOC_STATS_ALLOCATE = 0,
+    GRALLOC_STATS_IMPORT,
+    GRALLOC_STATS_LOCK,
+    GRALLOC_STATS_UNLOCK,
+    GRALLOC_STATS_FREE,
+    GRALLOC_STATS_NUM_OPS,
+} gralloc_stats_op_t;
+
+// The main consumer of a buffer, picked from its usage in this order.
+typedef enum gralloc_stats_usage_class {
+    GRALLOC_STATS_USAGE_CAMERA = 0,
+    GRALLOC_STATS_USAGE_VIDEO,
+    GRALLOC_STATS_USAGE_DISPLAY,  // framebuffer and cursor
+    GRALLOC_STATS_USAGE_RENDER,
+    GRALLOC_STATS_USAGE_TEXTURE,  // GPU or composer
+    GRALLOC_STATS_USAGE_CPU,
+    GRALLOC_STATS_USAGE_OTHER,
+    GRALLOC_STATS_NUM_USAGE_CLASSES,
+} gralloc_stats_usage_class_t;
+
+typedef struct gralloc_stats_op_stats {
+    uint64_t count;
+    uint64_t errors;
+    uint64_t latency_ns[GRALLOC_STATS_HIST_BUCKETS];
+} gralloc_stats_op_stats_t;
+
+typedef struct gralloc_stats_gauge {
+    int64_t live_count;        // BOs registered in this process
+    int64_t live_bytes;        // their size
+    uint64_t allocated_bytes;  // allocated by this process since it started
+} gralloc_stats_gauge_t;
+
+typedef struct gralloc_stats_snapshot {
+    gralloc_stats_op_stats_t ops[GRALLOC_STATS_NUM_OPS];
+    uint32_t num_formats;
+    uint32_t formats[GRALLOC_STATS_MAX_FORMATS]; // Android format of each gauge
+    gralloc_stats_gauge_t format_gauges[GRALLOC_STATS_MAX_FORMATS];
+    gralloc_stats_gauge_t usage_gauges[GRALLOC_STATS_NUM_USAGE_CLASSES];
+    gralloc_map_cache_stats_t map_cache;
+    gralloc_bo_cache_stats_t bo_cache;
+    gralloc_fence_stats_t fence;
+    gralloc_reaper_stats_t reaper;
+} gralloc_stats_snapshot_t;
+
+/*
+ * Sum the shards up. The counters are read one by one while other threads
+ * update them, the snapshot is not atomic.
+ * @return 0, or -ENOTSUP if the stats are compiled out.
+ */
+int gralloc_stats_get_snapshot(gralloc_stats_snapshot_t *snapshot);
+/*
+ * @percentile in [0, 100]
+ * @return the upper bound in ns of the bucket holding the percentile, 0 if
+ *         the histogram is empty.
+ */
+uint64_t gralloc_stats_hist_percentile(const uint64_t *latency_ns, double percentile);
+const char *gralloc_stats_op_name(gralloc_stats_op_t op);
+
+#if GRALLOC_STATS
+/*
+ * Recording, for libgralloc_gm itself.
+ * @return the start time to pass to gralloc_stats_end().
+ */
+uint64_t gralloc_stats_begin();
+void gralloc_stats_end(gralloc_stats_op_t op, uint64_t start_ns, int err);
+// The BO of the handle has been registered, allocated by us or imported.
+void gralloc_stats_bo_registered(uint32_t android_format, uint32_t usage, uint64_t size, bool allocated);
+void gralloc_stats_bo_unregistered(uint32_t android_format, uint32_t usage, uint64_t size);
+#else
+static inline uint64_t gralloc_stats_begin() { return 0; }
+static inline void gralloc_stats_end(gralloc_stats_op_t, uint64_t, int) {}
+static inline void gralloc_stats_bo_registered(uint32_t, uint32_t, uint64_t, bool) {}
+static inline void gralloc_stats_bo_unregistered(uint32_t, uint32_t, uint64_t) {}
+#endif
+
+#endif // _GRALLOC_GBM_STATS_H_
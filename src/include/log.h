@@ -14,6 +14,10 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <atomic>
 
 #include <android/log.h>
 
@@ -26,6 +30,44 @@
 #define FILEMODE_RW_APPEND "a"
 #define FILEMODE_RW_APPEND_CREATE "a+"
 
+/*
+ * Messages below GRALLOC_LOG_LEVEL are compiled out along with their
+ * arguments. Release builds (NDEBUG) keep the info level and above, pass
+ * -DGRALLOC_LOG_LEVEL=ANDROID_LOG_VERBOSE to get everything back.
+ */
+#ifndef GRALLOC_LOG_LEVEL
+#ifdef NDEBUG
+#define GRALLOC_LOG_LEVEL ANDROID_LOG_INFO
+#else
+#define GRALLOC_LOG_LEVEL ANDROID_LOG_VERBOSE
+#endif
+#endif
+
+// Messages of the same warning or error call site after the burst are dropped until the interval ends.
+#define GRALLOC_LOG_RATELIMIT_INTERVAL_MS 5000
+#define GRALLOC_LOG_RATELIMIT_BURST 10
+
+/*
+ * Queue the messages below ANDROID_LOG_ERROR into a ring buffer, which is
+ * written to logd by a background thread. Read once per process.
+ */
+#define GRALLOC_LOG_ASYNC_PROP "vendor.gralloc.log_async"
+
+typedef struct gralloc_log_ratelimit {
+    std::atomic<int64_t> window_start_ms;
+    std::atomic<uint32_t> count;
+    std::atomic<uint32_t> suppressed;
+} gralloc_log_ratelimit_t;
+
+/*
+ * Implemented by gralloc_gbm_log.cpp.
+ * @return true if the message has been queued to the async sink, false if
+ *         it is disabled or full and the caller should write the message.
+ */
+bool __log_async_vprint(int level, const char *tag, const char *format, va_list va);
+void __log_set_outputs_redirected(void);
+bool __log_outputs_redirected(void);
+
 inline void __flush_redirected_outputs(void) {
     (void)fflush(stderr);
     (void)fflush(stdout);
@@ -41,55 +83,82 @@ inline void __redirect_standard_outputs(void) {
     fprintf(stderr, "%s\n", __func__);
     fprintf(stdout, "%s\n", __func__);
     __flush_redirected_outputs();
+    __log_set_outputs_redirected();
 }
 
 inline void __log(const int level, const char *format, va_list va) {
+    if (level < ANDROID_LOG_ERROR) {
+        va_list copy;
+        va_copy(copy, va);
+        bool queued = __log_async_vprint(level, LOG_TAG, format, copy);
+        va_end(copy);
+        if (queued)
+            return;
+    }
+
     __android_log_vprint(level, LOG_TAG, format, va);
     // HACK: bind the flush operation of the redirects of standard outputs
-    // with normal log output
-    __flush_redirected_outputs();
+    // with normal log output, the async sink flushes after each batch.
+    if (__log_outputs_redirected())
+        __flush_redirected_outputs();
 }
 
-inline void log_v(const char *format, ...) {
+inline void __log_print(const int level, const char *format, ...) {
     va_list va;
     va_start(va, format);
-    __log(ANDROID_LOG_VERBOSE, format, va);
+    __log(level, format, va);
     va_end(va);
 }
 
-inline void log_d(const char *format, ...) {
-    va_list va;
-    va_start(va, format);
-    __log(ANDROID_LOG_DEBUG, format, va);
-    va_end(va);
+inline int64_t __log_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-inline void log_i(const char *format, ...) {
-    va_list va;
-    va_start(va, format);
-    __log(ANDROID_LOG_INFO, format, va);
-    va_end(va);
-}
+/*
+ * @return -1 if the message should be dropped, or the number of messages
+ *         dropped since the last one which went through.
+ */
+inline int __log_ratelimit(gralloc_log_ratelimit_t *ratelimit) {
+    int64_t now_ms = __log_now_ms();
+    int64_t start_ms = ratelimit->window_start_ms.load(std::memory_order_relaxed);
 
-inline void log_w(const char *format, ...) {
-    va_list va;
-    va_start(va, format);
-    __log(ANDROID_LOG_WARN, format, va);
-    va_end(va);
-}
+    if (now_ms - start_ms >= GRALLOC_LOG_RATELIMIT_INTERVAL_MS &&
+        ratelimit->window_start_ms.compare_exchange_strong(start_ms, now_ms, std::memory_order_relaxed))
+        ratelimit->count.store(0, std::memory_order_relaxed);
 
-inline void log_e(const char *format, ...) {
-    va_list va;
-    va_start(va, format);
-    __log(ANDROID_LOG_ERROR, format, va);
-    va_end(va);
-}
+    if (ratelimit->count.fetch_add(1, std::memory_order_relaxed) < GRALLOC_LOG_RATELIMIT_BURST)
+        return (int)ratelimit->suppressed.exchange(0, std::memory_order_relaxed);
 
-inline void log_f(const char *format, ...) {
-    va_list va;
-    va_start(va, format);
-    __log(ANDROID_LOG_FATAL, format, va);
-    va_end(va);
+    ratelimit->suppressed.fetch_add(1, std::memory_order_relaxed);
+    return -1;
 }
 
+#define __GRALLOC_LOG(level, ...)                \
+    do {                                         \
+        if ((level) >= GRALLOC_LOG_LEVEL)        \
+            __log_print((level), __VA_ARGS__);   \
+    } while (0)
+
+#define __GRALLOC_LOG_RATELIMITED(level, ...)                                            \
+    do {                                                                                 \
+        if ((level) >= GRALLOC_LOG_LEVEL) {                                              \
+            static gralloc_log_ratelimit_t __ratelimit;                                  \
+            int __suppressed = __log_ratelimit(&__ratelimit);                            \
+            if (__suppressed > 0)                                                        \
+                __log_print((level), "%d messages suppressed at %s:%d", __suppressed,    \
+                            __FILE__, __LINE__);                                         \
+            if (__suppressed >= 0)                                                       \
+                __log_print((level), __VA_ARGS__);                                       \
+        }                                                                                \
+    } while (0)
+
+#define log_v(...) __GRALLOC_LOG(ANDROID_LOG_VERBOSE, __VA_ARGS__)
+#define log_d(...) __GRALLOC_LOG(ANDROID_LOG_DEBUG, __VA_ARGS__)
+#define log_i(...) __GRALLOC_LOG(ANDROID_LOG_INFO, __VA_ARGS__)
+#define log_w(...) __GRALLOC_LOG_RATELIMITED(ANDROID_LOG_WARN, __VA_ARGS__)
+#define log_e(...) __GRALLOC_LOG_RATELIMITED(ANDROID_LOG_ERROR, __VA_ARGS__)
+#define log_f(...) __GRALLOC_LOG(ANDROID_LOG_FATAL, __VA_ARGS__)
+
 #endif // GRALLOC_GBM_MESA_LOG_H_
\ No newline at end of file
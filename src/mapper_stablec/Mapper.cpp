@@ -15,16 +15,20 @@
 #include <aidl/android/hardware/graphics/allocator/BufferDescriptorInfo.h>
 #include <aidl/android/hardware/graphics/common/BufferUsage.h>
 #include <aidl/android/hardware/graphics/common/PixelFormat.h>
+#include <aidl/android/hardware/graphics/common/PlaneLayoutComponentType.h>
 #include <aidl/android/hardware/graphics/common/StandardMetadataType.h>
 #include <android-base/unique_fd.h>
 #include <android/hardware/graphics/mapper/IMapper.h>
 #include <android/hardware/graphics/mapper/utils/IMapperMetadataTypes.h>
 #include <android/hardware/graphics/mapper/utils/IMapperProvider.h>
 #include <cutils/native_handle.h>
+#include <drm_fourcc.h>
 #include <gralloctypes/Gralloc4.h>
 #include <mutex>
 #include <unordered_map>
 
+#include "gralloc_gbm_fence.h"
+#include "gralloc_gbm_formats.h"
 #include "gralloc_gbm_mesa.h"
 #include "log.h"
 
@@ -63,6 +67,14 @@ static bool isStandardMetadata(AIMapper_MetadataType metadataType) {
 
 int getPlaneLayouts(uint32_t gbmFormat, std::vector<PlaneLayout>* outPlaneLayouts);
 
+// Same with the COMPRESSION of AFBC buffers reported by the Arm gralloc
+static const ExtendableType Compression_AFBC = {"arm.graphics.Compression", 0};
+
+static bool isAfbcModifier(uint64_t modifier) {
+    return (modifier >> 56) == DRM_FORMAT_MOD_VENDOR_ARM &&
+           ((modifier >> 52) & 0xf) == DRM_FORMAT_MOD_ARM_TYPE_AFBC;
+}
+
 // We store the all of metadata with a K,V map [int, struct gralloc_metadata] named gralloc_metadata_prime_fd_map.
 static std::unordered_map<int, struct gralloc_metadata *> gralloc_metadata_prime_fd_map;
 
@@ -171,7 +183,7 @@ AIMapper_Error GbmMesaMapperV5::importBuffer(
         buffer_handle_t _Nullable* _Nonnull outBufferHandle) {
     REQUIRE_DRIVER()
 
-    if (!bufferHandle || bufferHandle->numFds == 0) {
+    if (!gralloc_handle_validate(bufferHandle)) {
         log_e("Failed to importBuffer. Bad handle.");
         return AIMAPPER_ERROR_BAD_BUFFER;
     }
@@ -235,12 +247,17 @@ AIMapper_Error GbmMesaMapperV5::lock(buffer_handle_t _Nonnull bufferHandle, uint
         return AIMAPPER_ERROR_BAD_VALUE;
     }
 
+    // The acquire fence is waited for, or handed over to the dma-buf, by gralloc_gm.
     int usage = static_cast<int>(cpuUsage);
-    int ret = gralloc_gbm_bo_lock(bufferHandle, usage, 
+    int ret = gralloc_gbm_bo_lock_async(bufferHandle, usage,
                                  region.left, region.top, 
                                  region.right - region.left, 
                                  region.bottom - region.top, 
-                                 outData);
+                                 outData, acquireFence.release());
+    if (ret == -ETIME || ret == -EIO) {
+        log_e("Failed to wait for the acquire fence: %d", ret);
+        return AIMAPPER_ERROR_NO_RESOURCES;
+    }
     if (ret) {
         log_e("Failed to lock buffer: %d", ret);
         return AIMAPPER_ERROR_BAD_VALUE;
@@ -252,25 +269,31 @@ AIMapper_Error GbmMesaMapperV5::lock(buffer_handle_t _Nonnull bufferHandle, uint
 AIMapper_Error GbmMesaMapperV5::unlock(buffer_handle_t _Nonnull buffer,
                                            int* _Nonnull releaseFence) {
     VALIDATE_DRIVER_AND_BUFFER_HANDLE(buffer)
-    int ret = gralloc_gbm_bo_unlock(buffer);
+    int ret = gralloc_gbm_bo_unlock_async(buffer, releaseFence);
     if (ret) {
         log_e("Failed to unlock buffer: %d", ret);
         return AIMAPPER_ERROR_BAD_BUFFER;
     }
-    
-    *releaseFence = -1; // Fences not supported
     return AIMAPPER_ERROR_NONE;
 }
 
 AIMapper_Error GbmMesaMapperV5::flushLockedBuffer(buffer_handle_t _Nonnull buffer) {
-    log_w("flushLockedBuffer() required, but not implemented");
-    // No-op for GBM Mesa
+    VALIDATE_DRIVER_AND_BUFFER_HANDLE(buffer)
+    int ret = gralloc_gbm_bo_flush(buffer);
+    if (ret) {
+        log_e("Failed to flush locked buffer: %d", ret);
+        return AIMAPPER_ERROR_BAD_BUFFER;
+    }
     return AIMAPPER_ERROR_NONE;
 }
 
 AIMapper_Error GbmMesaMapperV5::rereadLockedBuffer(buffer_handle_t _Nonnull buffer) {
-    log_w("rereadLockedBuffer() required, but not implemented");
-    // No-op for GBM Mesa
+    VALIDATE_DRIVER_AND_BUFFER_HANDLE(buffer)
+    int ret = gralloc_gbm_bo_reread(buffer);
+    if (ret) {
+        log_e("Failed to reread locked buffer: %d", ret);
+        return AIMAPPER_ERROR_BAD_BUFFER;
+    }
     return AIMAPPER_ERROR_NONE;
 }
 
@@ -315,6 +338,9 @@ int32_t GbmMesaMapperV5::getStandardMetadata(buffer_handle_t handle, F&& provide
     if (!metadata) return AIMAPPER_ERROR_NO_RESOURCES;
 
     if constexpr (metadataType == StandardMetadataType::BUFFER_ID) {
+        // Handles from before version 9 have no ID, their address is the best we have.
+        if (hnd->version >= 9 && hnd->buffer_id)
+            return provide(hnd->buffer_id);
         return provide(reinterpret_cast<uint64_t>(handle));
     }
     if constexpr (metadataType == StandardMetadataType::WIDTH) {
@@ -324,7 +350,7 @@ int32_t GbmMesaMapperV5::getStandardMetadata(buffer_handle_t handle, F&& provide
         return provide(static_cast<int32_t>(hnd->height));
     }
     if constexpr (metadataType == StandardMetadataType::LAYER_COUNT) {
-        return provide(1);
+        return provide(static_cast<uint64_t>(gralloc_handle_layer_count(hnd)));
     }
     if constexpr (metadataType == StandardMetadataType::PIXEL_FORMAT_REQUESTED) {
         return provide(static_cast<PixelFormat>(hnd->format));
@@ -339,13 +365,12 @@ int32_t GbmMesaMapperV5::getStandardMetadata(buffer_handle_t handle, F&& provide
         return provide(hnd->modifier);
     }
     if constexpr (metadataType == StandardMetadataType::USAGE) {
-        return provide(static_cast<BufferUsage>(hnd->usage));
+        return provide(static_cast<BufferUsage>(gralloc_handle_usage(hnd)));
     }
     if constexpr (metadataType == StandardMetadataType::ALLOCATION_SIZE) {
-        size_t size = 0;
-        struct gbm_bo* bo = gralloc_get_gbm_bo_from_handle(handle);
-        if (bo) size = gbm_bo_get_stride(bo) * gbm_bo_get_height(bo);
-        return provide(static_cast<uint64_t>(size));
+        gralloc_bo_info_t info = {};
+        gralloc_gbm_get_bo_info(handle, &info);
+        return provide(static_cast<uint64_t>(info.size));
     }
     if constexpr (metadataType == StandardMetadataType::PROTECTED_CONTENT) {
         uint64_t hasProtectedContent =
@@ -353,6 +378,8 @@ int32_t GbmMesaMapperV5::getStandardMetadata(buffer_handle_t handle, F&& provide
         return provide(hasProtectedContent);
     }
     if constexpr (metadataType == StandardMetadataType::COMPRESSION) {
+        if (isAfbcModifier(hnd->modifier))
+            return provide(Compression_AFBC);
         return provide(android::gralloc4::Compression_None);
     }
     if constexpr (metadataType == StandardMetadataType::INTERLACED) {
@@ -365,16 +392,34 @@ int32_t GbmMesaMapperV5::getStandardMetadata(buffer_handle_t handle, F&& provide
         std::vector<PlaneLayout> planeLayouts;
         getPlaneLayouts(gralloc_gm_android_format_to_gbm_format(hnd->format), &planeLayouts);
 
+        gralloc_bo_info_t info = {};
+        if (gralloc_gbm_get_bo_info(handle, &info) || info.num_planes == 0) {
+            info.num_planes = 1;
+            info.strides[0] = hnd->stride;
+            info.layer_count = 1;
+        }
+
         for (size_t plane = 0; plane < planeLayouts.size(); plane++) {
             PlaneLayout& planeLayout = planeLayouts[plane];
-            planeLayout.offsetInBytes = 0;
-            planeLayout.strideInBytes = hnd->stride;
-            // FIXME: vertical_subsampling=1 for now
-            planeLayout.totalSizeInBytes = hnd->stride * DIV_ROUND_UP(hnd->height, 1);
+            // A compressed BO has a single plane for all of the components.
+            size_t bufferPlane = plane < info.num_planes ? plane : 0;
+            planeLayout.offsetInBytes = info.offsets[bufferPlane];
+            planeLayout.strideInBytes = info.strides[bufferPlane];
             planeLayout.widthInSamples =
-                    hnd->width / planeLayout.horizontalSubsampling;
+                    DIV_ROUND_UP(hnd->width, planeLayout.horizontalSubsampling);
             planeLayout.heightInSamples =
-                    hnd->height / planeLayout.verticalSubsampling;
+                    DIV_ROUND_UP(hnd->height, planeLayout.verticalSubsampling);
+            planeLayout.totalSizeInBytes = planeLayout.strideInBytes * planeLayout.heightInSamples;
+        }
+
+        // The planes of the other layers follow the ones of layer 0, layer by layer.
+        const size_t layerPlanes = planeLayouts.size();
+        for (uint32_t layer = 1; layer < info.layer_count; layer++) {
+            for (size_t plane = 0; plane < layerPlanes; plane++) {
+                PlaneLayout planeLayout = planeLayouts[plane];
+                planeLayout.offsetInBytes += static_cast<int64_t>(layer) * info.layer_stride;
+                planeLayouts.push_back(planeLayout);
+            }
         }
 
         return provide(planeLayouts);
@@ -556,7 +601,13 @@ AIMapper_Error GbmMesaMapperV5::getReservedRegion(buffer_handle_t _Nonnull buffe
     VALIDATE_DRIVER_AND_BUFFER_HANDLE(buffer)
     *outReservedRegion = nullptr;
     *outReservedSize = 0;
-    return AIMAPPER_ERROR_NONE; // Not supported
+
+    int ret = gralloc_gbm_get_reserved_region(buffer, outReservedRegion, outReservedSize);
+    if (ret == -EINVAL)
+        return AIMAPPER_ERROR_BAD_BUFFER;
+    if (ret)
+        return AIMAPPER_ERROR_NO_RESOURCES;
+    return AIMAPPER_ERROR_NONE;
 }
 
 extern "C" uint32_t ANDROID_HAL_MAPPER_VERSION = AIMAPPER_VERSION_5;
@@ -566,274 +617,41 @@ extern "C" AIMapper_Error AIMapper_loadIMapper(AIMapper* _Nullable* _Nonnull out
     return provider.load(outImplementation);
 }
 
-const std::unordered_map<uint32_t, std::vector<PlaneLayout>>& GetPlaneLayoutsMap() {
-    static const auto* kPlaneLayoutsMap =
-            new std::unordered_map<uint32_t, std::vector<PlaneLayout>>({
-                    {GBM_FORMAT_ABGR8888,
-                     {{
-                             .components = {{.type = android::gralloc4::PlaneLayoutComponentType_R,
-                                             .offsetInBits = 0,
-                                             .sizeInBits = 8},
-                                            {.type = android::gralloc4::PlaneLayoutComponentType_G,
-                                             .offsetInBits = 8,
-                                             .sizeInBits = 8},
-                                            {.type = android::gralloc4::PlaneLayoutComponentType_B,
-                                             .offsetInBits = 16,
-                                             .sizeInBits = 8},
-                                            {.type = android::gralloc4::PlaneLayoutComponentType_A,
-                                             .offsetInBits = 24,
-                                             .sizeInBits = 8}},
-                             .sampleIncrementInBits = 32,
-                             .horizontalSubsampling = 1,
-                             .verticalSubsampling = 1,
-                     }}},
-
-                    {GBM_FORMAT_ABGR2101010,
-                     {{
-                             .components = {{.type = android::gralloc4::PlaneLayoutComponentType_R,
-                                             .offsetInBits = 0,
-                                             .sizeInBits = 10},
-                                            {.type = android::gralloc4::PlaneLayoutComponentType_G,
-                                             .offsetInBits = 10,
-                                             .sizeInBits = 10},
-                                            {.type = android::gralloc4::PlaneLayoutComponentType_B,
-                                             .offsetInBits = 20,
-                                             .sizeInBits = 10},
-                                            {.type = android::gralloc4::PlaneLayoutComponentType_A,
-                                             .offsetInBits = 30,
-                                             .sizeInBits = 2}},
-                             .sampleIncrementInBits = 32,
-                             .horizontalSubsampling = 1,
-                             .verticalSubsampling = 1,
-                     }}},
-
-                    {GBM_FORMAT_ABGR16161616F,
-                     {{
-                             .components = {{.type = android::gralloc4::PlaneLayoutComponentType_R,
-                                             .offsetInBits = 0,
-                                             .sizeInBits = 16},
-                                            {.type = android::gralloc4::PlaneLayoutComponentType_G,
-                                             .offsetInBits = 16,
-                                             .sizeInBits = 16},
-                                            {.type = android::gralloc4::PlaneLayoutComponentType_B,
-                                             .offsetInBits = 32,
-                                             .sizeInBits = 16},
-                                            {.type = android::gralloc4::PlaneLayoutComponentType_A,
-                                             .offsetInBits = 48,
-                                             .sizeInBits = 16}},
-                             .sampleIncrementInBits = 64,
-                             .horizontalSubsampling = 1,
-                             .verticalSubsampling = 1,
-                     }}},
-
-                    {GBM_FORMAT_ARGB8888,
-                     {{
-                             .components = {{.type = android::gralloc4::PlaneLayoutComponentType_B,
-                                             .offsetInBits = 0,
-                                             .sizeInBits = 8},
-                                            {.type = android::gralloc4::PlaneLayoutComponentType_G,
-                                             .offsetInBits = 8,
-                                             .sizeInBits = 8},
-                                            {.type = android::gralloc4::PlaneLayoutComponentType_R,
-                                             .offsetInBits = 16,
-                                             .sizeInBits = 8},
-                                            {.type = android::gralloc4::PlaneLayoutComponentType_A,
-                                             .offsetInBits = 24,
-                                             .sizeInBits = 8}},
-                             .sampleIncrementInBits = 32,
-                             .horizontalSubsampling = 1,
-                             .verticalSubsampling = 1,
-                     }}},
-
-                    {GBM_FORMAT_NV12,
-                     {{
-                              .components = {{.type = android::gralloc4::PlaneLayoutComponentType_Y,
-                                              .offsetInBits = 0,
-                                              .sizeInBits = 8}},
-                              .sampleIncrementInBits = 8,
-                              .horizontalSubsampling = 1,
-                              .verticalSubsampling = 1,
-                      },
-                      {
-                              .components =
-                                      {{.type = android::gralloc4::PlaneLayoutComponentType_CB,
-                                        .offsetInBits = 0,
-                                        .sizeInBits = 8},
-                                       {.type = android::gralloc4::PlaneLayoutComponentType_CR,
-                                        .offsetInBits = 8,
-                                        .sizeInBits = 8}},
-                              .sampleIncrementInBits = 16,
-                              .horizontalSubsampling = 2,
-                              .verticalSubsampling = 2,
-                      }}},
-
-                    {GBM_FORMAT_NV21,
-                     {{
-                              .components = {{.type = android::gralloc4::PlaneLayoutComponentType_Y,
-                                              .offsetInBits = 0,
-                                              .sizeInBits = 8}},
-                              .sampleIncrementInBits = 8,
-                              .horizontalSubsampling = 1,
-                              .verticalSubsampling = 1,
-                      },
-                      {
-                              .components =
-                                      {{.type = android::gralloc4::PlaneLayoutComponentType_CR,
-                                        .offsetInBits = 0,
-                                        .sizeInBits = 8},
-                                       {.type = android::gralloc4::PlaneLayoutComponentType_CB,
-                                        .offsetInBits = 8,
-                                        .sizeInBits = 8}},
-                              .sampleIncrementInBits = 16,
-                              .horizontalSubsampling = 2,
-                              .verticalSubsampling = 2,
-                      }}},
-
-                    {GBM_FORMAT_R8,
-                     {{
-                             .components = {{.type = android::gralloc4::PlaneLayoutComponentType_R,
-                                             .offsetInBits = 0,
-                                             .sizeInBits = 8}},
-                             .sampleIncrementInBits = 8,
-                             .horizontalSubsampling = 1,
-                             .verticalSubsampling = 1,
-                     }}},
-
-                    {GBM_FORMAT_R16,
-                     {{
-                             .components = {{.type = android::gralloc4::PlaneLayoutComponentType_R,
-                                             .offsetInBits = 0,
-                                             .sizeInBits = 16}},
-                             .sampleIncrementInBits = 16,
-                             .horizontalSubsampling = 1,
-                             .verticalSubsampling = 1,
-                     }}},
-
-                    {GBM_FORMAT_RGB565,
-                     {{
-                             .components = {{.type = android::gralloc4::PlaneLayoutComponentType_B,
-                                             .offsetInBits = 0,
-                                             .sizeInBits = 5},
-                                            {.type = android::gralloc4::PlaneLayoutComponentType_G,
-                                             .offsetInBits = 5,
-                                             .sizeInBits = 6},
-                                            {.type = android::gralloc4::PlaneLayoutComponentType_R,
-                                             .offsetInBits = 11,
-                                             .sizeInBits = 5}},
-                             .sampleIncrementInBits = 16,
-                             .horizontalSubsampling = 1,
-                             .verticalSubsampling = 1,
-                     }}},
-
-                    {GBM_FORMAT_BGR888,
-                     {{
-                             .components = {{.type = android::gralloc4::PlaneLayoutComponentType_R,
-                                             .offsetInBits = 0,
-                                             .sizeInBits = 8},
-                                            {.type = android::gralloc4::PlaneLayoutComponentType_G,
-                                             .offsetInBits = 8,
-                                             .sizeInBits = 8},
-                                            {.type = android::gralloc4::PlaneLayoutComponentType_B,
-                                             .offsetInBits = 16,
-                                             .sizeInBits = 8}},
-                             .sampleIncrementInBits = 24,
-                             .horizontalSubsampling = 1,
-                             .verticalSubsampling = 1,
-                     }}},
-
-                    {GBM_FORMAT_XBGR8888,
-                     {{
-                             .components = {{.type = android::gralloc4::PlaneLayoutComponentType_R,
-                                             .offsetInBits = 0,
-                                             .sizeInBits = 8},
-                                            {.type = android::gralloc4::PlaneLayoutComponentType_G,
-                                             .offsetInBits = 8,
-                                             .sizeInBits = 8},
-                                            {.type = android::gralloc4::PlaneLayoutComponentType_B,
-                                             .offsetInBits = 16,
-                                             .sizeInBits = 8}},
-                             .sampleIncrementInBits = 32,
-                             .horizontalSubsampling = 1,
-                             .verticalSubsampling = 1,
-                     }}},
-
-                    {GBM_FORMAT_YVU420,
-                     {
-                             {
-                                     .components = {{.type = android::gralloc4::
-                                                             PlaneLayoutComponentType_Y,
-                                                     .offsetInBits = 0,
-                                                     .sizeInBits = 8}},
-                                     .sampleIncrementInBits = 8,
-                                     .horizontalSubsampling = 1,
-                                     .verticalSubsampling = 1,
-                             },
-                             {
-                                     .components = {{.type = android::gralloc4::
-                                                             PlaneLayoutComponentType_CR,
-                                                     .offsetInBits = 0,
-                                                     .sizeInBits = 8}},
-                                     .sampleIncrementInBits = 8,
-                                     .horizontalSubsampling = 2,
-                                     .verticalSubsampling = 2,
-                             },
-                             {
-                                     .components = {{.type = android::gralloc4::
-                                                             PlaneLayoutComponentType_CB,
-                                                     .offsetInBits = 0,
-                                                     .sizeInBits = 8}},
-                                     .sampleIncrementInBits = 8,
-                                     .horizontalSubsampling = 2,
-                                     .verticalSubsampling = 2,
-                             },
-                     }},
-
-                    {GBM_FORMAT_RGBX8888,
-                     {{
-                             .components = {{.type = android::gralloc4::PlaneLayoutComponentType_B,
-                                             .offsetInBits = 16,
-                                             .sizeInBits = 8},
-                                            {.type = android::gralloc4::PlaneLayoutComponentType_G,
-                                             .offsetInBits = 8,
-                                             .sizeInBits = 8},
-                                            {.type = android::gralloc4::PlaneLayoutComponentType_R,
-                                             .offsetInBits = 0,
-                                             .sizeInBits = 8}},
-                             .sampleIncrementInBits = 32,
-                             .horizontalSubsampling = 1,
-                             .verticalSubsampling = 1,
-                     }}},
-
-                    {GBM_FORMAT_XRGB8888,
-                     {{
-                             .components = {{.type = android::gralloc4::PlaneLayoutComponentType_B,
-                                             .offsetInBits = 16,
-                                             .sizeInBits = 8},
-                                            {.type = android::gralloc4::PlaneLayoutComponentType_G,
-                                             .offsetInBits = 8,
-                                             .sizeInBits = 8},
-                                            {.type = android::gralloc4::PlaneLayoutComponentType_R,
-                                             .offsetInBits = 0,
-                                             .sizeInBits = 8}},
-                             .sampleIncrementInBits = 32,
-                             .horizontalSubsampling = 1,
-                             .verticalSubsampling = 1,
-                     }}},
-
-                    // TODO: Add support for more pixel format.
-            });
-    return *kPlaneLayoutsMap;
-}
+static_assert(GRALLOC_COMPONENT_Y == static_cast<int64_t>(PlaneLayoutComponentType::Y) &&
+              GRALLOC_COMPONENT_CB == static_cast<int64_t>(PlaneLayoutComponentType::CB) &&
+              GRALLOC_COMPONENT_CR == static_cast<int64_t>(PlaneLayoutComponentType::CR) &&
+              GRALLOC_COMPONENT_R == static_cast<int64_t>(PlaneLayoutComponentType::R) &&
+              GRALLOC_COMPONENT_G == static_cast<int64_t>(PlaneLayoutComponentType::G) &&
+              GRALLOC_COMPONENT_B == static_cast<int64_t>(PlaneLayoutComponentType::B) &&
+              GRALLOC_COMPONENT_A == static_cast<int64_t>(PlaneLayoutComponentType::A),
+              "GRALLOC_COMPONENT_* must match PlaneLayoutComponentType");
 
+// The plane layouts are described by kGbmFormats in gralloc_gbm_formats.h
 int getPlaneLayouts(uint32_t gbmFormat, std::vector<PlaneLayout>* outPlaneLayouts) {
-    const auto& planeLayoutsMap = GetPlaneLayoutsMap();
-    const auto it = planeLayoutsMap.find(gbmFormat);
-    if (it == planeLayoutsMap.end()) {
+    const gralloc_gbm_format_desc_t *desc = gralloc_get_gbm_format_desc(gbmFormat);
+    if (!desc || !desc->num_planes) {
         log_e("Unknown plane layout for format %d", gbmFormat);
         return -EINVAL;
     }
 
-    *outPlaneLayouts = it->second;
+    outPlaneLayouts->resize(desc->num_planes);
+    for (size_t plane = 0; plane < desc->num_planes; plane++) {
+        const gralloc_plane_desc_t& planeDesc = desc->planes[plane];
+        PlaneLayout& planeLayout = (*outPlaneLayouts)[plane];
+
+        planeLayout.components.resize(planeDesc.num_components);
+        for (size_t comp = 0; comp < planeDesc.num_components; comp++) {
+            planeLayout.components[comp] = {
+                    .type = {GRALLOC4_STANDARD_PLANE_LAYOUT_COMPONENT_TYPE,
+                             planeDesc.components[comp].type},
+                    .offsetInBits = planeDesc.components[comp].offset_bits,
+                    .sizeInBits = planeDesc.components[comp].size_bits,
+            };
+        }
+        planeLayout.sampleIncrementInBits = planeDesc.sample_increment_bits;
+        planeLayout.horizontalSubsampling = planeDesc.horizontal_subsampling;
+        planeLayout.verticalSubsampling = planeDesc.vertical_subsampling;
+    }
     return 0;
 }
 
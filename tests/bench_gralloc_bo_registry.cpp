@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2025  Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ *
+ * Authors:
+ *      Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ */
+
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "gralloc_bo_registry.h"
+
+/*
+ * Lookup throughput of the handle registry against the single mutex map it
+ * replaced, with 1 to 16 threads and a few hundred to tens of thousands of
+ * live buffers.
+ */
+
+namespace {
+
+buffer_handle_t fakeHandle(size_t i) {
+    return reinterpret_cast<buffer_handle_t>(static_cast<uintptr_t>((i + 1) * 64));
+}
+
+struct MutexMap {
+    std::mutex mutex;
+    std::unordered_map<buffer_handle_t, int*> map;
+
+    int* lookup(buffer_handle_t handle) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = map.find(handle);
+        return it == map.end() ? nullptr : it->second;
+    }
+};
+
+constexpr size_t kMaxCount = 65536;
+std::vector<int> gValues(kMaxCount);
+
+// The handles of a benchmark, registered before any of its threads runs.
+struct Buffers {
+    GrallocHandleRegistry<int> registry;
+    MutexMap mutex_map;
+
+    explicit Buffers(size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            registry.insert(fakeHandle(i), &gValues[i]);
+            mutex_map.map.emplace(fakeHandle(i), &gValues[i]);
+        }
+    }
+};
+
+Buffers& buffers(size_t count) {
+    static Buffers small(256), medium(4096), large(kMaxCount);
+    return count <= 256 ? small : count <= 4096 ? medium : large;
+}
+
+// Forces the static buffers before the benchmarks start their threads.
+const bool gBuffersReady = (buffers(256), buffers(4096), buffers(kMaxCount), true);
+
+void BM_RegistryLookup(benchmark::State& state) {
+    const size_t count = state.range(0);
+    GrallocHandleRegistry<int>& registry = buffers(count).registry;
+
+    size_t i = state.thread_index() * 7919;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(registry.lookup(fakeHandle(i % count)));
+        i += 31;
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_RegistryLookup)->Arg(256)->Arg(4096)->Arg(kMaxCount)->ThreadRange(1, 16)->UseRealTime();
+
+void BM_MutexMapLookup(benchmark::State& state) {
+    const size_t count = state.range(0);
+    MutexMap& mutex_map = buffers(count).mutex_map;
+
+    size_t i = state.thread_index() * 7919;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(mutex_map.lookup(fakeHandle(i % count)));
+        i += 31;
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_MutexMapLookup)->Arg(256)->Arg(4096)->Arg(kMaxCount)->ThreadRange(1, 16)->UseRealTime();
+
+// Allocation and free of a buffer, one insert and one erase.
+void BM_RegistryInsertErase(benchmark::State& state) {
+    GrallocHandleRegistry<int> registry;
+    const size_t live = state.range(0);
+    for (size_t i = 0; i < live; i++)
+        registry.insert(fakeHandle(i), &gValues[i]);
+
+    size_t i = live;
+    for (auto _ : state) {
+        registry.insert(fakeHandle(i), &gValues[0]);
+        registry.erase(fakeHandle(i));
+        i++;
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_RegistryInsertErase)->Arg(256)->Arg(4096)->Arg(kMaxCount);
+
+} // namespace
+
+BENCHMARK_MAIN();
@@ -0,0 +1,143 @@
+/*
+ * Copyright (C) 2025  Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ *
+ * Authors:
+ *      Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ */
+
+#include <string.h>
+
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <hardware/gralloc.h>
+
+#include "gralloc_gbm_mesa.h"
+
+/*
+ * CPU access to a linear BO through the direct dma-buf mapping of
+ * gralloc_gbm_bo_lock(), against the gbm_bo_map() transfer of Mesa which
+ * every lock used before. Runs on the device, it needs the GPU.
+ *  - LockUnlock: the latency of a lock cycle with nothing copied.
+ *  - Copy: a lock cycle which writes a whole frame, bytes/s is the copy
+ *    throughput through the mapping.
+ */
+
+namespace {
+
+enum Path {
+    kDirect, // gralloc_gbm_bo_lock(), the mapping is kept by the map cache
+    kGbm,    // gbm_bo_map() and gbm_bo_unmap() on every cycle
+};
+
+class LinearBuffer {
+  public:
+    LinearBuffer(uint32_t width, uint32_t height) {
+        gralloc_buffer_desc_t desc = {};
+        int32_t stride;
+
+        desc.width = width;
+        desc.height = height;
+        desc.android_format = HAL_PIXEL_FORMAT_RGBA_8888;
+        // Texture usage keeps it a GBM BO rather than a dma-buf heap buffer.
+        desc.android_usage = GRALLOC_USAGE_SW_READ_OFTEN | GRALLOC_USAGE_SW_WRITE_OFTEN |
+                             GRALLOC_USAGE_HW_TEXTURE;
+        desc.layer_count = 1;
+        if (gralloc_gbm_allocator_device_init() < 0 || gralloc_allocate(&desc, &stride, &mHandle))
+            mHandle = nullptr;
+        mBo = mHandle ? gralloc_get_gbm_bo_from_handle(mHandle) : nullptr;
+    }
+    ~LinearBuffer() {
+        if (mHandle) {
+            gralloc_gm_buffer_free(mHandle);
+            native_handle_close(mHandle);
+            native_handle_delete(mHandle);
+        }
+    }
+
+    uint8_t *lock(Path path, uint32_t *stride) {
+        void *addr = nullptr;
+
+        if (path == kGbm) {
+            return static_cast<uint8_t *>(gbm_bo_map(mBo, 0, 0, width(), height(), GBM_BO_TRANSFER_READ_WRITE,
+                                                     stride, &mMapData));
+        }
+        *stride = gbm_bo_get_stride(mBo);
+        if (gralloc_gbm_bo_lock(mHandle, GRALLOC_USAGE_SW_READ_OFTEN | GRALLOC_USAGE_SW_WRITE_OFTEN,
+                                0, 0, width(), height(), &addr))
+            return nullptr;
+        return static_cast<uint8_t *>(addr);
+    }
+    void unlock(Path path) {
+        if (path == kGbm)
+            gbm_bo_unmap(mBo, mMapData);
+        else
+            gralloc_gbm_bo_unlock(mHandle);
+    }
+
+    bool valid() const { return mBo; }
+    uint32_t width() const { return gbm_bo_get_width(mBo); }
+    uint32_t height() const { return gbm_bo_get_height(mBo); }
+
+  private:
+    native_handle_t *mHandle = nullptr;
+    struct gbm_bo *mBo = nullptr;
+    void *mMapData = nullptr;
+};
+
+void lockCycle(benchmark::State& state, Path path, bool copy) {
+    LinearBuffer buffer(state.range(0), state.range(1));
+    if (!buffer.valid()) {
+        state.SkipWithError("cannot allocate a linear BO");
+        return;
+    }
+
+    const size_t row_size = (size_t)buffer.width() * 4;
+    std::vector<uint8_t> frame(row_size * buffer.height(), 0x5a);
+
+    for (auto _ : state) {
+        uint32_t stride;
+        uint8_t *addr = buffer.lock(path, &stride);
+        if (!addr) {
+            state.SkipWithError("lock failed");
+            break;
+        }
+        if (copy) {
+            for (uint32_t row = 0; row < buffer.height(); row++)
+                memcpy(addr + (size_t)row * stride, frame.data() + row * row_size, row_size);
+        }
+        benchmark::DoNotOptimize(addr);
+        buffer.unlock(path);
+    }
+
+    if (copy)
+        state.SetBytesProcessed(state.iterations() * frame.size());
+}
+
+void BM_LockUnlockDirect(benchmark::State& state) {
+    lockCycle(state, kDirect, false);
+}
+
+void BM_LockUnlockGbm(benchmark::State& state) {
+    lockCycle(state, kGbm, false);
+}
+
+void BM_CopyDirect(benchmark::State& state) {
+    lockCycle(state, kDirect, true);
+}
+
+void BM_CopyGbm(benchmark::State& state) {
+    lockCycle(state, kGbm, true);
+}
+
+// 1080p and 2160p RGBA8888
+#define GRALLOC_BENCH_SIZES ->Args({1920, 1080})->Args({3840, 2160})->Unit(benchmark::kMicrosecond)
+
+BENCHMARK(BM_LockUnlockDirect) GRALLOC_BENCH_SIZES;
+BENCHMARK(BM_LockUnlockGbm) GRALLOC_BENCH_SIZES;
+BENCHMARK(BM_CopyDirect) GRALLOC_BENCH_SIZES;
+BENCHMARK(BM_CopyGbm) GRALLOC_BENCH_SIZES;
+
+} // namespace
+
+BENCHMARK_MAIN();
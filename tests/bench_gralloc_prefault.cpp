@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2025  Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ *
+ * Authors:
+ *      Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ */
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include <benchmark/benchmark.h>
+
+#include "gralloc_gbm_prefault.h"
+
+/*
+ * The first CPU pass over a freshly locked buffer, with and without the
+ * prefault of the lock. The buffer is a memfd whose pages are allocated
+ * already, like a dma-buf: every fault only maps a page in. The time
+ * includes the prefault. "faults" is the minor page faults which the pass
+ * itself takes after the prefault.
+ */
+
+namespace {
+
+long minorFaults() {
+    struct rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    return usage.ru_minflt;
+}
+
+class Buffer {
+  public:
+    explicit Buffer(size_t size) : mSize(size) {
+        mFd = memfd_create("gralloc_prefault_bench", MFD_CLOEXEC);
+        if (mFd >= 0 && ftruncate(mFd, mSize))
+            mFd = -1;
+        // Allocate the pages once, the passes only map them.
+        void *addr = map();
+        if (addr) {
+            memset(addr, 0, mSize);
+            munmap(addr, mSize);
+        }
+    }
+    ~Buffer() {
+        if (mFd >= 0)
+            close(mFd);
+    }
+
+    void *map() {
+        void *addr = mmap(nullptr, mSize, PROT_READ | PROT_WRITE, MAP_SHARED, mFd, 0);
+        return addr == MAP_FAILED ? nullptr : addr;
+    }
+    size_t size() const { return mSize; }
+
+  private:
+    int mFd = -1;
+    size_t mSize;
+};
+
+// @prot of the prefault, PROT_NONE for none. @write the pass writes, else it reads every cache line.
+void firstPass(benchmark::State& state, int prot, bool write) {
+    Buffer buffer(state.range(0));
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    long faults = 0;
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        auto *addr = static_cast<uint8_t *>(buffer.map());
+        if (!addr) {
+            state.SkipWithError("mmap failed");
+            break;
+        }
+        state.ResumeTiming();
+
+        if (prot != PROT_NONE)
+            gralloc_prefault_range(addr, buffer.size(), prot, page_size);
+        long start = minorFaults();
+        if (write) {
+            memset(addr, 0x5a, buffer.size());
+        } else {
+            uint64_t sum = 0;
+            for (size_t i = 0; i < buffer.size(); i += 64)
+                sum += addr[i];
+            benchmark::DoNotOptimize(sum);
+        }
+
+        state.PauseTiming();
+        faults += minorFaults() - start;
+        munmap(addr, buffer.size());
+        state.ResumeTiming();
+    }
+
+    state.SetBytesProcessed(state.iterations() * buffer.size());
+    state.counters["faults"] = benchmark::Counter(faults, benchmark::Counter::kAvgIterations);
+}
+
+void BM_FirstWrite(benchmark::State& state) {
+    firstPass(state, PROT_NONE, true);
+}
+
+void BM_FirstWritePrefaulted(benchmark::State& state) {
+    firstPass(state, PROT_WRITE, true);
+}
+
+void BM_FirstRead(benchmark::State& state) {
+    firstPass(state, PROT_NONE, false);
+}
+
+void BM_FirstReadPrefaulted(benchmark::State& state) {
+    firstPass(state, PROT_READ, false);
+}
+
+// 1080p and 2160p RGBA8888
+#define GRALLOC_BENCH_SIZES ->Arg(1920 * 1080 * 4)->Arg(3840 * 2160 * 4)->Unit(benchmark::kMicrosecond)
+
+BENCHMARK(BM_FirstWrite) GRALLOC_BENCH_SIZES;
+BENCHMARK(BM_FirstWritePrefaulted) GRALLOC_BENCH_SIZES;
+BENCHMARK(BM_FirstRead) GRALLOC_BENCH_SIZES;
+BENCHMARK(BM_FirstReadPrefaulted) GRALLOC_BENCH_SIZES;
+
+} // namespace
+
+BENCHMARK_MAIN();
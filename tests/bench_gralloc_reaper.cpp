@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2025  Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ *
+ * Authors:
+ *      Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ */
+
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "gralloc_gbm_reaper.h"
+
+/*
+ * The latency which freeBuffer() sees for the BO of a buffer, with
+ * GRALLOC_REAPER_PROP on (gralloc_reaper_destroy() queues it) and off (the
+ * BO is destroyed by the caller, which is what gralloc_reaper_destroy()
+ * does then). The BOs are fakes which own a memfd of the size of the
+ * buffer, with its pages allocated and mapped: their destruction unmaps and
+ * frees the pages like the release of a shmem GEM object, without the
+ * teardown of the driver, which only adds to the inline case.
+ *
+ * The percentiles are of single calls, in microseconds.
+ */
+
+struct FakeBo {
+    int fd;
+    void *addr;
+    size_t size;
+};
+
+// The reaper, or the benchmark itself, destroys the fakes.
+void gbm_bo_destroy(struct gbm_bo *bo) {
+    auto *fake = reinterpret_cast<FakeBo *>(bo);
+    munmap(fake->addr, fake->size);
+    close(fake->fd);
+    delete fake;
+}
+
+namespace {
+
+struct gbm_bo *createBo(size_t size) {
+    auto *fake = new FakeBo{memfd_create("gralloc_reaper_bench", MFD_CLOEXEC), nullptr, size};
+    if (fake->fd < 0 || ftruncate(fake->fd, size)) {
+        delete fake;
+        return nullptr;
+    }
+    fake->addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fake->fd, 0);
+    if (fake->addr == MAP_FAILED) {
+        close(fake->fd);
+        delete fake;
+        return nullptr;
+    }
+    return reinterpret_cast<struct gbm_bo *>(fake);
+}
+
+int64_t nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+double percentileUs(std::vector<int64_t>& samples, double percentile) {
+    if (samples.empty())
+        return 0;
+    size_t rank = std::min(samples.size() - 1, (size_t)(percentile / 100 * samples.size()));
+    std::nth_element(samples.begin(), samples.begin() + rank, samples.end());
+    return samples[rank] / 1000.0;
+}
+
+void freeBuffers(benchmark::State& state, bool reaper) {
+    std::vector<int64_t> samples;
+    samples.reserve(state.max_iterations);
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        struct gbm_bo *bo = createBo(state.range(0));
+        if (!bo) {
+            state.SkipWithError("cannot create a fake BO");
+            break;
+        }
+        state.ResumeTiming();
+
+        int64_t start = nowNs();
+        if (reaper)
+            gralloc_reaper_destroy(bo);
+        else
+            gbm_bo_destroy(bo);
+        samples.push_back(nowNs() - start);
+    }
+
+    // What the worker has left must not slow the next run down, the timing is over already.
+    gralloc_reaper_drain();
+
+    state.counters["p50_us"] = percentileUs(samples, 50);
+    state.counters["p99_us"] = percentileUs(samples, 99);
+    state.counters["max_us"] = percentileUs(samples, 100);
+}
+
+void BM_FreeInline(benchmark::State& state) {
+    freeBuffers(state, false);
+}
+
+void BM_FreeReaper(benchmark::State& state) {
+    freeBuffers(state, true);
+}
+
+// 1080p and 2160p RGBA8888, a fixed count so that both see the same number of frees.
+#define GRALLOC_BENCH_SIZES \
+    ->Arg(1920 * 1080 * 4)->Arg(3840 * 2160 * 4)->Iterations(1000)->Unit(benchmark::kMicrosecond)
+
+BENCHMARK(BM_FreeInline) GRALLOC_BENCH_SIZES;
+BENCHMARK(BM_FreeReaper) GRALLOC_BENCH_SIZES;
+
+} // namespace
+
+BENCHMARK_MAIN();
@@ -0,0 +1,176 @@
+/*
+ * Copyright (C) 2025  Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ *
+ * Authors:
+ *      Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ */
+
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "gralloc_bo_lock.h"
+
+namespace {
+
+pid_t threadId() {
+    return (pid_t)syscall(SYS_gettid);
+}
+
+// The wait loop of gralloc_gbm_bo_lock(), without the mapping.
+int lockBo(GrallocBoLock& bo, bool write, std::chrono::milliseconds timeout) {
+    pid_t tid = threadId();
+    auto deadline = GrallocBoLock::Clock::now() + timeout;
+    std::unique_lock<std::mutex> lock(bo.mutex());
+    for (;;) {
+        int err = bo.check(write, tid);
+        if (err == -EDEADLK)
+            return -EBUSY;
+        if (!err) {
+            bo.acquire(write, tid);
+            return 0;
+        }
+        if (!bo.wait(lock, deadline))
+            return -EBUSY;
+    }
+}
+
+void unlockBo(GrallocBoLock& bo) {
+    std::unique_lock<std::mutex> lock(bo.mutex());
+    if (bo.release(threadId())) {
+        lock.unlock();
+        bo.notify();
+    }
+}
+
+TEST(GrallocBoLockTest, ReadersShare) {
+    GrallocBoLock bo;
+    std::unique_lock<std::mutex> lock(bo.mutex());
+    EXPECT_EQ(bo.check(false, 1), 0);
+    bo.acquire(false, 1);
+    EXPECT_EQ(bo.check(false, 2), 0);
+    bo.acquire(false, 2);
+    EXPECT_EQ(bo.count(), 2u);
+    EXPECT_EQ(bo.check(true, 3), -EAGAIN);
+    EXPECT_FALSE(bo.release(1));
+    EXPECT_TRUE(bo.release(2));
+    EXPECT_EQ(bo.check(true, 3), 0);
+}
+
+TEST(GrallocBoLockTest, ReaderCantUpgrade) {
+    GrallocBoLock bo;
+    std::unique_lock<std::mutex> lock(bo.mutex());
+    bo.acquire(false, 1);
+    bo.acquire(false, 2);
+    EXPECT_EQ(bo.check(true, 1), -EDEADLK);
+    EXPECT_EQ(bo.check(true, 2), -EDEADLK);
+    EXPECT_TRUE(bo.held(1));
+    EXPECT_FALSE(bo.held(3));
+}
+
+TEST(GrallocBoLockTest, WriterLocksAgain) {
+    GrallocBoLock bo;
+    std::unique_lock<std::mutex> lock(bo.mutex());
+    bo.acquire(true, 1);
+    EXPECT_EQ(bo.check(false, 2), -EAGAIN);
+    EXPECT_EQ(bo.check(true, 2), -EAGAIN);
+    EXPECT_EQ(bo.check(false, 1), 0);
+    bo.acquire(false, 1);
+    // The reads of the writer don't keep it from writing.
+    EXPECT_EQ(bo.check(true, 1), 0);
+    bo.acquire(true, 1);
+    EXPECT_EQ(bo.count(), 3u);
+
+    EXPECT_FALSE(bo.release(1));
+    EXPECT_FALSE(bo.release(1));
+    EXPECT_EQ(bo.check(false, 2), -EAGAIN);
+    EXPECT_TRUE(bo.release(1));
+    EXPECT_EQ(bo.check(false, 2), 0);
+}
+
+TEST(GrallocBoLockTest, OtherThreadUnlocks) {
+    GrallocBoLock bo;
+    std::unique_lock<std::mutex> lock(bo.mutex());
+    bo.acquire(false, 1);
+    bo.acquire(false, 2);
+    EXPECT_FALSE(bo.release(3));
+    EXPECT_TRUE(bo.release(3));
+    bo.acquire(true, 1);
+    EXPECT_TRUE(bo.release(2));
+}
+
+TEST(GrallocBoLockTest, UpgradeFailsWithoutWaiting) {
+    GrallocBoLock bo;
+    ASSERT_EQ(lockBo(bo, false, std::chrono::seconds(10)), 0);
+    auto start = GrallocBoLock::Clock::now();
+    EXPECT_EQ(lockBo(bo, true, std::chrono::seconds(10)), -EBUSY);
+    EXPECT_LT(GrallocBoLock::Clock::now() - start, std::chrono::seconds(1));
+    unlockBo(bo);
+    EXPECT_EQ(bo.count(), 0u);
+}
+
+TEST(GrallocBoLockTest, WaitTimesOut) {
+    GrallocBoLock bo;
+    ASSERT_EQ(lockBo(bo, true, std::chrono::milliseconds(0)), 0);
+    std::thread([&bo] {
+        EXPECT_EQ(lockBo(bo, false, std::chrono::milliseconds(0)), -EBUSY);
+        EXPECT_EQ(lockBo(bo, false, std::chrono::milliseconds(20)), -EBUSY);
+    }).join();
+    unlockBo(bo);
+}
+
+TEST(GrallocBoLockTest, ReadersAndWritersExclude) {
+    constexpr int kThreads = 8;
+    constexpr int kIterations = 2000;
+    GrallocBoLock bo;
+    std::atomic<int> readers{0}, writers{0}, max_readers{0};
+    std::atomic<bool> overlap{false};
+    std::atomic<int> failures{0};
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < kThreads; t++) {
+        threads.emplace_back([&, t] {
+            for (int i = 0; i < kIterations; i++) {
+                bool write = (i + t) % 4 == 0;
+                if (lockBo(bo, write, std::chrono::seconds(10))) {
+                    failures++;
+                    continue;
+                }
+                if (write) {
+                    if (writers.fetch_add(1) || readers.load())
+                        overlap = true;
+                    // A writer may read and write again.
+                    EXPECT_EQ(lockBo(bo, false, std::chrono::milliseconds(0)), 0);
+                    EXPECT_EQ(lockBo(bo, true, std::chrono::milliseconds(0)), 0);
+                    unlockBo(bo);
+                    unlockBo(bo);
+                    writers--;
+                } else {
+                    int n = readers.fetch_add(1) + 1;
+                    if (writers.load())
+                        overlap = true;
+                    int max = max_readers.load();
+                    while (n > max && !max_readers.compare_exchange_weak(max, n)) {
+                    }
+                    std::this_thread::yield();
+                    readers--;
+                }
+                unlockBo(bo);
+            }
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+
+    EXPECT_FALSE(overlap);
+    EXPECT_EQ(failures, 0);
+    EXPECT_EQ(bo.count(), 0u);
+    EXPECT_GE(max_readers, 1);
+}
+
+} // namespace
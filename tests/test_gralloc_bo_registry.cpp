@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2025  Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ *
+ * Authors:
+ *      Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ */
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "gralloc_bo_registry.h"
+
+namespace {
+
+// Registered handles are only compared, they are never dereferenced.
+buffer_handle_t fakeHandle(size_t i) {
+    return reinterpret_cast<buffer_handle_t>(static_cast<uintptr_t>((i + 1) * 64));
+}
+
+TEST(GrallocBoRegistryTest, InsertLookupErase) {
+    GrallocHandleRegistry<int> registry;
+    int a = 1, b = 2;
+
+    EXPECT_EQ(registry.lookup(fakeHandle(0)), nullptr);
+    EXPECT_TRUE(registry.insert(fakeHandle(0), &a));
+    EXPECT_TRUE(registry.insert(fakeHandle(1), &b));
+    EXPECT_FALSE(registry.insert(fakeHandle(0), &b));
+    EXPECT_FALSE(registry.insert(nullptr, &a));
+    EXPECT_FALSE(registry.insert(fakeHandle(2), nullptr));
+
+    EXPECT_EQ(registry.lookup(fakeHandle(0)), &a);
+    EXPECT_EQ(registry.lookup(fakeHandle(1)), &b);
+    EXPECT_TRUE(registry.contains(fakeHandle(1)));
+    EXPECT_EQ(registry.size(), 2u);
+
+    EXPECT_EQ(registry.erase(fakeHandle(0)), &a);
+    EXPECT_EQ(registry.erase(fakeHandle(0)), nullptr);
+    EXPECT_EQ(registry.lookup(fakeHandle(0)), nullptr);
+    EXPECT_EQ(registry.lookup(fakeHandle(1)), &b);
+    EXPECT_EQ(registry.size(), 1u);
+}
+
+// Growth, and the backward-shift erase keeping the probe chains whole.
+TEST(GrallocBoRegistryTest, ManyHandles) {
+    constexpr size_t kCount = 20000;
+    GrallocHandleRegistry<int> registry;
+    std::vector<int> values(kCount);
+
+    for (size_t i = 0; i < kCount; i++)
+        ASSERT_TRUE(registry.insert(fakeHandle(i), &values[i]));
+    EXPECT_EQ(registry.size(), kCount);
+
+    for (size_t i = 0; i < kCount; i += 2)
+        ASSERT_EQ(registry.erase(fakeHandle(i)), &values[i]);
+    for (size_t i = 0; i < kCount; i++)
+        ASSERT_EQ(registry.lookup(fakeHandle(i)), i % 2 ? &values[i] : nullptr) << i;
+    EXPECT_EQ(registry.size(), kCount / 2);
+}
+
+// Lookups of stable handles never miss while other handles come and go.
+TEST(GrallocBoRegistryTest, LookupsDuringWrites) {
+    constexpr size_t kStable = 1000;
+    constexpr size_t kChurn = 4000;
+    constexpr int kReaders = 4;
+    GrallocHandleRegistry<int> registry;
+    std::vector<int> values(kStable + kChurn);
+    std::atomic<bool> done{false};
+    std::atomic<int> misses{0};
+
+    for (size_t i = 0; i < kStable; i++)
+        ASSERT_TRUE(registry.insert(fakeHandle(i), &values[i]));
+
+    std::vector<std::thread> readers;
+    for (int t = 0; t < kReaders; t++) {
+        readers.emplace_back([&] {
+            while (!done.load(std::memory_order_relaxed)) {
+                for (size_t i = 0; i < kStable; i++) {
+                    if (registry.lookup(fakeHandle(i)) != &values[i])
+                        misses++;
+                }
+            }
+        });
+    }
+
+    for (int round = 0; round < 20; round++) {
+        for (size_t i = kStable; i < kStable + kChurn; i++)
+            registry.insert(fakeHandle(i), &values[i]);
+        for (size_t i = kStable; i < kStable + kChurn; i++)
+            registry.erase(fakeHandle(i));
+    }
+    done = true;
+    for (auto& reader : readers)
+        reader.join();
+
+    EXPECT_EQ(misses, 0);
+    EXPECT_EQ(registry.size(), kStable);
+}
+
+} // namespace
@@ -0,0 +1,173 @@
+/*
+ * Copyright (C) 2025  Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ *
+ * Authors:
+ *      Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ */
+
+#include <stdlib.h>
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "gralloc_gbm_format_caps.h"
+
+namespace {
+
+const uint32_t kRenderClass = 1u << gralloc_format_caps_class(GBM_BO_USE_RENDERING);
+const uint32_t kLinearClass = 1u << gralloc_format_caps_class(GBM_BO_USE_LINEAR);
+
+class GrallocFormatCapsTest : public ::testing::Test {
+  protected:
+    void SetUp() override {
+        gralloc_format_caps_init(&mCaps, "fake:fakedrm-1.0.0-20250101:fingerprint");
+        memset(mCaps.caps, 0, sizeof(mCaps.caps));
+    }
+
+    void allow(uint32_t gbm_format, uint32_t classes) {
+        const gralloc_gbm_format_desc_t *desc = gralloc_get_gbm_format_desc(gbm_format);
+        ASSERT_NE(desc, nullptr);
+        mCaps.caps[desc - gralloc_formats::kGbmFormats].classes |= (uint16_t)classes;
+    }
+
+    gralloc_format_caps_file_t mCaps;
+};
+
+TEST_F(GrallocFormatCapsTest, ClassesRoundTrip) {
+    for (uint32_t cls = 0; cls < GRALLOC_CAPS_NUM_CLASSES; cls++)
+        EXPECT_EQ(gralloc_format_caps_class(gralloc_format_caps_class_to_flags(cls)), cls);
+    // The flags which don't change the answer of GBM are no class of their own.
+    EXPECT_EQ(gralloc_format_caps_class(GBM_BO_USE_RENDERING | GBM_BO_USE_WRITE),
+              gralloc_format_caps_class(GBM_BO_USE_RENDERING));
+}
+
+TEST_F(GrallocFormatCapsTest, ProbedFormats) {
+    allow(GBM_FORMAT_ABGR8888, kRenderClass);
+
+    EXPECT_TRUE(gralloc_format_caps_supported(&mCaps, HAL_PIXEL_FORMAT_RGBA_8888, GBM_BO_USE_RENDERING));
+    EXPECT_FALSE(gralloc_format_caps_supported(&mCaps, HAL_PIXEL_FORMAT_RGBA_8888, GBM_BO_USE_LINEAR));
+    EXPECT_FALSE(gralloc_format_caps_supported(&mCaps, HAL_PIXEL_FORMAT_RGB_565, GBM_BO_USE_RENDERING));
+    EXPECT_FALSE(gralloc_format_caps_supported(&mCaps, 0x7fffffff, GBM_BO_USE_RENDERING));
+}
+
+// The most common buffers of SurfaceFlinger and the camera: GBM resolves the format.
+TEST_F(GrallocFormatCapsTest, ImplementationDefinedIsLeftToGbm) {
+    EXPECT_EQ(gralloc_format_caps_find(&mCaps, GRALLOC_GBM_FORMAT_IMPL_DEFINED), nullptr);
+    for (uint32_t cls = 0; cls < GRALLOC_CAPS_NUM_CLASSES; cls++) {
+        EXPECT_TRUE(gralloc_format_caps_supported(&mCaps, HAL_PIXEL_FORMAT_IMPLEMENTATION_DEFINED,
+                                                  gralloc_format_caps_class_to_flags(cls)));
+    }
+}
+
+TEST_F(GrallocFormatCapsTest, Ycbcr420888) {
+    const int format = HAL_PIXEL_FORMAT_YCbCr_420_888;
+
+    EXPECT_FALSE(gralloc_format_caps_supported(&mCaps, format, GBM_BO_USE_LINEAR));
+
+    // A driver without NV12 gets the R8 stand-in, which is linear.
+    allow(GBM_FORMAT_R8, kLinearClass);
+    EXPECT_TRUE(gralloc_format_caps_supported(&mCaps, format, GBM_BO_USE_LINEAR));
+    EXPECT_FALSE(gralloc_format_caps_supported(&mCaps, format, GBM_BO_USE_RENDERING));
+
+    allow(GBM_FORMAT_NV12, kRenderClass);
+    EXPECT_TRUE(gralloc_format_caps_supported(&mCaps, format, GBM_BO_USE_RENDERING));
+}
+
+class GrallocFormatCapsFileTest : public GrallocFormatCapsTest {
+  protected:
+    void SetUp() override {
+        GrallocFormatCapsTest::SetUp();
+        const char *tmp = getenv("TMPDIR");
+        mDir = std::string(tmp ? tmp : "/tmp") + "/gralloc_caps_XXXXXX";
+        ASSERT_NE(mkdtemp(mDir.data()), nullptr);
+        // The parent directory of the file is created by the save.
+        mPath = mDir + "/gralloc/format_caps";
+    }
+
+    void TearDown() override {
+        unlink(mPath.c_str());
+        rmdir((mDir + "/gralloc").c_str());
+        rmdir(mDir.c_str());
+    }
+
+    // Load the caps of a device with the key, or probe them: RGBA8888 renders.
+    bool loadOrProbe(const char *key) {
+        int save_err;
+        gralloc_format_caps_init(&mCaps, key);
+        memset(mCaps.caps, 0xff, sizeof(mCaps.caps));
+        bool probed = gralloc_format_caps_load_or_probe(mPath.c_str(), &mCaps, [this](gralloc_format_caps_file_t *) {
+            mProbes++;
+            allow(GBM_FORMAT_ABGR8888, kRenderClass);
+        }, &save_err);
+        EXPECT_EQ(save_err, 0);
+        return probed;
+    }
+
+    void rewriteHeader(void (*edit)(gralloc_format_caps_file_t *)) {
+        gralloc_format_caps_file_t file;
+        int fd = open(mPath.c_str(), O_RDWR);
+        ASSERT_GE(fd, 0);
+        ASSERT_EQ(pread(fd, &file, sizeof(file), 0), (ssize_t)sizeof(file));
+        edit(&file);
+        ASSERT_EQ(pwrite(fd, &file, sizeof(file), 0), (ssize_t)sizeof(file));
+        close(fd);
+    }
+
+    std::string mDir;
+    std::string mPath;
+    int mProbes = 0;
+};
+
+constexpr char kKey[] = "fake:fakedrm-1.0.0-20250101:fingerprint";
+
+TEST_F(GrallocFormatCapsFileTest, ProbedOnceThenLoaded) {
+    EXPECT_TRUE(loadOrProbe(kKey));
+    EXPECT_FALSE(loadOrProbe(kKey));
+    EXPECT_EQ(mProbes, 1);
+
+    // The loaded caps are the probed ones, not what was in memory.
+    EXPECT_TRUE(gralloc_format_caps_supported(&mCaps, HAL_PIXEL_FORMAT_RGBA_8888, GBM_BO_USE_RENDERING));
+    EXPECT_FALSE(gralloc_format_caps_supported(&mCaps, HAL_PIXEL_FORMAT_RGBA_8888, GBM_BO_USE_LINEAR));
+    EXPECT_FALSE(gralloc_format_caps_supported(&mCaps, HAL_PIXEL_FORMAT_RGB_565, GBM_BO_USE_RENDERING));
+}
+
+TEST_F(GrallocFormatCapsFileTest, OtherBuildProbesAgain) {
+    EXPECT_TRUE(loadOrProbe(kKey));
+    EXPECT_TRUE(loadOrProbe("fake:fakedrm-1.0.0-20250101:other-fingerprint"));
+    EXPECT_TRUE(loadOrProbe("fake:fakedrm-1.1.0-20250101:other-fingerprint"));
+    EXPECT_FALSE(loadOrProbe("fake:fakedrm-1.1.0-20250101:other-fingerprint"));
+    EXPECT_EQ(mProbes, 3);
+}
+
+TEST_F(GrallocFormatCapsFileTest, OtherLayoutProbesAgain) {
+    EXPECT_TRUE(loadOrProbe(kKey));
+    rewriteHeader([](gralloc_format_caps_file_t *file) { file->layout_hash ^= 1; });
+    EXPECT_TRUE(loadOrProbe(kKey));
+
+    rewriteHeader([](gralloc_format_caps_file_t *file) { file->num_formats--; });
+    EXPECT_TRUE(loadOrProbe(kKey));
+
+    rewriteHeader([](gralloc_format_caps_file_t *file) { file->version++; });
+    EXPECT_TRUE(loadOrProbe(kKey));
+    EXPECT_EQ(mProbes, 4);
+}
+
+TEST_F(GrallocFormatCapsFileTest, TruncatedFileProbesAgain) {
+    EXPECT_TRUE(loadOrProbe(kKey));
+    ASSERT_EQ(truncate(mPath.c_str(), sizeof(gralloc_format_caps_file_t) - 1), 0);
+    EXPECT_TRUE(loadOrProbe(kKey));
+    EXPECT_FALSE(loadOrProbe(kKey));
+    EXPECT_EQ(mProbes, 2);
+}
+
+// Whatever the file holds, the formats without caps stay up to GBM.
+TEST_F(GrallocFormatCapsFileTest, LoadedCapsLeaveImplementationDefinedToGbm) {
+    EXPECT_TRUE(loadOrProbe(kKey));
+    EXPECT_FALSE(loadOrProbe(kKey));
+    EXPECT_TRUE(gralloc_format_caps_supported(&mCaps, HAL_PIXEL_FORMAT_IMPLEMENTATION_DEFINED,
+                                              GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING));
+    EXPECT_TRUE(gralloc_format_caps_supported(&mCaps, HAL_PIXEL_FORMAT_IMPLEMENTATION_DEFINED, 0));
+}
+
+} // namespace
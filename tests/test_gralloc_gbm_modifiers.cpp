@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2025  Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ *
+ * Authors:
+ *      Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ */
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "gralloc_gbm_modifiers.h"
+
+namespace {
+
+/*
+ * Fake backends, as the format caps would record them: which of
+ * kGrallocCapsModifiers the device supports for a format.
+ */
+constexpr uint32_t kAllModifiers = (1u << GRALLOC_CAPS_NUM_MODIFIERS) - 1;
+constexpr uint32_t kMaliCaps = kAllModifiers;                      // panfrost, RGBA8888
+constexpr uint32_t kDisplayCaps = GRALLOC_CAPS_LINEAR_MODIFIER;    // a display-only KMS driver
+constexpr uint32_t kTiledOnlyCaps = 1u << (GRALLOC_CAPS_NUM_MODIFIERS - 1); // u-interleaved only
+
+std::vector<uint64_t> select(uint32_t supported, uint32_t flags, int usage,
+                             bool uncompressed = false, bool scanout_compression = false) {
+    uint64_t modifiers[GRALLOC_CAPS_NUM_MODIFIERS];
+    uint32_t count = gralloc_modifiers_select(supported, flags, usage, uncompressed,
+                                              scanout_compression, modifiers);
+    return std::vector<uint64_t>(modifiers, modifiers + count);
+}
+
+std::vector<uint64_t> linear() {
+    return {DRM_FORMAT_MOD_LINEAR};
+}
+
+std::vector<uint64_t> all() {
+    return std::vector<uint64_t>(std::begin(kGrallocCapsModifiers), std::end(kGrallocCapsModifiers));
+}
+
+std::vector<uint64_t> uncompressed() {
+    std::vector<uint64_t> modifiers;
+    for (uint64_t modifier : kGrallocCapsModifiers) {
+        if (!gralloc_modifier_is_compressed(modifier))
+            modifiers.push_back(modifier);
+    }
+    return modifiers;
+}
+
+TEST(GrallocGbmModifiersTest, CpuUsageIsLinear) {
+    EXPECT_EQ(select(kMaliCaps, 0, GRALLOC_USAGE_SW_READ_OFTEN | GRALLOC_USAGE_HW_TEXTURE), linear());
+    EXPECT_EQ(select(kMaliCaps, 0, GRALLOC_USAGE_SW_WRITE_RARELY | GRALLOC_USAGE_HW_RENDER), linear());
+    EXPECT_EQ(select(kMaliCaps, 0, GRALLOC_USAGE_CURSOR), linear());
+    EXPECT_EQ(select(kMaliCaps, GBM_BO_USE_LINEAR, GRALLOC_USAGE_HW_TEXTURE), linear());
+}
+
+TEST(GrallocGbmModifiersTest, GpuOnlyGetsEveryLayout) {
+    EXPECT_EQ(select(kMaliCaps, GBM_BO_USE_RENDERING, GRALLOC_USAGE_HW_RENDER | GRALLOC_USAGE_HW_TEXTURE), all());
+    EXPECT_EQ(select(kMaliCaps, 0, GRALLOC_USAGE_HW_TEXTURE | GRALLOC_USAGE_PROTECTED), all());
+}
+
+TEST(GrallocGbmModifiersTest, OtherConsumersAreLinear) {
+    EXPECT_EQ(select(kMaliCaps, 0, GRALLOC_USAGE_HW_TEXTURE | GRALLOC_USAGE_HW_VIDEO_ENCODER), linear());
+    EXPECT_EQ(select(kMaliCaps, 0, GRALLOC_USAGE_HW_RENDER | GRALLOC_USAGE_HW_CAMERA_WRITE), linear());
+    EXPECT_EQ(select(kMaliCaps, 0, GRALLOC_USAGE_HW_2D), linear());
+    EXPECT_EQ(select(kMaliCaps, 0, 0), linear());
+}
+
+TEST(GrallocGbmModifiersTest, ScanoutCompression) {
+    const int usage = GRALLOC_USAGE_HW_RENDER | GRALLOC_USAGE_HW_COMPOSER;
+    EXPECT_EQ(select(kMaliCaps, GBM_BO_USE_SCANOUT, usage), linear());
+    EXPECT_EQ(select(kMaliCaps, GBM_BO_USE_SCANOUT, usage, false, true), all());
+    EXPECT_EQ(select(kMaliCaps, GBM_BO_USE_SCANOUT, GRALLOC_USAGE_HW_FB, false, true), all());
+}
+
+TEST(GrallocGbmModifiersTest, Uncompressed) {
+    const int usage = GRALLOC_USAGE_HW_RENDER | GRALLOC_USAGE_HW_TEXTURE;
+    EXPECT_EQ(select(kMaliCaps, 0, usage, true), uncompressed());
+    EXPECT_EQ(select(kMaliCaps, GBM_BO_USE_FRONT_RENDERING, usage), uncompressed());
+    EXPECT_EQ(select(kMaliCaps, GBM_BO_USE_FRONT_RENDERING, GRALLOC_USAGE_HW_COMPOSER, false, true),
+              uncompressed());
+}
+
+// Only the layouts which the backend supports for the format are offered.
+TEST(GrallocGbmModifiersTest, BackendCaps) {
+    const int gpu_usage = GRALLOC_USAGE_HW_RENDER | GRALLOC_USAGE_HW_TEXTURE;
+    EXPECT_EQ(select(kDisplayCaps, 0, gpu_usage), linear());
+    EXPECT_EQ(select(kTiledOnlyCaps, 0, gpu_usage),
+              std::vector<uint64_t>{DRM_FORMAT_MOD_ARM_16X16_BLOCK_U_INTERLEAVED});
+    // Nothing left to offer, the driver decides.
+    EXPECT_TRUE(select(kTiledOnlyCaps, 0, GRALLOC_USAGE_SW_READ_OFTEN).empty());
+    EXPECT_TRUE(select(0, 0, gpu_usage).empty());
+}
+
+} // namespace
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2025  Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ *
+ * Authors:
+ *      Levi Marvin (LIU, YUANCHEN) <levimarvin@icloud.com>
+ */
+
+#include <gtest/gtest.h>
+
+#include <drm/gralloc_handle.h>
+
+namespace {
+
+/*
+ * A handle as another process would send it: the room of numInts, with the
+ * fields of a version. The storage is always large enough for the struct,
+ * only what numInts says counts.
+ */
+class FakeHandle {
+  public:
+    FakeHandle(uint32_t version, int num_ints) {
+        mHandle.base.version = sizeof(native_handle_t);
+        mHandle.base.numFds = GRALLOC_HANDLE_NUM_FDS;
+        mHandle.base.numInts = num_ints;
+        mHandle.prime_fd = -1;
+        mHandle.magic = GRALLOC_HANDLE_MAGIC;
+        mHandle.version = version;
+    }
+
+    // numInts of an allocator which had the version.
+    static int numInts(uint32_t version) {
+        return (int)((gralloc_handle_version_size(version) + sizeof(int) - 1) / sizeof(int)) -
+               GRALLOC_HANDLE_NUM_FDS;
+    }
+
+    native_handle_t *get() { return &mHandle.base; }
+    struct gralloc_handle_t *handle() { return &mHandle; }
+
+  private:
+    struct gralloc_handle_t mHandle = {};
+};
+
+TEST(GrallocHandleTest, CurrentVersion) {
+    FakeHandle handle(GRALLOC_HANDLE_VERSION, GRALLOC_HANDLE_NUM_INTS);
+    EXPECT_TRUE(gralloc_handle_validate(handle.get()));
+    EXPECT_EQ(gralloc_handle_version_size(GRALLOC_HANDLE_VERSION),
+              offsetof(struct gralloc_handle_t, buffer_id) + sizeof(uint64_t) - sizeof(native_handle_t));
+}
+
+TEST(GrallocHandleTest, EveryVersionWithItsOwnSize) {
+    for (uint32_t version = 3; version <= GRALLOC_HANDLE_VERSION; version++) {
+        FakeHandle handle(version, FakeHandle::numInts(version));
+        EXPECT_TRUE(gralloc_handle_validate(handle.get())) << "version " << version;
+
+        FakeHandle short_handle(version, FakeHandle::numInts(version) - 1);
+        EXPECT_FALSE(gralloc_handle_validate(short_handle.get())) << "version " << version;
+    }
+}
+
+// A handle which claims a later version than its size allows is refused.
+TEST(GrallocHandleTest, ForgedVersion) {
+    for (uint32_t version = 5; version <= GRALLOC_HANDLE_VERSION; version++) {
+        FakeHandle handle(version, FakeHandle::numInts(version - 1));
+        if (gralloc_handle_version_size(version) > gralloc_handle_version_size(version - 1)) {
+            EXPECT_FALSE(gralloc_handle_validate(handle.get())) << "version " << version;
+        }
+    }
+    FakeHandle future(GRALLOC_HANDLE_VERSION + 1, FakeHandle::numInts(4));
+    EXPECT_FALSE(gralloc_handle_validate(future.get()));
+}
+
+TEST(GrallocHandleTest, NotAGrallocHandle) {
+    EXPECT_FALSE(gralloc_handle_validate(nullptr));
+
+    FakeHandle magic(GRALLOC_HANDLE_VERSION, GRALLOC_HANDLE_NUM_INTS);
+    magic.handle()->magic = 0;
+    EXPECT_FALSE(gralloc_handle_validate(magic.get()));
+
+    FakeHandle no_fd(GRALLOC_HANDLE_VERSION, GRALLOC_HANDLE_NUM_INTS);
+    no_fd.get()->numFds = 0;
+    EXPECT_FALSE(gralloc_handle_validate(no_fd.get()));
+
+    FakeHandle two_fds(GRALLOC_HANDLE_VERSION, GRALLOC_HANDLE_NUM_INTS - 1);
+    two_fds.get()->numFds = 2;
+    EXPECT_FALSE(gralloc_handle_validate(two_fds.get()));
+
+    FakeHandle negative(GRALLOC_HANDLE_VERSION, -1);
+    EXPECT_FALSE(gralloc_handle_validate(negative.get()));
+
+    // Too short for the magic and the version
+    FakeHandle empty(GRALLOC_HANDLE_VERSION, 0);
+    EXPECT_FALSE(gralloc_handle_validate(empty.get()));
+}
+
+} // namespace